@@ -0,0 +1,322 @@
+//
+//  main.cpp
+//  opencl-language-server-bench
+//
+
+#include <benchmark/benchmark.h>
+
+#include "clinfo.hpp"
+#include "diagnostics.hpp"
+#include "jsonrpc.hpp"
+#include "jsonscan.hpp"
+#include "lineindex.hpp"
+#include "methods.hpp"
+#include "opencl_mock.hpp"
+#include "utils.hpp"
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/null_sink.h>
+
+using namespace ocls;
+using namespace nlohmann;
+
+namespace {
+
+std::string BuildRequest(
+    const std::string& content, const std::string& contentType = "application/vscode-jsonrpc;charset=utf-8")
+{
+    std::string request;
+    request.append("Content-Length: " + std::to_string(content.size()) + "\r\n");
+    request.append("Content-Type: " + contentType + "\r\n");
+    request.append("\r\n");
+    request.append(content);
+    return request;
+}
+
+void Send(const std::string& request, JsonRPC& jrpc)
+{
+    for (auto c : request)
+        jrpc.Consume(c);
+}
+
+std::string GenerateKernel(size_t size)
+{
+    const std::string line = "    output[get_global_id(0)] = input[get_global_id(0)] * 2.0f; // scale\n";
+    std::string text = "__kernel void scale(__global const float* input, __global float* output)\n{\n";
+    while (text.size() + line.size() < size)
+        text.append(line);
+    text.append("}\n");
+    return text;
+}
+
+std::string GenerateBuildLog(size_t problems)
+{
+    std::string log;
+    for (size_t i = 0; i < problems; ++i)
+    {
+        log.append("<program source>:" + std::to_string(i + 1) + ":" + std::to_string(i % 80 + 1) + ": ");
+        log.append(i % 4 == 0 ? "error: " : "warning: ");
+        log.append("implicit conversion from 'double' to 'float' may lose precision\n");
+        log.append("    output[get_global_id(0)] = input[get_global_id(0)] * 2.0;\n");
+        log.append("                                                         ^\n");
+    }
+    return log;
+}
+
+void InitializeJsonRPC(JsonRPC& jrpc)
+{
+    jrpc.RegisterOutputCallback([](const std::string&) {});
+    jrpc.RegisterMethodCallback("initialize", [](const json&) {});
+    Send(
+        BuildRequest(json::object(
+                         {{"jsonrpc", "2.0"},
+                          {"id", 0},
+                          {"method", "initialize"},
+                          {"params", {{"processId", 60650}, {"trace", "off"}}}})
+                         .dump()),
+        jrpc);
+    jrpc.Reset();
+}
+
+} // namespace
+
+static void BM_JsonRPCConsume(benchmark::State& state)
+{
+    const auto text = GenerateKernel(static_cast<size_t>(state.range(0)));
+    const auto request = BuildRequest(json::object(
+                                          {{"jsonrpc", "2.0"},
+                                           {"method", "textDocument/didChange"},
+                                           {"params",
+                                            {{"textDocument", {{"uri", "file:///kernel.cl"}, {"version", 1}}},
+                                             {"contentChanges", json::array({{{"text", text}}})}}}})
+                                          .dump());
+    JsonRPC jrpc;
+    InitializeJsonRPC(jrpc);
+    jrpc.RegisterMethodCallback("textDocument/didChange", [](const json& data) { benchmark::DoNotOptimize(&data); });
+    for (auto _ : state)
+    {
+        Send(request, jrpc);
+        jrpc.Reset();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * request.size()));
+}
+BENCHMARK(BM_JsonRPCConsume)->Arg(256)->Arg(1 << 20)->Arg(4 << 20)->Unit(benchmark::kMicrosecond);
+
+// The same 'didOpen' request as JSON text (0), CBOR (1) and MessagePack (2)
+static void BM_JsonRPCDidOpenEncoding(benchmark::State& state)
+{
+    const json body = {
+        {"jsonrpc", "2.0"},
+        {"method", "textDocument/didOpen"},
+        {"params",
+         {{"textDocument",
+           {{"uri", "file:///kernel.cl"},
+            {"languageId", "opencl"},
+            {"version", 1},
+            {"text", GenerateKernel(static_cast<size_t>(state.range(0)))}}}}}};
+    std::string request;
+    switch (state.range(1))
+    {
+        case 1: {
+            const auto content = json::to_cbor(body);
+            request = BuildRequest(std::string(content.begin(), content.end()), "application/cbor");
+            break;
+        }
+        case 2: {
+            const auto content = json::to_msgpack(body);
+            request = BuildRequest(std::string(content.begin(), content.end()), "application/msgpack");
+            break;
+        }
+        default:
+            request = BuildRequest(body.dump());
+            break;
+    }
+    JsonRPC jrpc;
+    InitializeJsonRPC(jrpc);
+    jrpc.RegisterMethodCallback("textDocument/didOpen", [](const json& data) { benchmark::DoNotOptimize(&data); });
+    for (auto _ : state)
+    {
+        jrpc.Consume(request.data(), request.size());
+        jrpc.Reset();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * request.size()));
+}
+BENCHMARK(BM_JsonRPCDidOpenEncoding)
+    ->ArgsProduct({{1 << 20, 4 << 20}, {0, 1, 2}})
+    ->ArgNames({"size", "encoding"})
+    ->Unit(benchmark::kMicrosecond);
+
+// A 'didChange' request parsed by nlohmann::json (0) and by the SIMD path for document texts (1)
+static void BM_ParseDocumentMessage(benchmark::State& state)
+{
+    const auto body = json::object(
+                          {{"jsonrpc", "2.0"},
+                           {"method", "textDocument/didChange"},
+                           {"params",
+                            {{"textDocument", {{"uri", "file:///kernel.cl"}, {"version", 2}}},
+                             {"contentChanges",
+                              json::array({{{"text", GenerateKernel(static_cast<size_t>(state.range(0)))}}})}}}})
+                          .dump();
+    const bool isScan = state.range(1) != 0;
+    json message;
+    for (auto _ : state)
+    {
+        if (!isScan || !jsonscan::ParseDocumentMessage(body, message))
+            message = json::parse(body);
+        benchmark::DoNotOptimize(message);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * body.size()));
+}
+BENCHMARK(BM_ParseDocumentMessage)
+    ->ArgsProduct({{64 << 10, 1 << 20, 4 << 20}, {0, 1}})
+    ->ArgNames({"size", "scan"})
+    ->Unit(benchmark::kMicrosecond);
+
+// Reindexing a document after a one character edit in its middle: rebuilt (0) and updated (1)
+static void BM_LineIndexEdit(benchmark::State& state)
+{
+    const auto text = GenerateKernel(static_cast<size_t>(state.range(0)));
+    auto edited = text;
+    edited.insert(edited.size() / 2, "x");
+    const bool isUpdate = state.range(1) != 0;
+    LineIndex index(text);
+    bool isEdited = false;
+    for (auto _ : state)
+    {
+        const auto& previous = isEdited ? edited : text;
+        const auto& next = isEdited ? text : edited;
+        if (isUpdate)
+            index.Update(previous, next);
+        else
+            index = LineIndex(next);
+        isEdited = !isEdited;
+        benchmark::DoNotOptimize(index);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * text.size()));
+}
+BENCHMARK(BM_LineIndexEdit)
+    ->ArgsProduct({{64 << 10, 1 << 20}, {0, 1}})
+    ->ArgNames({"size", "update"})
+    ->Unit(benchmark::kMicrosecond);
+
+// Converting the byte columns of a non-ASCII line to UTF-16
+static void BM_LineIndexGetCharacter(benchmark::State& state)
+{
+    std::string text = GenerateKernel(64 << 10);
+    text.append("    // \u00e9\u00e9 comment with accents \u00e9 and more text after them\n");
+    const LineIndex index(text);
+    const auto line = static_cast<uint32_t>(index.GetLineCount() - 2);
+    uint64_t sum = 0;
+    for (auto _ : state)
+    {
+        for (size_t column = 0; column < 64; column += 8)
+            sum += index.GetCharacter(text, line, column, PositionEncoding::Utf16);
+    }
+    benchmark::DoNotOptimize(sum);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * 8));
+}
+BENCHMARK(BM_LineIndexGetCharacter);
+
+static void BM_FindMethod(benchmark::State& state)
+{
+    size_t found = 0;
+    for (auto _ : state)
+    {
+        for (auto name : methods::names)
+        {
+            benchmark::DoNotOptimize(name);
+            found += methods::Find(name).has_value();
+        }
+    }
+    benchmark::DoNotOptimize(found);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * methods::count));
+}
+BENCHMARK(BM_FindMethod);
+
+static void BM_JsonRPCWrite(benchmark::State& state)
+{
+    JsonRPC jrpc;
+    size_t written = 0;
+    jrpc.RegisterOutputCallback([&written](const std::string& message) { written += message.size(); });
+    const json response = {{"id", 1}, {"result", {{"capabilities", {{"textDocumentSync", 1}}}}}};
+    for (auto _ : state)
+        jrpc.Write(response);
+    state.SetBytesProcessed(static_cast<int64_t>(written));
+}
+BENCHMARK(BM_JsonRPCWrite);
+
+static void BM_DiagnosticsGet(benchmark::State& state)
+{
+    mock::SetBuildLog(GenerateBuildLog(static_cast<size_t>(state.range(0))));
+    auto diagnostics = CreateDiagnostics(CreateCLInfo());
+    diagnostics->SetMaxProblemsCount(static_cast<int>(state.range(0)));
+    const Source source {"/kernels/kernel.cl", MakeSharedText(GenerateKernel(4096)), {}};
+    try
+    {
+        for (auto _ : state)
+            benchmark::DoNotOptimize(diagnostics->Get(source));
+    }
+    catch (const std::exception& err)
+    {
+        state.SkipWithError(err.what());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    mock::Reset();
+}
+BENCHMARK(BM_DiagnosticsGet)->Arg(10)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+static void BM_SplitString(benchmark::State& state)
+{
+    const auto text = GenerateKernel(64 << 10);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(utils::SplitString(text, "\n"));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * text.size()));
+}
+BENCHMARK(BM_SplitString);
+
+static void BM_UriToPath(benchmark::State& state)
+{
+    const std::string uri = "file:///home/user/My%20Projects/opencl/kernels/image%20filters/gaussian_blur.cl";
+    for (auto _ : state)
+        benchmark::DoNotOptimize(utils::UriToPath(uri));
+}
+BENCHMARK(BM_UriToPath);
+
+static void BM_CRC32(benchmark::State& state)
+{
+    const auto text = GenerateKernel(static_cast<size_t>(state.range(0)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(utils::CRC32(text.begin(), text.end()));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * text.size()));
+}
+BENCHMARK(BM_CRC32)->Arg(4 << 10)->Arg(1 << 20);
+
+static void BM_CLInfoJSON(benchmark::State& state)
+{
+    auto clinfo = CreateCLInfo();
+    for (auto _ : state)
+        benchmark::DoNotOptimize(clinfo->json());
+}
+BENCHMARK(BM_CLInfoJSON)->Unit(benchmark::kMicrosecond);
+
+int main(int argc, char** argv)
+{
+    auto sink = std::make_shared<spdlog::sinks::null_sink_st>();
+    auto mainLogger = std::make_shared<spdlog::logger>("opencl-language-server", sink);
+    auto clinfoLogger = std::make_shared<spdlog::logger>("clinfo", sink);
+    auto diagnosticsLogger = std::make_shared<spdlog::logger>("diagnostics", sink);
+    auto jsonrpcLogger = std::make_shared<spdlog::logger>("jrpc", sink);
+    auto lspLogger = std::make_shared<spdlog::logger>("lsp", sink);
+    spdlog::set_default_logger(mainLogger);
+    spdlog::register_logger(clinfoLogger);
+    spdlog::register_logger(diagnosticsLogger);
+    spdlog::register_logger(jsonrpcLogger);
+    spdlog::register_logger(lspLogger);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
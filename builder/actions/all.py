@@ -24,6 +24,18 @@ class AllAction(Action):
             action="store_true",
             help="configure test target",
         )
+        subparser.add_argument(
+            "-wb",
+            "--with-benchmarks",
+            action="store_true",
+            help="configure benchmark target",
+        )
+        subparser.add_argument(
+            "-wt",
+            "--with-tools",
+            action="store_true",
+            help="configure development tools targets",
+        )
         subparser.add_argument(
             "-v",
             "--verbose",
@@ -41,6 +41,12 @@ class ConanInstallAction(Action):
             action="store_true",
             help="install test-related requirements",
         )
+        subparser.add_argument(
+            "-wb",
+            "--with-benchmarks",
+            action="store_true",
+            help="install benchmark-related requirements",
+        )
 
     def execute(self, args):
         self.controller.install_conan_dependencies(
@@ -48,5 +54,6 @@ class ConanInstallAction(Action):
             args.build_profile,
             args.output_folder,
             args.with_tests,
+            args.with_benchmarks,
             args.clean,
         )
@@ -9,7 +9,13 @@ class ConanInstallController(object):
         self.conan = Conan()
 
     def install_conan_dependencies(
-        self, host_profile, build_profile, output_folder, with_tests, clean=False
+        self,
+        host_profile,
+        build_profile,
+        output_folder,
+        with_tests,
+        with_benchmarks=False,
+        clean=False,
     ):
         logging.debug(
             f"Installing Conan dependencies for profile host:'{host_profile}', build:'{build_profile}'..."
@@ -17,7 +23,7 @@ class ConanInstallController(object):
         self.__validate_install_dir(Path(output_folder), clean)
         self.conan.check_availability()
         self.conan.install_dependencies(
-            host_profile, build_profile, output_folder, with_tests
+            host_profile, build_profile, output_folder, with_tests, with_benchmarks
         )
 
     def __validate_install_dir(self, output_folder: Path, clean: bool):
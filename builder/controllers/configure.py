@@ -10,6 +10,8 @@ class ConfigureController(object):
         "build_folder",
         "toolchain_path",
         "with_tests",
+        "with_benchmarks",
+        "with_tools",
         "verbose",
     ]
 
@@ -23,5 +25,7 @@ class ConfigureController(object):
             self.build_folder,
             self.toolchain_path,
             self.with_tests,
+            self.with_benchmarks,
+            self.with_tools,
             self.verbose,
         )
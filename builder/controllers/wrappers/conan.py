@@ -7,7 +7,7 @@ class Conan(Wrapper):
         super(Conan, self).__init__("conan")
 
     def install_dependencies(
-        self, host_profile, build_profile, install_folder, with_tests
+        self, host_profile, build_profile, install_folder, with_tests, with_benchmarks
     ):
         exec(
             [
@@ -16,7 +16,9 @@ class Conan(Wrapper):
                 ".",
                 "--update",
                 f"--output-folder={install_folder}",
-                *self.__get_configuration_args(host_profile, build_profile, with_tests),
+                *self.__get_configuration_args(
+                    host_profile, build_profile, with_tests, with_benchmarks
+                ),
             ],
             check=True,
         )
@@ -32,7 +34,9 @@ class Conan(Wrapper):
             check=True,
         )
 
-    def __get_configuration_args(self, host_profile, build_profile, with_tests=False):
+    def __get_configuration_args(
+        self, host_profile, build_profile, with_tests=False, with_benchmarks=False
+    ):
         args = [
             f"--profile:host={host_profile}",
             f"--profile:build={build_profile}",
@@ -45,4 +49,11 @@ class Conan(Wrapper):
                     "opencl_language_server/*:enable_testing=True",
                 ]
             )
+        if with_benchmarks:
+            args.extend(
+                [
+                    "-o",
+                    "opencl_language_server/*:enable_benchmarks=True",
+                ]
+            )
         return args
@@ -17,8 +17,12 @@ class OpenCLLanguageServerConanfile(ConanFile):
     topics = ("opencl", "language-server")
     settings = "os", "compiler", "build_type", "arch"
     generators = "CMakeToolchain", "CMakeDeps"
-    options = {"fPIC": [True, False], "enable_testing": [True, False]}
-    default_options = {"fPIC": True, "enable_testing": False}
+    options = {
+        "fPIC": [True, False],
+        "enable_testing": [True, False],
+        "enable_benchmarks": [True, False],
+    }
+    default_options = {"fPIC": True, "enable_testing": False, "enable_benchmarks": False}
     requires = (
         "cli11/[^2.3.2]",
         "nlohmann_json/[^3.11.2]",
@@ -29,6 +33,9 @@ class OpenCLLanguageServerConanfile(ConanFile):
         "include/**",
         "src/**",
         "tests/**",
+        "benchmarks/**",
+        "mock/**",
+        "tools/**",
         "CMakeLists.txt",
         "version",
         "LICENSE",
@@ -45,6 +52,8 @@ class OpenCLLanguageServerConanfile(ConanFile):
     def build_requirements(self):
         if self.options.enable_testing:
             self.test_requires("gtest/[^1.13.0]")
+        if self.options.enable_benchmarks:
+            self.test_requires("benchmark/[^1.7.1]")
 
     def validate(self):
         check_min_cppstd(self, 17)
@@ -61,6 +70,7 @@ class OpenCLLanguageServerConanfile(ConanFile):
         cmake.configure(
             {
                 "ENABLE_TESTING": self.options.enable_testing,
+                "ENABLE_BENCHMARKS": self.options.enable_benchmarks,
             }
         )
         cmake.build()
@@ -0,0 +1,79 @@
+//
+//  buildoptions.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ocls {
+
+/**
+ Options of clBuildProgram in a canonical form, so that the same configuration written differently
+ (another order of the flags, repeated options, extra spaces) has the same command line and key.
+ The order is kept only where it matters: the search order of the include paths and the other options.
+ */
+class BuildOptions final
+{
+public:
+    BuildOptions() = default;
+
+    /**
+     Parse the items of the buildOptions setting, an item may hold several options separated by spaces.
+     Options the server does not know, such as vendor -cl-* flags, are passed to the compiler as they are.
+     Throws std::invalid_argument for malformed options, they would fail every build.
+     */
+    static BuildOptions Parse(const nlohmann::json& options);
+
+    /**
+     The canonical command line passed to clBuildProgram.
+     */
+    const std::string& GetString() const;
+    /**
+     Hash of the canonical command line, the same in every process and on every platform.
+     */
+    uint64_t GetKey() const;
+
+    /// macro name -> its definition, or nullopt for an undefined macro
+    const std::map<std::string, std::optional<std::string>>& GetDefines() const;
+    /// in the search order, without duplicates
+    const std::vector<std::string>& GetIncludePaths() const;
+    const std::optional<std::string>& GetStandard() const;
+    /// -cl-* flags defined by the OpenCL specification
+    const std::set<std::string>& GetFlags() const;
+    /// options the server does not interpret with their arguments, in the given order
+    const std::vector<std::string>& GetOtherOptions() const;
+
+    /**
+     Returns the options with the include paths searched before the configured ones.
+     */
+    BuildOptions WithIncludePaths(const std::vector<std::string>& paths) const;
+
+    bool operator==(const BuildOptions& other) const;
+    bool operator!=(const BuildOptions& other) const;
+
+private:
+    void AddDefine(const std::string& definition);
+    void AddUndefine(const std::string& name);
+    void AddIncludePath(const std::string& path);
+    bool AddOption(const std::string& option);
+    void Finalize();
+
+private:
+    std::map<std::string, std::optional<std::string>> m_defines;
+    std::vector<std::string> m_includePaths;
+    std::optional<std::string> m_standard;
+    std::set<std::string> m_flags;
+    std::vector<std::string> m_otherOptions;
+    std::string m_string;
+    uint64_t m_key = 14695981039346656037ull; // of the empty command line
+};
+
+} // namespace ocls
@@ -0,0 +1,68 @@
+//
+//  daemon.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace ocls {
+
+struct DaemonOptions
+{
+    size_t receiveBufferSize = 0; ///< SO_RCVBUF of the client sockets, 0 keeps the system default
+    size_t sendBufferSize = 0;    ///< SO_SNDBUF of the client sockets, 0 keeps the system default
+    /// reading from a client pauses while this many bytes of its output wait to be sent,
+    /// and resumes when half of them are sent
+    size_t maxPendingOutput = 4 * 1024 * 1024;
+    /// required for TCP: the daemon writes a random token to the file, which only its user can read,
+    /// and closes the connections that do not send the token in their first line
+    std::string tokenFile;
+};
+
+/**
+ Serves many clients from one process. Each connection gets a server of its own with its own documents,
+ while the OpenCL devices and contexts are shared by all of them.
+ */
+struct IDaemon
+{
+    virtual ~IDaemon() = default;
+
+    /**
+     Serve the connections until Stop is called. Returns the exit code.
+     */
+    virtual int Run() = 0;
+    /**
+     Make Run return, it is safe to call from a signal handler.
+     */
+    virtual void Stop() = 0;
+    /**
+     The TCP port the daemon listens on, 0 for Unix domain sockets.
+     */
+    virtual uint16_t GetPort() const = 0;
+};
+
+/**
+ Create a daemon listening on the Unix domain socket at the path, a stale socket file is replaced.
+ Throws std::runtime_error if the socket cannot be created, or if the platform is not supported (only Linux is).
+ */
+std::shared_ptr<IDaemon> CreateDaemon(const std::string& socketPath, const DaemonOptions& options = {});
+/**
+ Create a daemon listening on the loopback TCP port, port 0 picks a free one.
+ Every user of the host can connect to the port, so the clients authenticate with the token of options.tokenFile.
+ Throws std::runtime_error if the socket or the token file cannot be created, or if the platform is not supported
+ (only Linux is).
+ */
+std::shared_ptr<IDaemon> CreateDaemon(uint16_t port, const DaemonOptions& options = {});
+
+/**
+ Relay stdin and stdout to the daemon listening on the Unix domain socket, so that editors can use it
+ like a regular server. Returns the exit code.
+ */
+int RelayToDaemon(const std::string& socketPath);
+
+} // namespace ocls
@@ -7,28 +7,143 @@
 
 #pragma once
 
+#include <buildoptions.hpp>
 #include <clinfo.hpp>
+#include <stringpool.hpp>
 
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <nlohmann/json.hpp>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace ocls {
 
+/**
+ Immutable text of a document version. It is moved out of the message once and shared
+ by the server and the builds, so every version is stored a single time.
+ */
+using SharedText = std::shared_ptr<const std::string>;
+
+inline SharedText MakeSharedText(std::string text)
+{
+    return std::make_shared<const std::string>(std::move(text));
+}
+
 struct Source
 {
     std::string filePath;
-    std::string text;
+    SharedText text;
+    /// path -> text of the open documents that differ from their files, the build includes them instead
+    std::map<std::string, SharedText> overlays;
 };
 
+/**
+ Problems of a single file stored as a struct of arrays.
+ The file name is kept in the shared StringPool, the messages are stored one after another in the list,
+ so both are released with it.
+ */
+struct DiagnosticsList
+{
+    PooledString source;               ///< name of the file the problems were reported for
+    std::vector<uint32_t> lines;       ///< 0-indexed
+    std::vector<uint32_t> characters;
+    std::vector<int8_t> severities;    ///< LSP DiagnosticSeverity
+    std::string messageText;           ///< the messages without separators
+    std::vector<uint32_t> messageEnds; ///< end of every message in messageText
+
+    size_t size() const
+    {
+        return lines.size();
+    }
+
+    bool empty() const
+    {
+        return lines.empty();
+    }
+
+    void clear()
+    {
+        lines.clear();
+        characters.clear();
+        severities.clear();
+        messageText.clear();
+        messageEnds.clear();
+    }
+
+    std::string_view message(size_t index) const
+    {
+        const auto begin = index == 0 ? 0 : messageEnds[index - 1];
+        return std::string_view(messageText).substr(begin, messageEnds[index] - begin);
+    }
+
+    /**
+     Keep the first count problems.
+     */
+    void truncate(size_t count)
+    {
+        if (count >= size())
+            return;
+        lines.resize(count);
+        characters.resize(count);
+        severities.resize(count);
+        messageEnds.resize(count);
+        messageText.resize(count == 0 ? 0 : messageEnds.back());
+    }
+
+    void push_back(uint32_t line, uint32_t character, int8_t severity, std::string_view message)
+    {
+        lines.push_back(line);
+        characters.push_back(character);
+        severities.push_back(severity);
+        messageText.append(message);
+        messageEnds.push_back(static_cast<uint32_t>(messageText.size()));
+    }
+};
+
+/**
+ Appends the diagnostics as a JSON array of LSP Diagnostic objects.
+ */
+void SerializeDiagnostics(const DiagnosticsList& diagnostics, std::string& out);
+
+/**
+ Diagnostics of a single build grouped by the path of the file they were reported for.
+ The built source is always present (possibly with an empty list), included files only when they have problems.
+ */
+using DiagnosticsByFile = std::map<std::string, DiagnosticsList>;
+
+/**
+ The OpenCL devices and contexts, shared by the diagnostics of all clients served by the process.
+ Devices are enumerated on the first use and a context is created once per device.
+ */
+struct IBuildEnvironment
+{
+    virtual ~IBuildEnvironment() = default;
+
+    /**
+     Returns the device with the identifier, or the most powerful device if there is no such device.
+     */
+    virtual std::optional<cl::Device> SelectDevice(uint32_t identifier) = 0;
+    virtual cl::Context GetContext(const cl::Device& device) = 0;
+};
+
+std::shared_ptr<IBuildEnvironment> CreateBuildEnvironment(std::shared_ptr<ICLInfo> clInfo);
+
 struct IDiagnostics
 {
-    virtual void SetBuildOptions(const nlohmann::json& options) = 0;
+    virtual void SetBuildOptions(const BuildOptions& options) = 0;
     virtual void SetMaxProblemsCount(int maxNumberOfProblems) = 0;
     virtual void SetOpenCLDevice(uint32_t identifier) = 0;
-    virtual nlohmann::json Get(const Source& source) = 0;
+    virtual DiagnosticsByFile Get(const Source& source) = 0;
 };
 
+std::shared_ptr<IDiagnostics> CreateDiagnostics(std::shared_ptr<IBuildEnvironment> environment);
+/**
+ Create diagnostics with an environment of their own.
+ */
 std::shared_ptr<IDiagnostics> CreateDiagnostics(std::shared_ptr<ICLInfo> clInfo);
 
 } // namespace ocls
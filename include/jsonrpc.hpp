@@ -7,18 +7,25 @@
 
 #pragma once
 
+#include "messagebuffer.hpp"
+#include "methods.hpp"
+
+#include <array>
+#include <chrono>
 #include <functional>
 #include <iostream>
 #include <nlohmann/json.hpp>
 #include <optional>
-#include <regex>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 namespace ocls {
 
 class JsonRPC
 {
-    using InputCallbackFunc = std::function<void(const nlohmann::json&)>;
+    // the message is released once the callback returns, so its members can be moved out
+    using InputCallbackFunc = std::function<void(nlohmann::json&)>;
     using OutputCallbackFunc = std::function<void(const std::string&)>;
 
 public:
@@ -37,6 +44,44 @@ public:
                                 ///@}
     };
 
+    /**
+     Encoding of the message bodies, negotiated with the 'Content-Type' header.
+     The server responds in the encoding of the last message it received.
+     */
+    enum class Encoding
+    {
+        Json,       ///< application/vscode-jsonrpc; charset=utf-8
+        Cbor,       ///< application/cbor
+        MessagePack ///< application/msgpack
+    };
+
+    /**
+     Bounds of the messages received from the client.
+     */
+    struct Limits
+    {
+        /// larger messages are answered with InvalidRequest and skipped without being buffered
+        size_t maxMessageSize = 64 * 1024 * 1024;
+        /// longer headers are answered with InvalidRequest and skipped up to their end
+        size_t maxHeaderSize = 8 * 1024;
+        MessageBuffer::Options buffer;
+    };
+
+    /**
+     Use the limits set with SetDefaultLimits.
+     */
+    JsonRPC();
+    explicit JsonRPC(const Limits& limits);
+
+    /**
+     Set the limits of the instances created afterwards, it is not synchronized with their creation.
+     */
+    static void SetDefaultLimits(const Limits& limits);
+    /**
+     Returns the encoding of the 'Content-Type' header value, JSON for other media types.
+     */
+    static Encoding ParseContentType(std::string_view value);
+
     friend std::ostream& operator<<(std::ostream& out, ErrorCode const& code)
     {
         out << static_cast<int64_t>(code);
@@ -48,6 +93,17 @@ public:
      All unregistered notifications will be responded with MethodNotFound automatically.
      */
     void RegisterMethodCallback(const std::string& method, InputCallbackFunc&& func);
+    /**
+     Register the handler of a method known at compile time, it is called on the context object
+     without allocations or type erasure. Such handlers take precedence over the callbacks.
+     */
+    template <auto Handler, typename T>
+    void RegisterMethodHandler(methods::Method method, T* context)
+    {
+        m_handlers[static_cast<size_t>(method)] = {context, [](void* context, nlohmann::json& data) {
+                                                       (static_cast<T*>(context)->*Handler)(data);
+                                                   }};
+    }
     /**
      Register callback to be notified on client responds to server (our) requests.
      */
@@ -59,27 +115,66 @@ public:
     void RegisterOutputCallback(OutputCallbackFunc&& func);
 
     void Consume(char c);
+    /**
+     Consume the bytes up to the end of the current message, the message body is appended at once.
+     Returns the number of bytes consumed, it is less than the size if the message is ready.
+     */
+    size_t Consume(const char* data, size_t size);
     bool IsReady() const;
-    void Write(const nlohmann::json& data) const;
+    void Write(nlohmann::json data) const;
+    /**
+     Send an already serialized message body, it must include the "jsonrpc" member.
+     The method is only used for statistics, it is empty for responses.
+     The text is converted if a binary encoding was negotiated.
+     */
+    void WriteSerialized(const std::string& content, std::string_view method = {}) const;
+    /**
+     Prepare for the next message. The responses to a batch are sent here as one message,
+     so the responses queued by the handlers must be written before.
+     */
     void Reset();
     /**
      Send trace message to client.
      */
     void LogTrace(const std::string& message, const std::string& verbose = "");
     void WriteError(JsonRPC::ErrorCode errorCode, const std::string& message) const;
+    /**
+     The time the last message was completely read.
+     */
+    std::chrono::steady_clock::time_point GetReceiveTime() const;
+    Encoding GetEncoding() const;
 
 private:
     void OnInitialize();
     void OnTracingChanged(const nlohmann::json& data);
-    bool ReadHeader();
+    void ReadHeader();
+    void SkipHeader(char c);
+    void OnHeaderEnd();
+    void ParseBody();
+    void Dispatch();
+    void DispatchBatch();
+    bool CollectBatchResponse(const std::string& content, std::string_view method) const;
+    std::string GetBodyForLog() const;
+    void WriteBody(std::string_view content, std::string_view method) const;
     void FireMethodCallback();
     void FireRespondCallback();
 
 private:
+    struct MethodHandler
+    {
+        void* context = nullptr;
+        void (*thunk)(void* context, nlohmann::json& data) = nullptr;
+    };
+
     std::string m_method;
+    std::optional<methods::Method> m_methodId;
+    // the header being read
     std::string m_buffer;
+    MessageBuffer m_content;
     nlohmann::json m_body;
     std::unordered_map<std::string, std::string> m_headers;
+    mutable std::string m_writeBuffer;
+    std::array<MethodHandler, methods::count> m_handlers {};
     std::unordered_map<std::string, InputCallbackFunc> m_callbacks;
     OutputCallbackFunc m_outputCallback;
     InputCallbackFunc m_respondCallback;
@@ -88,8 +183,24 @@ private:
     bool m_validHeader = false;
     bool m_tracing = false;
     bool m_verbosity = false;
-    unsigned long m_contentLength = 0;
-    std::regex m_headerRegex {"([\\w-]+): (.+)\\r\\n(?:([^:]+)\\r\\n)?"};
+    size_t m_contentLength = 0;
+    size_t m_maxMessageSize;
+    size_t m_maxHeaderSize;
+    // bytes of the header read so far
+    size_t m_headerSize = 0;
+    // the header is too long, the bytes are dropped until its end
+    bool m_skipHeader = false;
+    // bytes of a rejected message left to skip
+    size_t m_skipLength = 0;
+    Encoding m_inputEncoding = Encoding::Json;
+    Encoding m_outputEncoding = Encoding::Json;
+    mutable std::vector<uint8_t> m_encodeBuffer;
+    // responses to the batch being dispatched, sent as one message by Reset
+    mutable std::string m_batchResponses;
+    bool m_inBatch = false;
+    // the time the body of the current message started to arrive, set while tracing
+    int64_t m_bodyStart = -1;
+    std::chrono::steady_clock::time_point m_receiveTime;
 };
 
 } // namespace ocls
@@ -0,0 +1,28 @@
+//
+//  jsonscan.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <cstddef>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+
+namespace ocls::jsonscan {
+
+/**
+ Parses a large 'textDocument/didOpen' or 'textDocument/didChange' message. The document texts are
+ found and unescaped with SIMD instructions, only the rest of the message is parsed by nlohmann::json.
+ Returns false if the message is of another kind or is unusual, then it must be parsed as usual.
+ */
+bool ParseDocumentMessage(std::string_view body, nlohmann::json& message);
+
+/**
+ Reads the JSON string whose opening quote precedes the start and appends its unescaped value
+ to the output, if any. Returns the position of the closing quote, or npos if the string is invalid.
+ */
+size_t ReadString(std::string_view json, size_t start, std::string* output);
+
+} // namespace ocls::jsonscan
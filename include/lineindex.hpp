@@ -0,0 +1,77 @@
+//
+//  lineindex.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace ocls {
+
+/**
+ Units of the LSP Position character offsets, negotiated with the client (LSP 3.17).
+ */
+enum class PositionEncoding
+{
+    Utf8,  ///< bytes
+    Utf16, ///< the default of the protocol
+    Utf32  ///< code points
+};
+
+struct TextPosition
+{
+    uint32_t line = 0;      ///< 0-indexed
+    uint32_t character = 0; ///< 0-indexed, in units of the position encoding
+};
+
+/**
+ Byte offsets of the line starts of a document, along with the lines that are not pure ASCII.
+ Finding the line of an offset is a binary search, columns only have to be counted on non-ASCII lines.
+ The index does not keep the text, it is passed to the conversions and must be the indexed one.
+ */
+class LineIndex final
+{
+public:
+    LineIndex();
+    explicit LineIndex(std::string_view text);
+
+    /**
+     Reindex the edited text, only the lines between the common prefix and suffix of the texts are scanned.
+     */
+    void Update(std::string_view oldText, std::string_view newText);
+
+    size_t GetLineCount() const;
+    /**
+     Returns the line containing the offset, the last line for offsets past the end.
+     */
+    uint32_t GetLine(size_t offset) const;
+    size_t GetLineStart(uint32_t line) const;
+    bool IsAscii(uint32_t line) const;
+
+    /**
+     Converts the byte column of the line, it is clamped to the end of the line.
+     */
+    uint32_t GetCharacter(std::string_view text, uint32_t line, size_t byteColumn, PositionEncoding encoding) const;
+    TextPosition GetPosition(std::string_view text, size_t offset, PositionEncoding encoding) const;
+    /**
+     Converts the position to a byte offset, positions past the end of a line are clamped to it.
+     */
+    size_t GetOffset(std::string_view text, TextPosition position, PositionEncoding encoding) const;
+
+private:
+    // the end of the line content, before its line break
+    size_t GetLineEnd(std::string_view text, uint32_t line) const;
+    void IndexLines(std::string_view text, size_t begin, size_t end, std::vector<uint32_t>& starts) const;
+    void MarkLines(std::string_view text, uint32_t first, uint32_t last);
+
+private:
+    // offsets are 32 bits, the documents are bounded by the message size limit
+    std::vector<uint32_t> m_starts;
+    std::vector<uint8_t> m_nonAscii;
+};
+
+} // namespace ocls
@@ -0,0 +1,59 @@
+//
+//  logging.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <string_view>
+
+namespace ocls::logging {
+
+struct Options
+{
+    bool fileLogging = false;
+    std::string filename;
+    spdlog::level::level_enum level = spdlog::level::info;
+    size_t maxFileSize = 10 * 1024 * 1024;
+    size_t maxFiles = 3;
+};
+
+/**
+ Register the loggers of all modules. File logging goes through a bounded queue to a background thread
+ that writes to a rotating file, when the queue is full the oldest messages are dropped.
+ The loggers already registered are kept and get the new sink and level, so the handles returned by Get
+ stay valid; they keep the kind they were created with, queued or not. It must not run while others log.
+ */
+void Configure(const Options& options);
+/**
+ Flush the queued messages and stop the background thread.
+ */
+void Shutdown();
+/**
+ Follow the client trace value: "off" restores the configured level,
+ "messages" enables debug and "verbose" enables trace logging. Ignored when file logging is disabled.
+ */
+void SetTrace(std::string_view value);
+
+/**
+ Returns the logger registered under the name, the registry is only looked up on the first call.
+ The logger must be registered before the first call, otherwise the default logger is returned.
+ */
+template <const char* name>
+spdlog::logger& Get()
+{
+    static const auto logger = spdlog::get(name);
+    assert(logger && "the logger must be registered before its first use");
+    return logger ? *logger : *spdlog::default_logger_raw();
+}
+
+/**
+ Returns the text cut to a size suitable for the log.
+ */
+std::string Truncate(std::string_view text);
+
+} // namespace ocls::logging
@@ -7,16 +7,65 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
+#include <optional>
+#include <string>
 
 namespace ocls {
 
+struct IBuildEnvironment;
+
 struct ILSPServer
 {
+    /**
+     Read up to size bytes of the client's stream into data, blocking until some are available.
+     Returns the number of bytes read, 0 when the stream is over.
+     Run calls it on a thread of its own, so that the builds proceed while the client is idle.
+     */
+    using InputFunc = std::function<size_t(char* data, size_t size)>;
+    /**
+     Deliver the framed message to the client.
+     */
+    using OutputFunc = std::function<void(const std::string&)>;
+
+    virtual ~ILSPServer() = default;
+
+    /**
+     Process messages until the input is over or the client sends 'exit'.
+     Returns the exit code.
+     */
     virtual int Run() = 0;
     virtual void Interrupt() = 0;
+    /**
+     Process the bytes received from the client, for servers driven by an event loop instead of Run.
+     Returns the exit code once the client sends 'exit', the remaining bytes are ignored.
+     */
+    virtual std::optional<int> Consume(const char* data, size_t size) = 0;
+    /**
+     Run the next of the builds scheduled by the consumed messages, for servers driven by an event loop.
+     Returns true while more builds are scheduled, the loop should check for input before running the next one.
+     The build may run on another thread, as long as the server is not used by any other meanwhile.
+     */
+    virtual bool RunScheduledBuild() = 0;
+    virtual bool HasScheduledBuild() const = 0;
 };
 
+/**
+ Read the bytes available on stdin, an InputFunc for servers communicating over stdin/stdout.
+ */
+size_t ReadStandardInput(char* data, size_t size);
+
+/**
+ Create a server communicating over stdin/stdout.
+ */
 std::shared_ptr<ILSPServer> CreateLSPServer();
+/**
+ The server builds with the given environment, or with an environment of its own if none is given.
+ */
+std::shared_ptr<ILSPServer> CreateLSPServer(
+    ILSPServer::InputFunc input,
+    ILSPServer::OutputFunc output,
+    std::shared_ptr<IBuildEnvironment> environment = nullptr);
 
 } // namespace ocls
@@ -0,0 +1,68 @@
+//
+//  messagebuffer.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace ocls {
+
+/**
+ Storage of the message body being received. Bodies up to the spool threshold are kept in a string
+ whose capacity is reused between messages, unless an outlier made it much larger than the usual bodies.
+ Larger bodies are spooled into a private mapping that is returned to the system as soon as they are handled.
+ */
+class MessageBuffer final
+{
+public:
+    struct Options
+    {
+        /// bodies of this size and larger are spooled into a mapping, 0 never spools
+        size_t spoolThreshold = 8 * 1024 * 1024;
+        /// capacity that is always kept, more is released once it is 4 times the usual body size
+        size_t retainedCapacity = 64 * 1024;
+    };
+
+    MessageBuffer() = default;
+    explicit MessageBuffer(const Options& options);
+    ~MessageBuffer();
+    MessageBuffer(const MessageBuffer&) = delete;
+    MessageBuffer& operator=(const MessageBuffer&) = delete;
+
+    /**
+     Prepare for a body of the size, it must be bounded by the caller since it comes from the client.
+     */
+    void Begin(size_t size);
+    /**
+     Append at most the remaining size of the body.
+     */
+    void Append(const char* data, size_t size);
+    std::string_view View() const;
+    size_t Size() const;
+    size_t Capacity() const;
+    bool IsSpooled() const;
+    /**
+     Discard the body, the memory is released or kept for the next one.
+     */
+    void Clear();
+
+private:
+    bool Map(size_t size);
+    void Unmap();
+
+private:
+    Options m_options;
+    std::string m_storage;
+    char* m_mapping = nullptr;
+    size_t m_mappingSize = 0;
+    size_t m_size = 0;
+    size_t m_expectedSize = 0;
+    // moving average of the body sizes
+    size_t m_usualSize = 0;
+};
+
+} // namespace ocls
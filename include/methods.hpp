@@ -0,0 +1,146 @@
+//
+//  methods.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace ocls::methods {
+
+/**
+ Methods known at compile time, they are looked up with a perfect hash
+ and dispatched without allocations.
+ */
+enum class Method : uint8_t
+{
+    Initialize,
+    Initialized,
+    Shutdown,
+    Exit,
+    SetTrace,
+    CancelRequest,
+    DidOpen,
+    DidChange,
+    DidClose,
+    DocumentDiagnostic,
+    WorkspaceDiagnostic,
+    DidChangeConfiguration,
+    Stats,
+    Count
+};
+
+constexpr auto count = static_cast<size_t>(Method::Count);
+
+constexpr std::array<std::string_view, count> names {
+    "initialize",
+    "initialized",
+    "shutdown",
+    "exit",
+    "$/setTrace",
+    "$/cancelRequest",
+    "textDocument/didOpen",
+    "textDocument/didChange",
+    "textDocument/didClose",
+    "textDocument/diagnostic",
+    "workspace/diagnostic",
+    "workspace/didChangeConfiguration",
+    "$/ocls/stats",
+};
+
+namespace detail {
+
+constexpr unsigned tableBits = 5;
+constexpr size_t tableSize = size_t(1) << tableBits;
+static_assert(count < tableSize);
+
+// FNV-1a with the seed mixed into the offset basis
+constexpr uint32_t Hash(std::string_view name, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    for (const char c : name)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// The low bits of FNV-1a only depend on the low bits of the input, so the top bits are used
+constexpr size_t GetSlot(std::string_view name, uint32_t seed)
+{
+    return Hash(name, seed) >> (32 - tableBits);
+}
+
+constexpr bool IsPerfect(uint32_t seed)
+{
+    bool used[tableSize] {};
+    for (const auto name : names)
+    {
+        const auto slot = GetSlot(name, seed);
+        if (used[slot])
+            return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr uint32_t FindSeed()
+{
+    uint32_t seed = 0;
+    while (!IsPerfect(seed))
+        ++seed;
+    return seed;
+}
+
+constexpr uint32_t seed = FindSeed();
+
+// slot -> index of the method, count for empty slots
+constexpr std::array<uint8_t, tableSize> BuildTable()
+{
+    std::array<uint8_t, tableSize> table {};
+    for (auto& index : table)
+        index = static_cast<uint8_t>(count);
+    for (size_t i = 0; i < count; ++i)
+        table[GetSlot(names[i], seed)] = static_cast<uint8_t>(i);
+    return table;
+}
+
+constexpr auto table = BuildTable();
+
+} // namespace detail
+
+constexpr std::optional<Method> Find(std::string_view name)
+{
+    const auto index = detail::table[detail::GetSlot(name, detail::seed)];
+    if (index == count || names[index] != name)
+        return std::nullopt;
+    return static_cast<Method>(index);
+}
+
+constexpr std::string_view GetName(Method method)
+{
+    return names[static_cast<size_t>(method)];
+}
+
+namespace detail {
+constexpr bool FindsAll()
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (Find(names[i]) != static_cast<Method>(i))
+            return false;
+    }
+    return true;
+}
+} // namespace detail
+
+static_assert(detail::FindsAll());
+static_assert(!Find("textDocument/hover"));
+
+} // namespace ocls::methods
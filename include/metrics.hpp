@@ -0,0 +1,89 @@
+//
+//  metrics.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <string_view>
+
+namespace ocls::metrics {
+
+/**
+ Counters and histograms are kept per thread and summed up when read,
+ so that updating them never contends with other threads.
+ */
+
+enum class Counter : size_t
+{
+    PublishedDiagnostics, ///< 'textDocument/publishDiagnostics' notifications sent to the client
+    SuppressedDiagnostics, ///< publishes skipped because the diagnostics did not change
+    BytesReceived,         ///< message bodies read from the client
+    BytesSent,             ///< message bodies sent to the client
+    RejectedMessages,      ///< messages skipped because they exceeded the size limit
+    BuildsStarted,         ///< programs built to get diagnostics
+    BuildsCancelled,       ///< builds dropped before they completed
+    BuildsCoalesced,       ///< build requests merged into an already scheduled build
+    CacheHits,             ///< diagnostics served without building
+    CacheMisses,           ///< diagnostics requests that required a build
+    PausedInputs,          ///< times the daemon stopped reading from a client until it reads its responses
+    RejectedClients,       ///< connections to the daemon closed because they sent a wrong token
+    Count
+};
+
+enum class Gauge : size_t
+{
+    OutgoingQueue,         ///< messages waiting to be sent to the client
+    PendingServerRequests, ///< server requests waiting for the client response
+    Connections,           ///< clients connected to the daemon
+    Count
+};
+
+/**
+ Latency histograms, the values are in microseconds.
+ */
+enum class Histogram : size_t
+{
+    ReceiveToPublish, ///< from reading a document change to publishing its diagnostics
+    Build,            ///< building a program and parsing its build log
+    QueueActive,      ///< time a build of the document being edited waited in the queue
+    QueueOpen,        ///< time a build of another open document waited in the queue
+    QueueBackground,  ///< time a background build waited in the queue
+    Count
+};
+
+enum class Direction
+{
+    Received,
+    Sent
+};
+
+void Increment(Counter counter, uint64_t value = 1);
+uint64_t Get(Counter counter);
+const char* GetName(Counter counter);
+
+void SetGauge(Gauge gauge, int64_t value);
+
+void Record(Histogram histogram, std::chrono::microseconds value);
+/**
+ Returns the value the given percentage of the recorded values does not exceed,
+ the precision is about 6% of the value, 0 if nothing was recorded.
+ */
+uint64_t GetPercentile(Histogram histogram, double percentile);
+
+/**
+ Count a message by its method, the empty method stands for responses.
+ */
+void CountMessage(Direction direction, std::string_view method);
+uint64_t GetMessageCount(Direction direction, std::string_view method);
+
+/**
+ All metrics as a JSON object, the result of the '$/ocls/stats' request.
+ */
+nlohmann::json GetSnapshot();
+
+} // namespace ocls::metrics
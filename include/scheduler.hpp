@@ -0,0 +1,100 @@
+//
+//  scheduler.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <unordered_map>
+
+namespace ocls {
+
+enum class BuildPriority : uint8_t
+{
+    Active,     ///< the document being edited
+    Open,       ///< other open documents
+    Background, ///< rebuilds the user did not ask for, e.g. after a configuration change
+    Count
+};
+
+/**
+ Builds waiting to run, one queue per priority. A document is queued at most once: a repeated request
+ is merged into the queued build, which takes the higher priority. A build that has waited long enough
+ is ranked one priority higher for every aging interval, so the background builds finish as well.
+ */
+class BuildScheduler final
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using Key = uint32_t;
+
+    struct Options
+    {
+        std::chrono::milliseconds agingInterval {1000};
+    };
+
+    struct Build
+    {
+        Key key;
+        /// the latest request, the build reflects the changes up to it
+        Clock::time_point requestTime;
+    };
+
+    BuildScheduler() = default;
+    explicit BuildScheduler(const Options& options);
+
+    /**
+     Returns false if the build was merged into the queued one.
+     */
+    bool Enqueue(Key key, BuildPriority priority, Clock::time_point requestTime = Clock::now());
+    /**
+     Move the queued build to the lower priority, a build queued at a lower one is left as it is.
+     */
+    void Demote(Key key, BuildPriority priority);
+    /**
+     Returns false if no build of the key was queued.
+     */
+    bool Cancel(Key key);
+    /**
+     Returns the number of the cancelled builds.
+     */
+    size_t CancelAll();
+    /**
+     Take the build to run next, the time it waited is recorded in the histogram of its priority.
+     */
+    std::optional<Build> Pop(Clock::time_point now = Clock::now());
+    std::optional<BuildPriority> GetPriority(Key key) const;
+    size_t size() const;
+    bool empty() const;
+
+private:
+    struct Entry
+    {
+        Key key;
+        Clock::time_point enqueueTime;
+    };
+
+    struct Queued
+    {
+        BuildPriority priority;
+        Clock::time_point requestTime;
+    };
+
+    using Queue = std::deque<Entry>;
+
+    Queue& GetQueue(BuildPriority priority);
+    void Insert(const Entry& entry, BuildPriority priority);
+    std::optional<Entry> Remove(Key key, BuildPriority priority);
+
+private:
+    Options m_options;
+    std::array<Queue, static_cast<size_t>(BuildPriority::Count)> m_queues;
+    std::unordered_map<Key, Queued> m_queued;
+};
+
+} // namespace ocls
@@ -0,0 +1,78 @@
+//
+//  session.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+namespace ocls {
+
+/**
+ A message of a recorded session. The session file holds one JSON object per line:
+ {"time": <microseconds since the session start>, "direction": "in"|"out", "message": <message body>}
+ CBOR and MessagePack bodies are not text, they are stored in base64 along with "contentType": <header value>.
+ */
+struct SessionFrame
+{
+    int64_t time = 0;
+    bool inbound = true;
+    std::string message;
+    /// of the binary messages, empty for JSON
+    std::string contentType;
+};
+
+class SessionRecorder
+{
+public:
+    /**
+     Throws std::runtime_error if the file cannot be opened for writing.
+     */
+    explicit SessionRecorder(const std::string& path);
+
+    /**
+     Feed the bytes read from the client, complete messages are written to the file.
+     */
+    void RecordInput(const char* data, size_t size);
+    /**
+     Write a framed message sent to the client.
+     */
+    void RecordOutput(const std::string& message);
+
+private:
+    void Write(bool inbound, std::string_view headers, std::string_view body);
+
+private:
+    std::mutex m_mutex;
+    std::ofstream m_file;
+    std::chrono::steady_clock::time_point m_start;
+    std::string m_input;
+    size_t m_bodyOffset = 0;
+    size_t m_contentLength = 0;
+};
+
+/**
+ Throws std::runtime_error if the file cannot be read or parsed.
+ */
+std::vector<SessionFrame> LoadSession(const std::string& path);
+
+/**
+ Feed the inbound messages of the session to a new server and measure how long each one takes to process.
+ The messages are delivered at the recorded pace divided by speed, speed 0 replays them without delays.
+ The observer, if any, gets the framed messages the server sends.
+ Returns the report with the throughput and p50/p95/p99 latencies in microseconds per method,
+ the exit code is null if the session does not end with 'exit'.
+ */
+nlohmann::json ReplaySession(
+    const std::vector<SessionFrame>& frames,
+    double speed,
+    std::function<void(const std::string&)> observer = nullptr);
+
+} // namespace ocls
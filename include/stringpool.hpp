@@ -0,0 +1,120 @@
+//
+//  stringpool.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace ocls {
+
+/**
+ Storage of unique strings referenced by small integer handles.
+ Interning takes a lock, resolving a handle does not: the storage is never reallocated,
+ so a handle obtained from any thread stays valid until it is released.
+ Every Intern takes a reference that Release drops, the slot of a string without references is reused.
+ */
+class StringPool final
+{
+public:
+    using Handle = uint32_t;
+    /// The handle of the empty string, valid without interning it.
+    static constexpr Handle Empty = 0;
+
+    struct Stats
+    {
+        size_t strings = 0;        ///< unique strings in the pool
+        size_t storedBytes = 0;    ///< characters stored by the pool
+        size_t requests = 0;       ///< calls to Intern
+        size_t requestedBytes = 0; ///< characters passed to Intern, what separate copies would have stored
+    };
+
+    /// The most strings the pool can hold.
+    static constexpr size_t MaxCapacity = 4096 * 1024;
+
+    /**
+     Intern throws std::length_error once the pool holds capacity strings.
+     */
+    explicit StringPool(size_t capacity = MaxCapacity);
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    /**
+     Returns the handle of the string with a new reference to it.
+     */
+    Handle Intern(std::string_view str);
+    /**
+     Returns the handle of an interned string without taking a reference, it stays valid while someone holds one.
+     */
+    std::optional<Handle> Find(std::string_view str) const;
+    /**
+     Take another reference to an interned string.
+     */
+    void Retain(Handle handle);
+    /**
+     Drop a reference taken by Intern or Retain, the string is removed with the last one.
+     The empty string is never removed.
+     */
+    void Release(Handle handle);
+    std::string_view Get(Handle handle) const;
+    size_t Size() const;
+    Stats GetStats() const;
+
+private:
+    static constexpr size_t ChunkSize = 1024;
+    static constexpr size_t MaxChunks = MaxCapacity / ChunkSize;
+
+    const size_t m_capacity;
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string_view, Handle> m_index;
+    std::array<std::atomic<std::string*>, MaxChunks> m_chunks {};
+    std::array<std::unique_ptr<std::string[]>, MaxChunks> m_storage;
+    std::atomic<size_t> m_size {0};
+    // references of every handle, the handles without references are reused
+    std::vector<uint32_t> m_references;
+    std::vector<Handle> m_free;
+    size_t m_storedBytes = 0;
+    size_t m_requests = 0;
+    size_t m_requestedBytes = 0;
+};
+
+/**
+ The pool shared by the diagnostics pipeline.
+ */
+StringPool& GetStringPool();
+
+/**
+ A string of the shared pool referenced for the lifetime of the object, copies take references of their own.
+ */
+class PooledString final
+{
+public:
+    PooledString() = default;
+    explicit PooledString(std::string_view str);
+    PooledString(const PooledString& other);
+    PooledString(PooledString&& other) noexcept;
+    PooledString& operator=(PooledString other) noexcept;
+    ~PooledString();
+
+    StringPool::Handle GetHandle() const
+    {
+        return m_handle;
+    }
+
+    std::string_view Get() const;
+
+private:
+    StringPool::Handle m_handle = StringPool::Empty;
+};
+
+} // namespace ocls
@@ -0,0 +1,77 @@
+//
+//  tracing.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace ocls::tracing {
+
+/**
+ Spans are written in the Chrome trace event format, open the file with chrome://tracing or Perfetto.
+ While tracing is stopped a span costs a single relaxed atomic load.
+ */
+
+namespace internal {
+extern std::atomic<bool> enabled;
+} // namespace internal
+
+inline bool IsEnabled()
+{
+    return internal::enabled.load(std::memory_order_relaxed);
+}
+
+/**
+ Start writing spans to the file, throws std::runtime_error if it cannot be opened.
+ */
+void Start(const std::string& path);
+/**
+ Flush the pending spans and close the file.
+ */
+void Stop();
+/**
+ Microseconds since tracing was started.
+ */
+int64_t Now();
+void WriteComplete(const char* category, const char* name, int64_t start, int64_t duration, std::string_view detail);
+
+/**
+ Records the time between its construction and destruction.
+ */
+class Span final
+{
+public:
+    Span(const char* category, const char* name) noexcept : m_category {category}, m_name {name}
+    {
+        if (IsEnabled())
+            m_start = Now();
+    }
+
+    Span(const char* category, const char* name, std::string_view detail) : Span(category, name)
+    {
+        if (m_start >= 0)
+            m_detail = detail;
+    }
+
+    ~Span()
+    {
+        if (m_start >= 0)
+            WriteComplete(m_category, m_name, m_start, Now() - m_start, m_detail);
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+private:
+    const char* m_category;
+    const char* m_name;
+    int64_t m_start = -1;
+    std::string m_detail;
+};
+
+} // namespace ocls::tracing
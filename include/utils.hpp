@@ -12,6 +12,7 @@
 #include <cstdint>
 #include <numeric>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace ocls::utils {
@@ -20,8 +21,11 @@ std::string GenerateId();
 void Trim(std::string& s);
 std::vector<std::string> SplitString(const std::string& str, const std::string& pattern);
 std::string UriToPath(const std::string& uri);
+std::string PathToUri(const std::string& path);
 bool EndsWith(const std::string& str, const std::string& suffix);
 void RemoveNullTerminator(std::string& str);
+// Appends a quoted JSON string, invalid UTF-8 sequences are replaced with U+FFFD.
+void AppendJsonString(std::string& out, std::string_view str);
 
 namespace internal {
 // Generates a lookup table for the checksums of all 8-bit values.
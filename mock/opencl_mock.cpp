@@ -0,0 +1,470 @@
+//
+//  opencl_mock.cpp
+//  opencl-language-server
+//
+
+#include "opencl_mock.hpp"
+
+#if !defined(CL_TARGET_OPENCL_VERSION)
+    #define CL_TARGET_OPENCL_VERSION 300
+#endif
+#if defined(__APPLE__)
+    #include <OpenCL/cl.h>
+#else
+    #include <CL/cl.h>
+#endif
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+struct _cl_platform_id
+{};
+
+struct _cl_device_id
+{
+    ocls::mock::Device info;
+};
+
+struct _cl_context
+{
+    std::atomic<int> references {1};
+    std::vector<cl_device_id> devices;
+};
+
+struct _cl_program
+{
+    std::atomic<int> references {1};
+    cl_context context = nullptr;
+    std::string source;
+    std::string log;
+    cl_build_status status = CL_BUILD_NONE;
+};
+
+namespace {
+
+_cl_platform_id platform;
+
+std::mutex mutex;
+std::vector<std::unique_ptr<_cl_device_id>> devices = [] {
+    std::vector<std::unique_ptr<_cl_device_id>> list;
+    list.emplace_back(new _cl_device_id {});
+    return list;
+}();
+// replaced devices are kept alive, contexts and programs may still refer to them
+std::vector<std::unique_ptr<_cl_device_id>> retiredDevices;
+std::chrono::microseconds buildLatency {0};
+std::string buildLog;
+ocls::mock::BuildLogCallback buildLogCallback;
+std::atomic<uint64_t> buildCount {0};
+
+void ResetDevices(std::vector<ocls::mock::Device> infos)
+{
+    for (auto& device : devices)
+        retiredDevices.emplace_back(std::move(device));
+    devices.clear();
+    for (auto& info : infos)
+        devices.emplace_back(new _cl_device_id {std::move(info)});
+}
+
+cl_int ReturnInfo(const void* data, size_t size, size_t paramValueSize, void* paramValue, size_t* paramValueSizeRet)
+{
+    if (paramValue)
+    {
+        if (paramValueSize < size)
+            return CL_INVALID_VALUE;
+        std::memcpy(paramValue, data, size);
+    }
+    if (paramValueSizeRet)
+        *paramValueSizeRet = size;
+    return CL_SUCCESS;
+}
+
+template <typename T>
+cl_int ReturnValue(const T& value, size_t paramValueSize, void* paramValue, size_t* paramValueSizeRet)
+{
+    return ReturnInfo(&value, sizeof(T), paramValueSize, paramValue, paramValueSizeRet);
+}
+
+cl_int ReturnString(const std::string& value, size_t paramValueSize, void* paramValue, size_t* paramValueSizeRet)
+{
+    return ReturnInfo(value.c_str(), value.size() + 1, paramValueSize, paramValue, paramValueSizeRet);
+}
+
+} // namespace
+
+namespace ocls::mock {
+
+void SetDevices(std::vector<Device> infos)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ResetDevices(std::move(infos));
+}
+
+void SetBuildLatency(std::chrono::microseconds latency)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    buildLatency = latency;
+}
+
+void SetBuildLog(std::string log)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    buildLog = std::move(log);
+}
+
+void SetBuildLogCallback(BuildLogCallback callback)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    buildLogCallback = std::move(callback);
+}
+
+uint64_t GetBuildCount()
+{
+    return buildCount.load();
+}
+
+void Reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ResetDevices({Device {}});
+    buildLatency = std::chrono::microseconds {0};
+    buildLog.clear();
+    buildLogCallback = nullptr;
+    buildCount = 0;
+}
+
+} // namespace ocls::mock
+
+extern "C" {
+
+CL_API_ENTRY cl_int CL_API_CALL clGetPlatformIDs(cl_uint num_entries, cl_platform_id* platforms, cl_uint* num_platforms)
+{
+    if ((num_entries == 0 && platforms) || (!platforms && !num_platforms))
+        return CL_INVALID_VALUE;
+    if (platforms)
+        platforms[0] = &platform;
+    if (num_platforms)
+        *num_platforms = 1;
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetPlatformInfo(
+    cl_platform_id, cl_platform_info param_name, size_t param_value_size, void* param_value, size_t* param_value_size_ret)
+{
+    switch (param_name)
+    {
+        case CL_PLATFORM_NAME:
+            return ReturnString("Mock Platform", param_value_size, param_value, param_value_size_ret);
+        case CL_PLATFORM_VENDOR:
+            return ReturnString("opencl-language-server", param_value_size, param_value, param_value_size_ret);
+        case CL_PLATFORM_VERSION:
+            return ReturnString("OpenCL 3.0 Mock", param_value_size, param_value, param_value_size_ret);
+        case CL_PLATFORM_PROFILE:
+            return ReturnString("FULL_PROFILE", param_value_size, param_value, param_value_size_ret);
+        case CL_PLATFORM_EXTENSIONS:
+            return ReturnString("cl_khr_fp64 cl_khr_fp16", param_value_size, param_value, param_value_size_ret);
+        default:
+            return CL_INVALID_VALUE;
+    }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetDeviceIDs(
+    cl_platform_id, cl_device_type device_type, cl_uint num_entries, cl_device_id* device_list, cl_uint* num_devices)
+{
+    if ((num_entries == 0 && device_list) || (!device_list && !num_devices))
+        return CL_INVALID_VALUE;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    cl_uint count = 0;
+    for (auto& device : devices)
+    {
+        if (device_type != CL_DEVICE_TYPE_ALL && device_type != CL_DEVICE_TYPE_DEFAULT &&
+            (device->info.type & device_type) == 0)
+            continue;
+        if (device_list && count < num_entries)
+            device_list[count] = device.get();
+        ++count;
+    }
+    if (count == 0)
+        return CL_DEVICE_NOT_FOUND;
+    if (num_devices)
+        *num_devices = count;
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetDeviceInfo(
+    cl_device_id device,
+    cl_device_info param_name,
+    size_t param_value_size,
+    void* param_value,
+    size_t* param_value_size_ret)
+{
+    if (!device)
+        return CL_INVALID_DEVICE;
+
+    const auto& info = device->info;
+    switch (param_name)
+    {
+        case CL_DEVICE_NAME:
+            return ReturnString(info.name, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_VENDOR:
+            return ReturnString(info.vendor, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_VERSION:
+            return ReturnString(info.version, param_value_size, param_value, param_value_size_ret);
+        case CL_DRIVER_VERSION:
+            return ReturnString(info.driverVersion, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_PROFILE:
+            return ReturnString("FULL_PROFILE", param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_OPENCL_C_VERSION:
+            return ReturnString("OpenCL C 1.2", param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_EXTENSIONS:
+            return ReturnString(
+                "cl_khr_fp64 cl_khr_fp16 cl_khr_global_int32_base_atomics",
+                param_value_size,
+                param_value,
+                param_value_size_ret);
+        case CL_DEVICE_BUILT_IN_KERNELS:
+            return ReturnString("", param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_PLATFORM:
+            return ReturnValue(static_cast<cl_platform_id>(&platform), param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_TYPE:
+            return ReturnValue<cl_device_type>(info.type, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_MAX_COMPUTE_UNITS:
+            return ReturnValue<cl_uint>(info.computeUnits, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_MAX_CLOCK_FREQUENCY:
+            return ReturnValue<cl_uint>(info.clockFrequency, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_VENDOR_ID:
+            return ReturnValue<cl_uint>(info.vendorID, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_MAX_WORK_ITEM_SIZES:
+        {
+            const size_t sizes[] = {1024, 1024, 64};
+            return ReturnInfo(sizes, sizeof(sizes), param_value_size, param_value, param_value_size_ret);
+        }
+        case CL_DEVICE_PARTITION_PROPERTIES:
+        case CL_DEVICE_PARTITION_TYPE:
+            return ReturnValue<cl_device_partition_property>(0, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_IMAGE2D_MAX_HEIGHT:
+        case CL_DEVICE_IMAGE2D_MAX_WIDTH:
+        case CL_DEVICE_IMAGE3D_MAX_DEPTH:
+        case CL_DEVICE_IMAGE3D_MAX_HEIGHT:
+        case CL_DEVICE_IMAGE3D_MAX_WIDTH:
+        case CL_DEVICE_IMAGE_MAX_BUFFER_SIZE:
+        case CL_DEVICE_IMAGE_MAX_ARRAY_SIZE:
+        case CL_DEVICE_MAX_PARAMETER_SIZE:
+        case CL_DEVICE_MAX_WORK_GROUP_SIZE:
+        case CL_DEVICE_PRINTF_BUFFER_SIZE:
+        case CL_DEVICE_PROFILING_TIMER_RESOLUTION:
+            return ReturnValue<size_t>(1024, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_GLOBAL_MEM_CACHE_SIZE:
+        case CL_DEVICE_GLOBAL_MEM_SIZE:
+        case CL_DEVICE_LOCAL_MEM_SIZE:
+        case CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE:
+        case CL_DEVICE_MAX_MEM_ALLOC_SIZE:
+            return ReturnValue<cl_ulong>(1 << 20, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_SINGLE_FP_CONFIG:
+        case CL_DEVICE_DOUBLE_FP_CONFIG:
+            return ReturnValue<cl_bitfield>(
+                CL_FP_DENORM | CL_FP_INF_NAN | CL_FP_ROUND_TO_NEAREST | CL_FP_FMA,
+                param_value_size,
+                param_value,
+                param_value_size_ret);
+        case CL_DEVICE_EXECUTION_CAPABILITIES:
+            return ReturnValue<cl_bitfield>(CL_EXEC_KERNEL, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_QUEUE_PROPERTIES:
+            return ReturnValue<cl_bitfield>(
+                CL_QUEUE_PROFILING_ENABLE, param_value_size, param_value, param_value_size_ret);
+        case CL_DEVICE_PARTITION_AFFINITY_DOMAIN:
+            return ReturnValue<cl_bitfield>(0, param_value_size, param_value, param_value_size_ret);
+        default:
+            // the remaining properties are cl_uint numbers, booleans and enums
+            return ReturnValue<cl_uint>(1, param_value_size, param_value, param_value_size_ret);
+    }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainDevice(cl_device_id)
+{
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseDevice(cl_device_id)
+{
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_context CL_API_CALL clCreateContext(
+    const cl_context_properties*,
+    cl_uint num_devices,
+    const cl_device_id* devices,
+    void(CL_CALLBACK*)(const char*, const void*, size_t, void*),
+    void*,
+    cl_int* errcode_ret)
+{
+    if (num_devices == 0 || !devices)
+    {
+        if (errcode_ret)
+            *errcode_ret = CL_INVALID_VALUE;
+        return nullptr;
+    }
+    auto context = new _cl_context;
+    context->devices.assign(devices, devices + num_devices);
+    if (errcode_ret)
+        *errcode_ret = CL_SUCCESS;
+    return context;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetContextInfo(
+    cl_context context,
+    cl_context_info param_name,
+    size_t param_value_size,
+    void* param_value,
+    size_t* param_value_size_ret)
+{
+    switch (param_name)
+    {
+        case CL_CONTEXT_NUM_DEVICES:
+            return ReturnValue(
+                static_cast<cl_uint>(context->devices.size()), param_value_size, param_value, param_value_size_ret);
+        case CL_CONTEXT_DEVICES:
+            return ReturnInfo(
+                context->devices.data(),
+                context->devices.size() * sizeof(cl_device_id),
+                param_value_size,
+                param_value,
+                param_value_size_ret);
+        default:
+            return CL_INVALID_VALUE;
+    }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainContext(cl_context context)
+{
+    ++context->references;
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseContext(cl_context context)
+{
+    if (--context->references == 0)
+        delete context;
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithSource(
+    cl_context context, cl_uint count, const char** strings, const size_t* lengths, cl_int* errcode_ret)
+{
+    if (count == 0 || !strings)
+    {
+        if (errcode_ret)
+            *errcode_ret = CL_INVALID_VALUE;
+        return nullptr;
+    }
+    auto program = new _cl_program;
+    program->context = context;
+    clRetainContext(context);
+    for (cl_uint i = 0; i < count; ++i)
+    {
+        if (lengths && lengths[i] > 0)
+            program->source.append(strings[i], lengths[i]);
+        else
+            program->source.append(strings[i]);
+    }
+    if (errcode_ret)
+        *errcode_ret = CL_SUCCESS;
+    return program;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clBuildProgram(
+    cl_program program,
+    cl_uint,
+    const cl_device_id*,
+    const char* options,
+    void(CL_CALLBACK*)(cl_program, void*),
+    void*)
+{
+    ++buildCount;
+    std::chrono::microseconds latency;
+    ocls::mock::BuildLogCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        latency = buildLatency;
+        callback = buildLogCallback;
+        program->log = buildLog;
+    }
+    if (latency.count() > 0)
+        std::this_thread::sleep_for(latency);
+    if (callback)
+        program->log = callback(program->source, options ? options : "");
+    const bool failed = program->log.find("error: ") != std::string::npos;
+    program->status = failed ? CL_BUILD_ERROR : CL_BUILD_SUCCESS;
+    return failed ? CL_BUILD_PROGRAM_FAILURE : CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetProgramInfo(
+    cl_program program,
+    cl_program_info param_name,
+    size_t param_value_size,
+    void* param_value,
+    size_t* param_value_size_ret)
+{
+    const auto& devices = program->context->devices;
+    switch (param_name)
+    {
+        case CL_PROGRAM_NUM_DEVICES:
+            return ReturnValue(static_cast<cl_uint>(devices.size()), param_value_size, param_value, param_value_size_ret);
+        case CL_PROGRAM_DEVICES:
+            return ReturnInfo(
+                devices.data(),
+                devices.size() * sizeof(cl_device_id),
+                param_value_size,
+                param_value,
+                param_value_size_ret);
+        case CL_PROGRAM_CONTEXT:
+            return ReturnValue(program->context, param_value_size, param_value, param_value_size_ret);
+        case CL_PROGRAM_SOURCE:
+            return ReturnString(program->source, param_value_size, param_value, param_value_size_ret);
+        default:
+            return CL_INVALID_VALUE;
+    }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetProgramBuildInfo(
+    cl_program program,
+    cl_device_id,
+    cl_program_build_info param_name,
+    size_t param_value_size,
+    void* param_value,
+    size_t* param_value_size_ret)
+{
+    switch (param_name)
+    {
+        case CL_PROGRAM_BUILD_STATUS:
+            return ReturnValue(program->status, param_value_size, param_value, param_value_size_ret);
+        case CL_PROGRAM_BUILD_LOG:
+            return ReturnString(program->log, param_value_size, param_value, param_value_size_ret);
+        case CL_PROGRAM_BUILD_OPTIONS:
+            return ReturnString("", param_value_size, param_value, param_value_size_ret);
+        default:
+            return CL_INVALID_VALUE;
+    }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainProgram(cl_program program)
+{
+    ++program->references;
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseProgram(cl_program program)
+{
+    if (--program->references == 0)
+    {
+        clReleaseContext(program->context);
+        delete program;
+    }
+    return CL_SUCCESS;
+}
+
+} // extern "C"
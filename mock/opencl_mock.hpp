@@ -0,0 +1,66 @@
+//
+//  opencl_mock.hpp
+//  opencl-language-server
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace ocls::mock {
+
+/**
+ The mock library implements the OpenCL entry points used by the server with a single
+ emulated platform, so that code built on top of OpenCL runs on machines without a driver.
+ Link it instead of the OpenCL ICD loader.
+ */
+
+struct Device
+{
+    std::string name = "Mock Device";
+    std::string vendor = "opencl-language-server";
+    std::string version = "OpenCL 3.0 Mock";
+    std::string driverVersion = "1.0";
+    uint64_t type = 1 << 2; // CL_DEVICE_TYPE_GPU
+    uint32_t vendorID = 0x1234;
+    uint32_t computeUnits = 16;
+    uint32_t clockFrequency = 1000;
+};
+
+/**
+ Returns the build log for the given program source and build options.
+ */
+using BuildLogCallback = std::function<std::string(const std::string& source, const std::string& options)>;
+
+/**
+ Replace the emulated devices, a single default device is available initially.
+ Device handles obtained before the call must not be used afterwards.
+ */
+void SetDevices(std::vector<Device> devices);
+/**
+ Set the time every subsequent clBuildProgram call takes.
+ */
+void SetBuildLatency(std::chrono::microseconds latency);
+/**
+ Set the log every subsequent clBuildProgram call produces.
+ A build fails with CL_BUILD_PROGRAM_FAILURE when the log contains an error.
+ */
+void SetBuildLog(std::string log);
+/**
+ Produce the build log per program, overrides SetBuildLog.
+ */
+void SetBuildLogCallback(BuildLogCallback callback);
+/**
+ Number of clBuildProgram calls since the last reset.
+ */
+uint64_t GetBuildCount();
+/**
+ Restore the default device, zero latency and an empty build log.
+ */
+void Reset();
+
+} // namespace ocls::mock
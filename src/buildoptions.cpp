@@ -0,0 +1,316 @@
+//
+//  buildoptions.cpp
+//  opencl-language-server
+//
+
+#include "buildoptions.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <iterator>
+#include <stdexcept>
+
+namespace ocls {
+
+namespace {
+
+constexpr char logger[] = "diagnostics";
+
+// https://registry.khronos.org/OpenCL/specs/3.0-unified/html/OpenCL_API.html#compiler-options
+const std::set<std::string> knownFlags = {
+    "-cl-denorms-are-zero",
+    "-cl-fast-relaxed-math",
+    "-cl-finite-math-only",
+    "-cl-fp32-correctly-rounded-divide-sqrt",
+    "-cl-kernel-arg-info",
+    "-cl-mad-enable",
+    "-cl-no-signed-zeros",
+    "-cl-no-subgroup-ifp",
+    "-cl-opt-disable",
+    "-cl-single-precision-constant",
+    "-cl-strict-aliasing",
+    "-cl-uniform-work-group-size",
+    "-cl-unsafe-math-optimizations",
+};
+
+const std::set<std::string> knownStandards = {
+    "CL1.0", "CL1.1", "CL1.2", "CL2.0", "CL3.0", "CLC++", "CLC++1.0", "CLC++2021"};
+
+// options the next argument belongs to, unless it is attached
+const std::set<std::string> optionsWithArgument = {"-D", "-U", "-I", "-x", "-include"};
+
+constexpr char standardPrefix[] = "-cl-std=";
+
+// Split on white space, double quotes keep spaces in an argument
+std::vector<std::string> Tokenize(const std::string& options)
+{
+    std::vector<std::string> tokens;
+    std::string token;
+    bool quoted = false;
+    bool started = false;
+    for (const char c : options)
+    {
+        if (c == '"')
+        {
+            quoted = !quoted;
+            started = true;
+        }
+        else if (!quoted && std::isspace(static_cast<unsigned char>(c)))
+        {
+            if (started)
+                tokens.push_back(std::move(token));
+            token.clear();
+            started = false;
+        }
+        else
+        {
+            token.push_back(c);
+            started = true;
+        }
+    }
+    if (quoted)
+        throw std::invalid_argument("unterminated quote in '" + options + "'");
+    if (started)
+        tokens.push_back(std::move(token));
+    return tokens;
+}
+
+bool IsIdentifier(const std::string& name)
+{
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name.front())))
+        return false;
+    return std::all_of(name.begin(), name.end(), [](unsigned char c) { return std::isalnum(c) || c == '_'; });
+}
+
+// Returns the macro name of NAME, NAME=value or NAME(args)=value
+std::string GetMacroName(const std::string& definition)
+{
+    const auto name = definition.substr(0, definition.find_first_of("=("));
+    if (!IsIdentifier(name))
+        throw std::invalid_argument("invalid macro name in '-D" + definition + "'");
+    if (definition.size() > name.size() && definition[name.size()] == '(' &&
+        definition.find(')', name.size()) == std::string::npos)
+        throw std::invalid_argument("unterminated macro parameters in '-D" + definition + "'");
+    return name;
+}
+
+std::string Quote(const std::string& argument)
+{
+    if (std::none_of(argument.begin(), argument.end(), [](unsigned char c) { return std::isspace(c); }))
+        return argument;
+    return '"' + argument + '"';
+}
+
+void AppendOption(std::string& out, const std::string& option)
+{
+    if (!out.empty())
+        out.push_back(' ');
+    out.append(option);
+}
+
+// FNV-1a, std::hash differs between standard libraries
+uint64_t Hash(const std::string& str)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : str)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+} // namespace
+
+BuildOptions BuildOptions::Parse(const nlohmann::json& options)
+{
+    if (!options.is_array())
+        throw std::invalid_argument("build options must be an array of strings");
+
+    std::vector<std::string> tokens;
+    for (const auto& option : options)
+    {
+        if (!option.is_string())
+            throw std::invalid_argument("build option " + option.dump() + " is not a string");
+        auto optionTokens = Tokenize(option.get<std::string>());
+        tokens.insert(tokens.end(), optionTokens.begin(), optionTokens.end());
+    }
+
+    BuildOptions result;
+    // the previous option is passed through, so it may take a separate argument
+    bool argumentAllowed = false;
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        auto option = tokens[i];
+        if (option.empty() || option.front() != '-')
+        {
+            // the argument of an option the server does not interpret, e.g. -s <file> of Intel compilers
+            if (!argumentAllowed)
+                throw std::invalid_argument("unexpected argument '" + option + "'");
+            result.m_otherOptions.back().append(" " + Quote(option));
+            argumentAllowed = false;
+            continue;
+        }
+        argumentAllowed = false;
+        std::string argument;
+        if (optionsWithArgument.count(option) > 0)
+        {
+            if (i + 1 == tokens.size())
+                throw std::invalid_argument("missing argument of '" + option + "'");
+            argument = tokens[++i];
+        }
+        else
+        {
+            for (const auto* prefix : {"-D", "-U", "-I"})
+            {
+                if (option.size() > 2 && option.compare(0, 2, prefix) == 0)
+                {
+                    argument = option.substr(2);
+                    option = prefix;
+                    break;
+                }
+            }
+        }
+
+        if (option == "-D")
+            result.AddDefine(argument);
+        else if (option == "-U")
+            result.AddUndefine(argument);
+        else if (option == "-I")
+            result.AddIncludePath(argument);
+        else if (!argument.empty())
+            result.m_otherOptions.push_back(option + " " + Quote(argument));
+        else
+            argumentAllowed = result.AddOption(option);
+    }
+    result.Finalize();
+    return result;
+}
+
+const std::string& BuildOptions::GetString() const
+{
+    return m_string;
+}
+
+uint64_t BuildOptions::GetKey() const
+{
+    return m_key;
+}
+
+const std::map<std::string, std::optional<std::string>>& BuildOptions::GetDefines() const
+{
+    return m_defines;
+}
+
+const std::vector<std::string>& BuildOptions::GetIncludePaths() const
+{
+    return m_includePaths;
+}
+
+const std::optional<std::string>& BuildOptions::GetStandard() const
+{
+    return m_standard;
+}
+
+const std::set<std::string>& BuildOptions::GetFlags() const
+{
+    return m_flags;
+}
+
+const std::vector<std::string>& BuildOptions::GetOtherOptions() const
+{
+    return m_otherOptions;
+}
+
+BuildOptions BuildOptions::WithIncludePaths(const std::vector<std::string>& paths) const
+{
+    auto options = *this;
+    options.m_includePaths.clear();
+    for (const auto& path : paths)
+        options.AddIncludePath(path);
+    for (const auto& path : m_includePaths)
+        options.AddIncludePath(path);
+    options.Finalize();
+    return options;
+}
+
+bool BuildOptions::operator==(const BuildOptions& other) const
+{
+    return m_key == other.m_key && m_string == other.m_string;
+}
+
+bool BuildOptions::operator!=(const BuildOptions& other) const
+{
+    return !(*this == other);
+}
+
+void BuildOptions::AddDefine(const std::string& definition)
+{
+    // -DNAME defines NAME as 1, a later definition of the macro replaces the earlier one
+    const auto name = GetMacroName(definition);
+    m_defines[name] = definition.size() == name.size() ? name + "=1" : definition;
+}
+
+void BuildOptions::AddUndefine(const std::string& name)
+{
+    if (!IsIdentifier(name))
+        throw std::invalid_argument("invalid macro name in '-U" + name + "'");
+    m_defines[name] = std::nullopt;
+}
+
+void BuildOptions::AddIncludePath(const std::string& path)
+{
+    auto normalized = std::filesystem::path(path).lexically_normal().generic_string();
+    if (normalized.size() > 1 && normalized.back() == '/')
+        normalized.pop_back();
+    if (normalized.empty())
+        throw std::invalid_argument("empty include path");
+    // the first occurrence decides the search order
+    if (std::find(m_includePaths.begin(), m_includePaths.end(), normalized) == m_includePaths.end())
+        m_includePaths.push_back(std::move(normalized));
+}
+
+// Returns true if the option is kept in the other options
+bool BuildOptions::AddOption(const std::string& option)
+{
+    if (option.size() < 2)
+        throw std::invalid_argument("unexpected argument '" + option + "'");
+    if (option.compare(0, std::size(standardPrefix) - 1, standardPrefix) == 0)
+    {
+        const auto standard = option.substr(std::size(standardPrefix) - 1);
+        if (knownStandards.count(standard) == 0)
+            throw std::invalid_argument("unknown OpenCL C version '" + option + "'");
+        m_standard = standard;
+        return false;
+    }
+    if (knownFlags.count(option) > 0)
+    {
+        m_flags.insert(option);
+        return false;
+    }
+    // vendors extend the -cl-* options, the compiler decides whether it supports them
+    if (option.compare(0, 4, "-cl-") == 0)
+        logging::Get<logger>().warn("Passing the unknown option '{}' to the compiler", option);
+    m_otherOptions.push_back(option);
+    return true;
+}
+
+void BuildOptions::Finalize()
+{
+    m_string.clear();
+    if (m_standard)
+        AppendOption(m_string, standardPrefix + *m_standard);
+    for (const auto& flag : m_flags)
+        AppendOption(m_string, flag);
+    for (const auto& [name, definition] : m_defines)
+        AppendOption(m_string, definition ? "-D" + Quote(*definition) : "-U" + name);
+    for (const auto& path : m_includePaths)
+        AppendOption(m_string, "-I" + Quote(path));
+    for (const auto& option : m_otherOptions)
+        AppendOption(m_string, option);
+    m_key = Hash(m_string);
+}
+
+} // namespace ocls
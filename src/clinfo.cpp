@@ -6,6 +6,7 @@
 //
 
 #include "clinfo.hpp"
+#include "logging.hpp"
 #include "utils.hpp"
 
 #include <array>
@@ -15,6 +16,7 @@
 using namespace nlohmann;
 using namespace ocls::utils;
 using ocls::ICLInfo;
+namespace logging = ocls::logging;
 
 namespace {
 
@@ -351,7 +353,7 @@ json::object_t GetDeviceJSONInfo(const cl::Device& device)
         }
         catch (const cl::Error& err)
         {
-            spdlog::get(logger)->error("Failed to get info for the device, {}", err.what());
+            logging::Get<logger>().error("Failed to get info for the device, {}", err.what());
             continue;
         }
     }
@@ -374,7 +376,7 @@ uint32_t CalculateDeviceID(const cl::Device& device)
     }
     catch (const cl::Error& err)
     {
-        spdlog::get(logger)->error("Failed to calculate device uuid, {}", err.what());
+        logging::Get<logger>().error("Failed to calculate device uuid, {}", err.what());
     }
     return 0;
 }
@@ -404,7 +406,7 @@ uint32_t CalculatePlatformID(const cl::Platform& platform)
     }
     catch (const cl::Error& err)
     {
-        spdlog::get(logger)->error("Failed to calculate platform uuid, {}", err.what());
+        logging::Get<logger>().error("Failed to calculate platform uuid, {}", err.what());
     }
     return 0;
 }
@@ -423,7 +425,7 @@ json GetPlatformJSONInfo(const cl::Platform& platform)
         }
         catch (const cl::Error& err)
         {
-            spdlog::get(logger)->error("Failed to get info for a platform, {}", err.what());
+            logging::Get<logger>().error("Failed to get info for a platform, {}", err.what());
         }
     }
 
@@ -441,7 +443,7 @@ json GetPlatformJSONInfo(const cl::Platform& platform)
     }
     catch (const cl::Error& err)
     {
-        spdlog::get(logger)->error("Failed to get devices for a platform, {}", err.what());
+        logging::Get<logger>().error("Failed to get devices for a platform, {}", err.what());
     }
 
     return info;
@@ -452,7 +454,7 @@ class CLInfo final : public ICLInfo
 public:
     nlohmann::json json()
     {
-        spdlog::get(logger)->trace("Searching for OpenCL platforms...");
+        logging::Get<logger>().trace("Searching for OpenCL platforms...");
         std::vector<cl::Platform> platforms;
         try
         {
@@ -460,10 +462,10 @@ public:
         }
         catch (const cl::Error& err)
         {
-            spdlog::get(logger)->error("No OpenCL platforms were found ({})", err.what());
+            logging::Get<logger>().error("No OpenCL platforms were found ({})", err.what());
         }
 
-        spdlog::get(logger)->info("Found OpenCL platforms, {}", platforms.size());
+        logging::Get<logger>().info("Found OpenCL platforms, {}", platforms.size());
         if (platforms.size() == 0)
         {
             return {};
@@ -0,0 +1,865 @@
+//
+//  daemon.cpp
+//  opencl-language-server
+//
+
+#include "daemon.hpp"
+#include "clinfo.hpp"
+#include "diagnostics.hpp"
+#include "logging.hpp"
+#include "lsp.hpp"
+#include "metrics.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if !defined(WIN32)
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+#if defined(__linux__)
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+#endif
+
+namespace ocls {
+
+namespace {
+
+constexpr char logger[] = "lsp";
+constexpr size_t bufferSize = 64 * 1024;
+
+#if !defined(WIN32)
+
+std::runtime_error SystemError(const std::string& what)
+{
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+sockaddr_un GetSocketAddress(const std::string& path)
+{
+    sockaddr_un address {};
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error("Invalid socket path '" + path + "'");
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+// Returns the connected socket or -1
+int ConnectUnixSocket(const std::string& path)
+{
+    const auto address = GetSocketAddress(path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool WriteAll(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const auto written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+#endif
+
+#if defined(__linux__)
+
+// The comparison takes the same time wherever the strings differ, so the token cannot be guessed byte by byte
+bool TokensEqual(std::string_view left, std::string_view right)
+{
+    if (left.size() != right.size())
+        return false;
+    unsigned char difference = 0;
+    for (size_t i = 0; i < left.size(); ++i)
+        difference |= static_cast<unsigned char>(left[i] ^ right[i]);
+    return difference == 0;
+}
+
+class Daemon final : public IDaemon
+{
+public:
+    explicit Daemon(const DaemonOptions& options);
+    ~Daemon();
+
+    void ListenUnix(const std::string& path);
+    void ListenTcp(uint16_t port);
+    void WriteToken();
+
+    int Run();
+    void Stop();
+    uint16_t GetPort() const;
+
+private:
+    struct Connection
+    {
+        int fd = -1;
+        std::shared_ptr<ILSPServer> server;
+        // framed messages that were not sent yet, starting at the offset
+        std::string output;
+        size_t outputOffset = 0;
+        // the events are edge-triggered, so the socket stays readable until a read would block
+        bool readable = false;
+        // too much output is pending, the input is left in the socket until the client reads it
+        bool readPaused = false;
+        // the client has exited, the connection is closed once the output is sent
+        bool closing = false;
+        // the client has sent the token, or does not need to
+        bool authenticated = false;
+        // the first line of the client while it is incomplete
+        std::string handshake;
+        // the server is in use by one of the threads, the other leaves it and the socket alone,
+        // guarded by the mutex of the daemon like the queued flag
+        bool busy = false;
+        // the connection waits for the worker to run its next build
+        bool queued = false;
+        // the worker runs a build, the messages it sends are kept in the build output until it completes
+        bool building = false;
+        std::string buildOutput;
+    };
+
+    void Listen(int domain, const sockaddr* address, socklen_t size);
+    void SetBufferSizes(int fd);
+    void Release();
+    void Accept();
+    bool Read(Connection& connection);
+    std::optional<size_t> Authenticate(Connection& connection, const char* data, size_t size);
+    bool Flush(Connection& connection);
+    void Close(Connection& connection);
+    bool TryLock(Connection& connection);
+    void Unlock(Connection& connection);
+    void ScheduleBuilds();
+    void CompleteBuilds();
+    void RunBuilds();
+
+private:
+    DaemonOptions m_options;
+    std::string m_path;
+    std::string m_address;
+    // TCP clients send it in their first line
+    std::string m_token;
+    uint16_t m_port = 0;
+    int m_listener = -1;
+    int m_epoll = -1;
+    int m_wakeup = -1;
+    // signaled by the worker when builds complete
+    int m_completion = -1;
+    std::shared_ptr<IBuildEnvironment> m_environment;
+    std::unordered_map<int, std::unique_ptr<Connection>> m_connections;
+    // connections whose servers may have builds scheduled
+    std::unordered_set<int> m_building;
+    std::vector<char> m_buffer;
+    // the builds run on the worker, so that a long build does not hold up the other clients
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_buildReady;
+    std::deque<Connection*> m_buildQueue;
+    // connections whose build has completed, with whether more builds are scheduled
+    std::vector<std::pair<Connection*, bool>> m_completedBuilds;
+    bool m_stopping = false;
+};
+
+Daemon::Daemon(const DaemonOptions& options)
+    : m_options {options}
+    , m_environment {CreateBuildEnvironment(CreateCLInfo())}
+    , m_buffer(bufferSize)
+{
+    try
+    {
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll < 0)
+            throw SystemError("Failed to create the event loop");
+        for (auto* fd : {&m_wakeup, &m_completion})
+        {
+            *fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (*fd < 0)
+                throw SystemError("Failed to create the event loop");
+            epoll_event event {};
+            event.events = EPOLLIN;
+            event.data.fd = *fd;
+            if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, *fd, &event) != 0)
+                throw SystemError("Failed to create the event loop");
+        }
+        m_worker = std::thread([this] { RunBuilds(); });
+    }
+    catch (...)
+    {
+        Release();
+        throw;
+    }
+}
+
+Daemon::~Daemon()
+{
+    Release();
+}
+
+void Daemon::ListenUnix(const std::string& path)
+{
+    const auto address = GetSocketAddress(path);
+    if (access(path.c_str(), F_OK) == 0)
+    {
+        const int fd = ConnectUnixSocket(path);
+        if (fd >= 0)
+        {
+            close(fd);
+            throw std::runtime_error("Another server is listening on '" + path + "'");
+        }
+        logging::Get<logger>().info("Removing the stale socket '{}'", path);
+        unlink(path.c_str());
+    }
+
+    m_address = path;
+    Listen(AF_UNIX, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    m_path = path;
+}
+
+void Daemon::ListenTcp(uint16_t port)
+{
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    m_address = "127.0.0.1:" + std::to_string(port);
+    Listen(AF_INET, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+
+    socklen_t size = sizeof(address);
+    if (getsockname(m_listener, reinterpret_cast<sockaddr*>(&address), &size) != 0)
+        throw SystemError("Failed to get the port of '" + m_address + "'");
+    m_port = ntohs(address.sin_port);
+    m_address = "127.0.0.1:" + std::to_string(m_port);
+}
+
+// Every user can connect to the loopback interface, the token is readable by the user of the daemon only
+void Daemon::WriteToken()
+{
+    const auto& path = m_options.tokenFile;
+    if (path.empty())
+        throw std::runtime_error("A token file is required to listen on a TCP port");
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        throw SystemError("Failed to create the token file '" + path + "'");
+    // an existing file keeps its mode on open
+    const auto token = utils::GenerateId();
+    const auto line = token + "\n";
+    const bool written = fchmod(fd, S_IRUSR | S_IWUSR) == 0 && WriteAll(fd, line.data(), line.size());
+    close(fd);
+    if (!written)
+    {
+        const auto error = SystemError("Failed to write the token file '" + path + "'");
+        unlink(path.c_str());
+        throw error;
+    }
+    m_token = token;
+    logging::Get<logger>().info("Clients authenticate with the token in '{}'", path);
+}
+
+void Daemon::Listen(int domain, const sockaddr* address, socklen_t size)
+{
+    m_listener = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listener < 0)
+        throw SystemError("Failed to create the socket");
+    if (domain == AF_INET)
+    {
+        const int enable = 1;
+        setsockopt(m_listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        // accepted sockets inherit the sizes, TCP needs them before the connection to scale the window
+        SetBufferSizes(m_listener);
+    }
+    if (bind(m_listener, address, size) != 0)
+    {
+        close(m_listener);
+        m_listener = -1;
+        throw SystemError("Failed to bind the socket '" + m_address + "'");
+    }
+    // the clients share the devices and the builds, only the user running the daemon may connect,
+    // nobody can connect before the socket listens
+    if (domain == AF_UNIX && chmod(m_address.c_str(), S_IRUSR | S_IWUSR) != 0)
+    {
+        const auto error = SystemError("Failed to restrict the access to the socket '" + m_address + "'");
+        close(m_listener);
+        m_listener = -1;
+        unlink(m_address.c_str());
+        throw error;
+    }
+    if (listen(m_listener, SOMAXCONN) != 0)
+        throw SystemError("Failed to listen on the socket '" + m_address + "'");
+
+    epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.fd = m_listener;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_listener, &event) != 0)
+        throw SystemError("Failed to create the event loop");
+}
+
+void Daemon::SetBufferSizes(int fd)
+{
+    const std::pair<int, size_t> sizes[] = {
+        {SO_RCVBUF, m_options.receiveBufferSize},
+        {SO_SNDBUF, m_options.sendBufferSize},
+    };
+    for (const auto& [option, size] : sizes)
+    {
+        if (size == 0)
+            continue;
+        const int value = static_cast<int>(std::min<size_t>(size, std::numeric_limits<int>::max()));
+        if (setsockopt(fd, SOL_SOCKET, option, &value, sizeof(value)) != 0)
+            logging::Get<logger>().warn("Failed to set the socket buffer size, {}", std::strerror(errno));
+    }
+}
+
+void Daemon::Release()
+{
+    // the build that runs is finished, the queued ones are dropped with their connections
+    if (m_worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_buildReady.notify_one();
+        m_worker.join();
+    }
+    for (auto& connection : m_connections)
+        close(connection.first);
+    m_connections.clear();
+    for (auto* fd : {&m_wakeup, &m_completion, &m_epoll})
+    {
+        if (*fd >= 0)
+            close(*fd);
+        *fd = -1;
+    }
+    if (m_listener >= 0)
+    {
+        close(m_listener);
+        if (!m_path.empty())
+            unlink(m_path.c_str());
+        m_listener = -1;
+    }
+    if (!m_token.empty())
+    {
+        unlink(m_options.tokenFile.c_str());
+        m_token.clear();
+    }
+}
+
+int Daemon::Run()
+{
+    logging::Get<logger>().info("Listening on '{}'", m_address);
+    constexpr int maxEvents = 64;
+    epoll_event events[maxEvents];
+    while (true)
+    {
+        // the received messages are handled first, then one scheduled build per client is queued for the worker
+        const int count = epoll_wait(m_epoll, events, maxEvents, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            logging::Get<logger>().error("Failed to wait for events, {}", std::strerror(errno));
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == m_wakeup)
+            {
+                logging::Get<logger>().info("Stopping, {} clients are connected", m_connections.size());
+                return EXIT_SUCCESS;
+            }
+            if (fd == m_listener)
+            {
+                Accept();
+                continue;
+            }
+            if (fd == m_completion)
+            {
+                CompleteBuilds();
+                continue;
+            }
+            // the connection may have been closed while handling the previous events
+            auto found = m_connections.find(fd);
+            if (found == m_connections.end())
+                continue;
+            auto& connection = *found->second;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                connection.readable = true;
+            // the output is flushed and the input read once the build of the connection completes
+            if (!TryLock(connection))
+                continue;
+            if ((events[i].events & EPOLLOUT) && !Flush(connection))
+                continue;
+            if (connection.readable && !connection.readPaused && !Read(connection))
+                continue;
+            Unlock(connection);
+        }
+        ScheduleBuilds();
+    }
+}
+
+void Daemon::Stop()
+{
+    const uint64_t value = 1;
+    if (write(m_wakeup, &value, sizeof(value)) < 0)
+    {
+        // nothing can be done in a signal handler
+    }
+}
+
+uint16_t Daemon::GetPort() const
+{
+    return m_port;
+}
+
+void Daemon::Accept()
+{
+    while (true)
+    {
+        const int fd = accept4(m_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                logging::Get<logger>().error("Failed to accept a client, {}", std::strerror(errno));
+            return;
+        }
+        if (m_port != 0)
+        {
+            // responses are written whole, there is nothing to gain from delaying them
+            const int enable = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        }
+        else
+        {
+            SetBufferSizes(fd);
+        }
+
+        auto connection = std::make_unique<Connection>();
+        connection->fd = fd;
+        connection->authenticated = m_token.empty();
+        auto* target = connection.get();
+        // messages are queued and sent once the server is done with the received bytes,
+        // the thread that uses the server is the only one that accesses the target
+        connection->server = CreateLSPServer(
+            nullptr,
+            [target](const std::string& message) {
+                (target->building ? target->buildOutput : target->output).append(message);
+            },
+            m_environment);
+
+        // watched for both directions once, the edges tell when to read or write again
+        epoll_event event {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = fd;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            logging::Get<logger>().error("Failed to watch a client, {}", std::strerror(errno));
+            close(fd);
+            continue;
+        }
+        m_connections.emplace(fd, std::move(connection));
+        metrics::SetGauge(metrics::Gauge::Connections, static_cast<int64_t>(m_connections.size()));
+        logging::Get<logger>().info("Client {} connected, {} clients in total", fd, m_connections.size());
+    }
+}
+
+// Returns false if the connection was closed
+bool Daemon::Read(Connection& connection)
+{
+    while (connection.readable && !connection.closing)
+    {
+        if (connection.output.size() - connection.outputOffset > m_options.maxPendingOutput)
+        {
+            if (!Flush(connection))
+                return false;
+            if (connection.readPaused)
+            {
+                logging::Get<logger>().debug("Client {} reads slowly, pausing its input", connection.fd);
+                metrics::Increment(metrics::Counter::PausedInputs);
+                return true;
+            }
+            continue;
+        }
+        const auto size = read(connection.fd, m_buffer.data(), m_buffer.size());
+        if (size > 0)
+        {
+            size_t offset = 0;
+            if (!connection.authenticated)
+            {
+                const auto handshake = Authenticate(connection, m_buffer.data(), static_cast<size_t>(size));
+                if (!handshake)
+                {
+                    logging::Get<logger>().warn("Client {} sent a wrong token, closing the connection", connection.fd);
+                    metrics::Increment(metrics::Counter::RejectedClients);
+                    Close(connection);
+                    return false;
+                }
+                offset = *handshake;
+                if (offset == static_cast<size_t>(size))
+                    continue;
+            }
+            if (const auto exitCode =
+                    connection.server->Consume(m_buffer.data() + offset, static_cast<size_t>(size) - offset))
+            {
+                logging::Get<logger>().info("Client {} exited with code {}", connection.fd, *exitCode);
+                connection.closing = true;
+            }
+            else
+            {
+                m_building.insert(connection.fd);
+            }
+            continue;
+        }
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            connection.readable = false;
+            break;
+        }
+        // the client has gone, its pending messages can not be delivered
+        Close(connection);
+        return false;
+    }
+    return Flush(connection);
+}
+
+// Returns the number of bytes of the first line in the data, or nothing if the line is not the token
+std::optional<size_t> Daemon::Authenticate(Connection& connection, const char* data, size_t size)
+{
+    const auto* end = static_cast<const char*>(std::memchr(data, '\n', size));
+    const auto length = end ? static_cast<size_t>(end - data) : size;
+    auto& line = connection.handshake;
+    line.append(data, length);
+    // the line may end with CRLF
+    if (line.size() > m_token.size() + 1)
+        return std::nullopt;
+    if (!end)
+        return size;
+    if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+    if (!TokensEqual(line, m_token))
+        return std::nullopt;
+    connection.authenticated = true;
+    std::string().swap(line);
+    return length + 1;
+}
+
+// Returns false if the connection was closed
+bool Daemon::Flush(Connection& connection)
+{
+    auto& output = connection.output;
+    while (connection.outputOffset < output.size())
+    {
+        const auto size = send(
+            connection.fd,
+            output.data() + connection.outputOffset,
+            output.size() - connection.outputOffset,
+            MSG_NOSIGNAL);
+        if (size >= 0)
+        {
+            connection.outputOffset += static_cast<size_t>(size);
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        logging::Get<logger>().error("Failed to write to client {}, {}", connection.fd, std::strerror(errno));
+        Close(connection);
+        return false;
+    }
+
+    if (connection.outputOffset == output.size())
+    {
+        output.clear();
+        connection.outputOffset = 0;
+        if (connection.closing)
+        {
+            Close(connection);
+            return false;
+        }
+    }
+    else if (connection.outputOffset >= bufferSize && connection.outputOffset * 2 >= output.size())
+    {
+        // drop the sent part, so that the queue does not keep growing while the client reads slowly
+        output.erase(0, connection.outputOffset);
+        connection.outputOffset = 0;
+    }
+
+    const auto pending = output.size() - connection.outputOffset;
+    const bool wasPaused = connection.readPaused;
+    connection.readPaused =
+        pending > (connection.readPaused ? m_options.maxPendingOutput / 2 : m_options.maxPendingOutput);
+    if (wasPaused && !connection.readPaused)
+        m_building.insert(connection.fd);
+    return true;
+}
+
+// The connection must be acquired
+void Daemon::Close(Connection& connection)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_buildQueue.erase(std::remove(m_buildQueue.begin(), m_buildQueue.end(), &connection), m_buildQueue.end());
+    }
+    const int fd = connection.fd;
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    m_connections.erase(fd);
+    m_building.erase(fd);
+    metrics::SetGauge(metrics::Gauge::Connections, static_cast<int64_t>(m_connections.size()));
+    logging::Get<logger>().info("Client {} disconnected, {} clients in total", fd, m_connections.size());
+}
+
+// Take the connection over from the worker, returns false if the worker builds for it.
+// A queued connection stays in its place, the worker skips it until it is unlocked.
+bool Daemon::TryLock(Connection& connection)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (connection.busy)
+        return false;
+    connection.busy = true;
+    return true;
+}
+
+void Daemon::Unlock(Connection& connection)
+{
+    bool queued;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        connection.busy = false;
+        queued = connection.queued;
+    }
+    if (queued)
+        m_buildReady.notify_one();
+}
+
+// Queue one build of every client with scheduled builds, in the order their messages arrived
+void Daemon::ScheduleBuilds()
+{
+    bool scheduled = false;
+    for (const int fd : m_building)
+    {
+        auto& connection = *m_connections.at(fd);
+        // the output of a slow client is not queued further, its builds resume once it reads
+        if (connection.readPaused || !TryLock(connection))
+            continue;
+        if (!connection.queued && connection.server->HasScheduledBuild())
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            connection.queued = true;
+            m_buildQueue.push_back(&connection);
+            scheduled = true;
+        }
+        Unlock(connection);
+    }
+    m_building.clear();
+    if (scheduled)
+        m_buildReady.notify_one();
+}
+
+void Daemon::CompleteBuilds()
+{
+    uint64_t value = 0;
+    if (read(m_completion, &value, sizeof(value)) < 0)
+    {
+        // the counter is reset already, the completed builds are taken below
+    }
+    std::vector<std::pair<Connection*, bool>> completed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        completed.swap(m_completedBuilds);
+        // the build is over, the worker no longer uses the connections
+        for (auto& [connection, pending] : completed)
+        {
+            connection->building = false;
+            connection->output.append(connection->buildOutput);
+            connection->buildOutput.clear();
+        }
+    }
+    for (auto& [connection, pending] : completed)
+    {
+        if (pending)
+            m_building.insert(connection->fd);
+        if (!Flush(*connection))
+            continue;
+        if (connection->readable && !connection->readPaused && !Read(*connection))
+            continue;
+        Unlock(*connection);
+    }
+}
+
+void Daemon::RunBuilds()
+{
+    while (true)
+    {
+        Connection* connection = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto next = m_buildQueue.end();
+            m_buildReady.wait(lock, [this, &next] {
+                next = std::find_if(m_buildQueue.begin(), m_buildQueue.end(), [](const Connection* connection) {
+                    return !connection->busy;
+                });
+                return m_stopping || next != m_buildQueue.end();
+            });
+            if (m_stopping)
+                return;
+            connection = *next;
+            m_buildQueue.erase(next);
+            connection->queued = false;
+            connection->busy = true;
+            connection->building = true;
+        }
+        const bool pending = connection->server->RunScheduledBuild();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_completedBuilds.emplace_back(connection, pending);
+        }
+        const uint64_t value = 1;
+        if (write(m_completion, &value, sizeof(value)) < 0)
+            logging::Get<logger>().error("Failed to signal the completed build, {}", std::strerror(errno));
+    }
+}
+
+#endif
+
+} // namespace
+
+std::shared_ptr<IDaemon> CreateDaemon(const std::string& socketPath, const DaemonOptions& options)
+{
+#if defined(__linux__)
+    auto daemon = std::make_shared<Daemon>(options);
+    daemon->ListenUnix(socketPath);
+    return daemon;
+#else
+    (void)socketPath;
+    (void)options;
+    throw std::runtime_error("Listening on a socket is only supported on Linux");
+#endif
+}
+
+std::shared_ptr<IDaemon> CreateDaemon(uint16_t port, const DaemonOptions& options)
+{
+#if defined(__linux__)
+    auto daemon = std::make_shared<Daemon>(options);
+    daemon->WriteToken();
+    daemon->ListenTcp(port);
+    return daemon;
+#else
+    (void)port;
+    (void)options;
+    throw std::runtime_error("Listening on a socket is only supported on Linux");
+#endif
+}
+
+int RelayToDaemon(const std::string& socketPath)
+{
+#if defined(WIN32)
+    (void)socketPath;
+    std::cerr << "Connecting to a socket is not supported on Windows" << std::endl;
+    return EXIT_FAILURE;
+#else
+    signal(SIGPIPE, SIG_IGN);
+    int fd = -1;
+    try
+    {
+        fd = ConnectUnixSocket(socketPath);
+    }
+    catch (const std::exception& err)
+    {
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (fd < 0)
+    {
+        std::cerr << "Failed to connect to '" << socketPath << "': " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    logging::Get<logger>().info("Connected to '{}'", socketPath);
+
+    std::vector<char> buffer(bufferSize);
+    pollfd fds[] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    while (true)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents != 0)
+        {
+            const auto size = read(STDIN_FILENO, buffer.data(), buffer.size());
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size <= 0)
+            {
+                // let the daemon see the end of the input, then wait for it to close the connection
+                shutdown(fd, SHUT_WR);
+                fds[0].fd = -1;
+            }
+            else if (!WriteAll(fd, buffer.data(), static_cast<size_t>(size)))
+            {
+                break;
+            }
+        }
+        if (fds[1].revents != 0)
+        {
+            const auto size = read(fd, buffer.data(), buffer.size());
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size <= 0 || !WriteAll(STDOUT_FILENO, buffer.data(), static_cast<size_t>(size)))
+                break;
+        }
+    }
+    close(fd);
+    logging::Get<logger>().info("Disconnected from '{}'", socketPath);
+    return EXIT_SUCCESS;
+#endif
+}
+
+} // namespace ocls
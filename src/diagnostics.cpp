@@ -6,17 +6,25 @@
 //
 
 #include "diagnostics.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
 #include "utils.hpp"
 
 #include <CL/opencl.hpp>
 
+#include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <optional>
-#include <regex>
 #include <spdlog/spdlog.h>
 #include <stdexcept> // std::runtime_error, std::invalid_argument
-#include <tuple>
+#include <string_view>
+#include <unordered_map>
 
 using namespace nlohmann;
 
@@ -24,28 +32,206 @@ namespace {
 
 constexpr char logger[] = "diagnostics";
 
-int ParseSeverity(const std::string& severity)
+struct LogLine
 {
-    if (severity == "error")
-        return 1;
-    else if (severity == "warning")
-        return 2;
-    else
-        return -1;
+    std::string_view source;
+    uint32_t line;
+    uint32_t character;
+    int8_t severity;
+    std::string_view message;
+};
+
+constexpr std::pair<std::string_view, int8_t> severities[] = {
+    {"fatal error: ", 1},
+    {"error: ", 1},
+    {"warning: ", 2},
+    {"Scholar: ", -1},
+};
+
+bool ParseNumber(std::string_view str, size_t& pos, uint32_t& value)
+{
+    const auto* begin = str.data() + pos;
+    const auto [ptr, ec] = std::from_chars(begin, str.data() + str.size(), value);
+    if (ec != std::errc() || ptr == begin)
+        return false;
+    pos += static_cast<size_t>(ptr - begin);
+    return true;
 }
 
 // <program source>:13:5: warning: no previous prototype for function 'getChannel'
-std::tuple<std::string, long, long, long, std::string> ParseOutput(const std::smatch& matches)
+std::optional<LogLine> ParseOutput(std::string_view line)
+{
+    std::optional<LogLine> output;
+    // The file name may contain ':' itself, so the last matching position wins
+    for (auto pos = line.find(':'); pos != std::string_view::npos; pos = line.find(':', pos + 1))
+    {
+        uint32_t lineNumber = 0;
+        uint32_t character = 0;
+        auto cur = pos + 1;
+        if (!ParseNumber(line, cur, lineNumber) || line.compare(cur, 1, ":") != 0)
+            continue;
+        ++cur;
+        if (!ParseNumber(line, cur, character) || line.compare(cur, 2, ": ") != 0)
+            continue;
+        cur += 2;
+        for (const auto& [label, severity] : severities)
+        {
+            if (line.compare(cur, label.size(), label) == 0)
+            {
+                // LSP assumes 0-indexed lines
+                const auto lspLine = lineNumber > 0 ? lineNumber - 1 : 0;
+                output = LogLine {line.substr(0, pos), lspLine, character, severity, line.substr(cur + label.size())};
+                break;
+            }
+        }
+    }
+    return output;
+}
+
+void AppendNumber(std::string& out, int64_t value)
+{
+    char buffer[24];
+    const auto [ptr, ec] = std::to_chars(std::begin(buffer), std::end(buffer), value);
+    out.append(buffer, static_cast<size_t>(ptr - buffer));
+}
+
+// Maps the file component of a build log line to the path of the file it refers to.
+// The built program itself is reported under a driver specific placeholder, e.g. '<program source>',
+// included files are reported by their path, which is relative to the built file unless an -I option was used.
+// A relative file is looked up next to the built file and then in the include directories
+std::string ResolveSourcePath(
+    const std::string& source, const std::string& filePath, const std::vector<std::filesystem::path>& searchPaths)
+{
+    if (source.empty() || source.front() == '<' || filePath.empty())
+        return filePath;
+
+    std::error_code ec;
+    auto path = std::filesystem::path(source);
+    if (path.is_relative())
+    {
+        const auto found = std::find_if(searchPaths.begin(), searchPaths.end(), [&path, &ec](const auto& directory) {
+            return std::filesystem::exists(directory / path, ec);
+        });
+        path = found != searchPaths.end() ? *found / path : std::filesystem::absolute(path, ec);
+    }
+    path = path.lexically_normal();
+    if (!std::filesystem::exists(path, ec) || std::filesystem::equivalent(path, filePath, ec))
+        return filePath;
+    return path.string();
+}
+
+// The search roots of a build: the directory of the built file, then the include paths in the search order
+std::vector<std::filesystem::path> GetSearchPaths(const std::string& filePath, const ocls::BuildOptions& options)
 {
-    std::string source = matches[1];
-    const long line = std::stoi(matches[2]) - 1; // LSP assumes 0-indexed lines
-    const long col = std::stoi(matches[3]);
-    const int severity = ParseSeverity(matches[4]);
-    // matches[5] - 'fatal'
-    std::string message = matches[6];
-    return std::make_tuple(std::move(source), line, col, severity, std::move(message));
+    std::error_code ec;
+    std::vector<std::filesystem::path> searchPaths {std::filesystem::path(filePath).parent_path()};
+    for (const auto& includePath : options.GetIncludePaths())
+        searchPaths.push_back(std::filesystem::absolute(includePath, ec).lexically_normal());
+    return searchPaths;
 }
 
+/**
+ Open documents written to a temporary directory, so the builds see the text the user is editing.
+ Every search root with an overlaid file is mirrored in a directory of its own that is searched before the
+ configured include paths. The directory is kept between the builds: only the files whose text changed are written,
+ the files of documents that are no longer overlaid are removed. It is removed with the object.
+ */
+class Overlays final
+{
+public:
+    Overlays() = default;
+
+    ~Overlays()
+    {
+        if (m_root.empty())
+            return;
+        std::error_code ec;
+        std::filesystem::remove_all(m_root, ec);
+    }
+
+    Overlays(const Overlays&) = delete;
+    Overlays& operator=(const Overlays&) = delete;
+
+    // Writes the documents under the search roots, the others cannot be included by the build.
+    // Returns the directories to search in the order of their roots.
+    std::vector<std::string> Update(
+        const std::map<std::string, ocls::SharedText>& documents, const std::vector<std::filesystem::path>& searchPaths)
+    {
+        std::vector<std::string> directories;
+        if (documents.empty() && m_files.empty())
+            return directories;
+        std::error_code ec;
+        if (m_root.empty())
+            m_root =
+                std::filesystem::temp_directory_path(ec) / ("opencl-language-server-" + ocls::utils::GenerateId());
+        std::unordered_map<std::string, File> files;
+        for (const auto& searchPath : searchPaths)
+        {
+            const auto directory = m_directories.emplace(searchPath, m_root / std::to_string(m_directories.size()));
+            const auto directoryPath = directory.first->second.string();
+            for (const auto& [path, text] : documents)
+            {
+                const auto relative = std::filesystem::path(path).lexically_normal().lexically_relative(searchPath);
+                if (!text || relative.empty() || *relative.begin() == "..")
+                    continue;
+                const auto overlayPath = (directory.first->second / relative).lexically_normal().string();
+                const auto file = m_files.find(overlayPath);
+                const bool unchanged = file != m_files.end() && file->second.text == text;
+                if (files.count(overlayPath) == 0 && !unchanged && !Write(overlayPath, *text))
+                {
+                    ocls::logging::Get<logger>().error("Failed to write the overlay of '{}'", path);
+                    continue;
+                }
+                files[overlayPath] = {path, text};
+                if (std::find(directories.begin(), directories.end(), directoryPath) == directories.end())
+                    directories.push_back(directoryPath);
+            }
+        }
+        for (const auto& [overlayPath, file] : m_files)
+        {
+            if (files.count(overlayPath) == 0)
+                std::filesystem::remove(overlayPath, ec);
+        }
+        m_files = std::move(files);
+        return directories;
+    }
+
+    // Returns the path of the document an overlay was written for, other paths are returned as they are
+    std::string GetDocumentPath(std::string path) const
+    {
+        const auto file = m_files.find(path);
+        return file == m_files.end() ? path : file->second.documentPath;
+    }
+
+private:
+    struct File
+    {
+        std::string documentPath;
+        // the text written to the file, compared by identity as every version of a document has its own
+        ocls::SharedText text;
+    };
+
+    static bool Write(const std::filesystem::path& path, const std::string& text)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        std::ofstream file(path, std::ios::binary);
+        file.write(text.data(), static_cast<std::streamsize>(text.size()));
+        if (file)
+            return true;
+        file.close();
+        std::filesystem::remove(path, ec);
+        return false;
+    }
+
+private:
+    std::filesystem::path m_root;
+    // search root -> directory mirroring it
+    std::map<std::filesystem::path, std::filesystem::path> m_directories;
+    // overlay path -> the document written to it
+    std::unordered_map<std::string, File> m_files;
+};
+
 size_t GetDevicePowerIndex(const cl::Device& device)
 {
     const size_t maxComputeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
@@ -57,36 +243,31 @@ size_t GetDevicePowerIndex(const cl::Device& device)
 
 namespace ocls {
 
-class Diagnostics final : public IDiagnostics
+class BuildEnvironment final : public IBuildEnvironment
 {
 public:
-    explicit Diagnostics(std::shared_ptr<ICLInfo> clInfo);
+    explicit BuildEnvironment(std::shared_ptr<ICLInfo> clInfo) : m_clInfo {std::move(clInfo)} {}
 
-    void SetBuildOptions(const nlohmann::json& options);
-    void SetMaxProblemsCount(int maxNumberOfProblems);
-    void SetOpenCLDevice(uint32_t identifier);
-    nlohmann::json Get(const Source& source);
+    std::optional<cl::Device> SelectDevice(uint32_t identifier);
+    cl::Context GetContext(const cl::Device& device);
 
 private:
-    nlohmann::json BuildDiagnostics(const std::string& buildLog, const std::string& name);
-    std::string BuildSource(const std::string& source) const;
+    const std::vector<cl::Device>& GetDevices();
 
 private:
     std::shared_ptr<ICLInfo> m_clInfo;
-    std::optional<cl::Device> m_device;
-    std::regex m_regex {"^(.*):(\\d+):(\\d+): ((fatal )?error|warning|Scholar): (.*)$"};
-    std::string m_BuildOptions;
-    int m_maxNumberOfProblems = 100;
+    std::mutex m_mutex;
+    std::optional<std::vector<cl::Device>> m_devices;
+    std::vector<std::pair<cl::Device, cl::Context>> m_contexts;
 };
 
-Diagnostics::Diagnostics(std::shared_ptr<ICLInfo> clInfo) : m_clInfo {std::move(clInfo)}
+const std::vector<cl::Device>& BuildEnvironment::GetDevices()
 {
-    SetOpenCLDevice(0);
-}
+    if (m_devices.has_value())
+        return *m_devices;
 
-void Diagnostics::SetOpenCLDevice(uint32_t identifier)
-{
-    spdlog::get(logger)->trace("Selecting OpenCL platform...");
+    m_devices.emplace();
+    logging::Get<logger>().trace("Selecting OpenCL platform...");
     std::vector<cl::Platform> platforms;
     try
     {
@@ -94,17 +275,10 @@ void Diagnostics::SetOpenCLDevice(uint32_t identifier)
     }
     catch (cl::Error& err)
     {
-        spdlog::get(logger)->error("No OpenCL platforms were found, {}", err.what());
-    }
-
-    spdlog::get(logger)->info("Found OpenCL platforms: {}", platforms.size());
-    if (platforms.size() == 0)
-    {
-        return;
+        logging::Get<logger>().error("No OpenCL platforms were found, {}", err.what());
     }
 
-    std::string description;
-    std::optional<cl::Device> selectedDevice;
+    logging::Get<logger>().info("Found OpenCL platforms: {}", platforms.size());
     for (auto& platform : platforms)
     {
         std::vector<cl::Device> devices;
@@ -114,51 +288,115 @@ void Diagnostics::SetOpenCLDevice(uint32_t identifier)
         }
         catch (cl::Error& err)
         {
-            spdlog::get(logger)->error("No OpenCL devices were found, {}", err.what());
+            logging::Get<logger>().error("No OpenCL devices were found, {}", err.what());
         }
-        spdlog::get(logger)->info("Found OpenCL devices: {}", devices.size());
-        if (devices.size() == 0)
+        logging::Get<logger>().info("Found OpenCL devices: {}", devices.size());
+        m_devices->insert(m_devices->end(), devices.begin(), devices.end());
+    }
+    return *m_devices;
+}
+
+std::optional<cl::Device> BuildEnvironment::SelectDevice(uint32_t identifier)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto& devices = GetDevices();
+    logging::Get<logger>().trace("Selecting OpenCL device (total: {})...", devices.size());
+
+    size_t maxPowerIndex = 0;
+    std::optional<cl::Device> selectedDevice;
+    for (const auto& device : devices)
+    {
+        size_t powerIndex = 0;
+        try
         {
+            if (identifier == m_clInfo->GetDeviceID(device))
+            {
+                selectedDevice = device;
+                break;
+            }
+            powerIndex = GetDevicePowerIndex(device);
+        }
+        catch (cl::Error& err)
+        {
+            logging::Get<logger>().error("Failed to get info for a device, {}", err.what());
             continue;
         }
 
-        size_t maxPowerIndex = 0;
-        spdlog::get(logger)->trace("Selecting OpenCL device (total: {})...", devices.size());
-        for (auto& device : devices)
+        if (powerIndex > maxPowerIndex)
         {
-            size_t powerIndex = 0;
-            try
-            {
-                description = m_clInfo->GetDeviceDescription(device);
-                auto deviceID = m_clInfo->GetDeviceID(device);
-                if (identifier == deviceID)
-                {
-                    selectedDevice = device;
-                    break;
-                }
-                else
-                {
-                    powerIndex = GetDevicePowerIndex(device);
-                }
-            }
-            catch (cl::Error& err)
-            {
-                spdlog::get(logger)->error("Failed to get info for a device, {}", err.what());
-                continue;
-            }
+            maxPowerIndex = powerIndex;
+            selectedDevice = device;
+        }
+    }
 
-            if (powerIndex > maxPowerIndex)
-            {
-                maxPowerIndex = powerIndex;
-                selectedDevice = device;
-            }
+    if (selectedDevice.has_value())
+    {
+        try
+        {
+            logging::Get<logger>().info("Selected OpenCL device: {}", m_clInfo->GetDeviceDescription(*selectedDevice));
         }
+        catch (cl::Error& err)
+        {
+            logging::Get<logger>().error("Failed to get info for a device, {}", err.what());
+        }
+    }
+    return selectedDevice;
+}
+
+cl::Context BuildEnvironment::GetContext(const cl::Device& device)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto& [contextDevice, context] : m_contexts)
+    {
+        if (contextDevice() == device())
+            return context;
     }
-    m_device = selectedDevice;
-    spdlog::get(logger)->info("Selected OpenCL device: {}", description);
+
+    tracing::Span span("opencl", "createContext");
+    std::vector<cl::Device> devices {device};
+    cl::Context context(devices, NULL, NULL, NULL);
+    m_contexts.emplace_back(device, context);
+    return context;
+}
+
+class Diagnostics final : public IDiagnostics
+{
+public:
+    explicit Diagnostics(std::shared_ptr<IBuildEnvironment> environment);
+
+    void SetBuildOptions(const BuildOptions& options);
+    void SetMaxProblemsCount(int maxNumberOfProblems);
+    void SetOpenCLDevice(uint32_t identifier);
+    DiagnosticsByFile Get(const Source& source);
+
+private:
+    DiagnosticsByFile BuildDiagnostics(
+        const std::string& buildLog,
+        const std::string& filePath,
+        const std::vector<std::filesystem::path>& searchPaths,
+        const Overlays& overlays);
+    std::string BuildSource(const std::string& source, const BuildOptions& buildOptions) const;
+
+private:
+    std::shared_ptr<IBuildEnvironment> m_environment;
+    Overlays m_overlays;
+    std::optional<cl::Device> m_device;
+    BuildOptions m_buildOptions;
+    int m_maxNumberOfProblems = 100;
+};
+
+Diagnostics::Diagnostics(std::shared_ptr<IBuildEnvironment> environment) : m_environment {std::move(environment)}
+{
+    SetOpenCLDevice(0);
+}
+
+void Diagnostics::SetOpenCLDevice(uint32_t identifier)
+{
+    tracing::Span span("opencl", "selectDevice");
+    m_device = m_environment->SelectDevice(identifier);
 }
 
-std::string Diagnostics::BuildSource(const std::string& source) const
+std::string Diagnostics::BuildSource(const std::string& source, const BuildOptions& buildOptions) const
 {
     if (!m_device.has_value())
     {
@@ -166,19 +404,24 @@ std::string Diagnostics::BuildSource(const std::string& source) const
     }
 
     std::vector<cl::Device> ds {*m_device};
-    cl::Context context(ds, NULL, NULL, NULL);
+    const auto context = m_environment->GetContext(*m_device);
     cl::Program program;
     try
     {
-        spdlog::get(logger)->debug("Building program with options: {}", m_BuildOptions);
-        program = cl::Program(context, source, false);
-        program.build(ds, m_BuildOptions.c_str());
+        const auto& options = buildOptions.GetString();
+        logging::Get<logger>().debug("Building program with options: {}", options);
+        {
+            tracing::Span span("opencl", "createProgram");
+            program = cl::Program(context, source, false);
+        }
+        tracing::Span span("opencl", "buildProgram", options);
+        program.build(ds, options.c_str());
     }
     catch (cl::Error& err)
     {
         if (err.err() != CL_BUILD_PROGRAM_FAILURE)
         {
-            spdlog::get(logger)->error("Failed to build program, error, {}", err.what());
+            logging::Get<logger>().error("Failed to build program, error, {}", err.what());
         }
     }
 
@@ -186,109 +429,163 @@ std::string Diagnostics::BuildSource(const std::string& source) const
 
     try
     {
+        tracing::Span span("opencl", "getBuildLog");
         program.getBuildInfo(*m_device, CL_PROGRAM_BUILD_LOG, &build_log);
     }
     catch (cl::Error& err)
     {
-        spdlog::get(logger)->error("Failed get build info, error, {}", err.what());
+        logging::Get<logger>().error("Failed get build info, error, {}", err.what());
     }
 
     return build_log;
 }
 
-nlohmann::json Diagnostics::BuildDiagnostics(const std::string& buildLog, const std::string& name)
+DiagnosticsByFile Diagnostics::BuildDiagnostics(
+    const std::string& buildLog,
+    const std::string& filePath,
+    const std::vector<std::filesystem::path>& searchPaths,
+    const Overlays& overlays)
 {
-    std::smatch matches;
-    auto errorLines = utils::SplitString(buildLog, "\n");
-    json diagnostics;
+    tracing::Span span("diagnostics", "parseBuildLog");
+    DiagnosticsByFile diagnostics;
+    diagnostics[filePath].source = PooledString(std::filesystem::path(filePath).filename().string());
+    // the file component of log lines -> diagnostics of the file it refers to
+    std::unordered_map<std::string_view, DiagnosticsList*> sources;
     int count = 0;
-    for (auto errLine : errorLines)
+    std::string_view log = buildLog;
+    while (!log.empty())
     {
-        std::regex_search(errLine, matches, m_regex);
-        if (matches.size() != 7)
+        const auto end = std::min(log.find('\n'), log.size());
+        auto line = log.substr(0, end);
+        log.remove_prefix(std::min(end + 1, log.size()));
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+
+        const auto output = ParseOutput(line);
+        if (!output)
             continue;
 
-        if (count++ > m_maxNumberOfProblems)
+        if (count++ >= m_maxNumberOfProblems)
         {
-            spdlog::get(logger)->info("Maximum number of problems reached, other problems will be slipped");
+            logging::Get<logger>().info("Maximum number of problems reached, other problems will be slipped");
             break;
         }
 
-        auto [source, line, col, severity, message] = ParseOutput(matches);
-        json diagnostic;
-        json range {
-            {"start",
-             {
-                 {"line", line},
-                 {"character", col},
-             }},
-            {"end",
-             {
-                 {"line", line},
-                 {"character", col},
-             }},
-        };
-        diagnostic["source"] = name.empty() ? source : name;
-        diagnostic["range"] = range;
-        diagnostic["severity"] = severity;
-        diagnostic["message"] = message;
-        diagnostics.emplace_back(diagnostic);
+        auto list = sources.find(output->source);
+        if (list == sources.end())
+        {
+            const auto sourcePath =
+                overlays.GetDocumentPath(ResolveSourcePath(std::string(output->source), filePath, searchPaths));
+            auto& fileDiagnostics = diagnostics[sourcePath];
+            if (fileDiagnostics.source.GetHandle() == StringPool::Empty)
+            {
+                const auto sourceName = std::filesystem::path(sourcePath).filename().string();
+                fileDiagnostics.source = PooledString(sourceName.empty() ? output->source : sourceName);
+            }
+            list = sources.emplace(output->source, &fileDiagnostics).first;
+        }
+        list->second->push_back(output->line, output->character, output->severity, output->message);
+    }
+
+    if (logging::Get<logger>().should_log(spdlog::level::debug))
+    {
+        const auto stats = GetStringPool().GetStats();
+        logging::Get<logger>().debug(
+            "String pool: {} strings, {} bytes stored for {} bytes interned ({} saved)",
+            stats.strings,
+            stats.storedBytes,
+            stats.requestedBytes,
+            stats.requestedBytes - stats.storedBytes);
     }
     return diagnostics;
 }
 
-nlohmann::json Diagnostics::Get(const Source& source)
+DiagnosticsByFile Diagnostics::Get(const Source& source)
 {
+    tracing::Span span("diagnostics", "get", source.filePath);
     if (!m_device.has_value())
     {
         throw std::runtime_error("missing OpenCL device");
     }
 
-    spdlog::get(logger)->trace("Getting diagnostics...");
-    std::string buildLog;
-    std::string srcName;
-
-    if (!source.filePath.empty())
+    logging::Get<logger>().trace("Getting diagnostics...");
+    const auto start = std::chrono::steady_clock::now();
+    metrics::Increment(metrics::Counter::BuildsStarted);
+    if (!source.text)
     {
-        auto filePath = std::filesystem::path(source.filePath).string();
-        srcName = std::filesystem::path(filePath).filename().string();
+        throw std::runtime_error("missing source text");
     }
-
-    buildLog = BuildSource(source.text);
+    const auto searchPaths = GetSearchPaths(source.filePath, m_buildOptions);
+    const auto overlayDirectories = m_overlays.Update(source.overlays, searchPaths);
+    auto searchOrder = searchPaths;
+    searchOrder.insert(searchOrder.begin() + 1, overlayDirectories.begin(), overlayDirectories.end());
+    std::string buildLog = overlayDirectories.empty()
+                               ? BuildSource(*source.text, m_buildOptions)
+                               : BuildSource(*source.text, m_buildOptions.WithIncludePaths(overlayDirectories));
     utils::RemoveNullTerminator(buildLog);
-    spdlog::get(logger)->trace("BuildLog:\n", buildLog);
+    if (logging::Get<logger>().should_log(spdlog::level::trace))
+        logging::Get<logger>().trace("BuildLog:\n{}", logging::Truncate(buildLog));
 
-    return BuildDiagnostics(buildLog, srcName);
+    auto diagnostics = BuildDiagnostics(buildLog, source.filePath, searchOrder, m_overlays);
+    metrics::Record(
+        metrics::Histogram::Build,
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+    return diagnostics;
 }
 
-void Diagnostics::SetBuildOptions(const json& options)
+void Diagnostics::SetBuildOptions(const BuildOptions& options)
 {
-    try
+    m_buildOptions = options;
+    logging::Get<logger>().trace(
+        "Set build options, {} (key {:016x})", m_buildOptions.GetString(), m_buildOptions.GetKey());
+}
+
+void Diagnostics::SetMaxProblemsCount(int maxNumberOfProblems)
+{
+    logging::Get<logger>().trace("Set max number of problems: {}", maxNumberOfProblems);
+    m_maxNumberOfProblems = maxNumberOfProblems;
+}
+
+void SerializeDiagnostics(const DiagnosticsList& diagnostics, std::string& out)
+{
+    const auto source = diagnostics.source.Get();
+    // members are written in the order nlohmann::json would dump them
+    out.push_back('[');
+    for (size_t i = 0; i < diagnostics.size(); ++i)
     {
-        std::string args;
-        for (auto option : options)
+        if (i > 0)
+            out.push_back(',');
+        out.append("{\"message\":");
+        utils::AppendJsonString(out, diagnostics.message(i));
+        for (const auto* position : {",\"range\":{\"end\":{\"character\":", "},\"start\":{\"character\":"})
         {
-            args.append(option.get<std::string>());
-            args.append(" ");
+            out.append(position);
+            AppendNumber(out, diagnostics.characters[i]);
+            out.append(",\"line\":");
+            AppendNumber(out, diagnostics.lines[i]);
         }
-        m_BuildOptions = std::move(args);
-        spdlog::get(logger)->trace("Set build options, {}", m_BuildOptions);
-    }
-    catch (std::exception& e)
-    {
-        spdlog::get(logger)->error("Failed to parse build options, {}", e.what());
+        out.append("}},\"severity\":");
+        AppendNumber(out, diagnostics.severities[i]);
+        out.append(",\"source\":");
+        utils::AppendJsonString(out, source);
+        out.push_back('}');
     }
+    out.push_back(']');
 }
 
-void Diagnostics::SetMaxProblemsCount(int maxNumberOfProblems)
+std::shared_ptr<IBuildEnvironment> CreateBuildEnvironment(std::shared_ptr<ICLInfo> clInfo)
 {
-    spdlog::get(logger)->trace("Set max number of problems: {}", maxNumberOfProblems);
-    m_maxNumberOfProblems = maxNumberOfProblems;
+    return std::make_shared<BuildEnvironment>(std::move(clInfo));
+}
+
+std::shared_ptr<IDiagnostics> CreateDiagnostics(std::shared_ptr<IBuildEnvironment> environment)
+{
+    return std::make_shared<Diagnostics>(std::move(environment));
 }
 
 std::shared_ptr<IDiagnostics> CreateDiagnostics(std::shared_ptr<ICLInfo> clInfo)
 {
-    return std::make_shared<Diagnostics>(std::move(clInfo));
+    return CreateDiagnostics(CreateBuildEnvironment(std::move(clInfo)));
 }
 
 } // namespace ocls
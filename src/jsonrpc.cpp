@@ -6,8 +6,16 @@
 //
 
 #include "jsonrpc.hpp"
+#include "jsonscan.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+
 using namespace nlohmann;
 
 namespace ocls {
@@ -15,141 +23,428 @@ namespace ocls {
 namespace {
 constexpr char logger[] = "jrpc";
 constexpr char LE[] = "\r\n";
+// bodies of this size are tried with the SIMD path for document texts first
+constexpr size_t documentScanThreshold = 64 * 1024;
+
+JsonRPC::Limits defaultLimits;
+
+const char* GetContentType(JsonRPC::Encoding encoding)
+{
+    switch (encoding)
+    {
+        case JsonRPC::Encoding::Cbor:
+            return "application/cbor";
+        case JsonRPC::Encoding::MessagePack:
+            return "application/msgpack";
+        default:
+            return "application/vscode-jsonrpc;charset=utf-8";
+    }
+}
+
+std::string ToLower(std::string_view value)
+{
+    std::string result(value);
+    std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return std::tolower(c); });
+    return result;
+}
+
+void Encode(const json& data, JsonRPC::Encoding encoding, std::vector<uint8_t>& output)
+{
+    output.clear();
+    if (encoding == JsonRPC::Encoding::Cbor)
+        json::to_cbor(data, output);
+    else
+        json::to_msgpack(data, output);
+}
 } // namespace
 
+// Media types are case-insensitive, the parameters and the spaces around the type are ignored
+JsonRPC::Encoding JsonRPC::ParseContentType(std::string_view value)
+{
+    auto mediaType = value.substr(0, value.find(';'));
+    const auto start = mediaType.find_first_not_of(" \t");
+    mediaType = start == std::string_view::npos ? std::string_view() : mediaType.substr(start);
+    mediaType = mediaType.substr(0, mediaType.find_last_not_of(" \t") + 1);
+    const auto name = ToLower(mediaType);
+    if (name == "application/cbor")
+        return Encoding::Cbor;
+    if (name == "application/msgpack" || name == "application/x-msgpack" || name == "application/vnd.msgpack")
+        return Encoding::MessagePack;
+    return Encoding::Json;
+}
+
+JsonRPC::JsonRPC() : JsonRPC(defaultLimits) {}
+
+JsonRPC::JsonRPC(const Limits& limits)
+    : m_content {limits.buffer}
+    , m_maxMessageSize {limits.maxMessageSize}
+    , m_maxHeaderSize {limits.maxHeaderSize}
+{}
+
+void JsonRPC::SetDefaultLimits(const Limits& limits)
+{
+    defaultLimits = limits;
+}
+
 void JsonRPC::RegisterMethodCallback(const std::string& method, InputCallbackFunc&& func)
 {
-    spdlog::get(logger)->trace("Set callback for method: {}", method);
+    logging::Get<logger>().trace("Set callback for method: {}", method);
     m_callbacks[method] = std::move(func);
 }
 
 void JsonRPC::RegisterInputCallback(InputCallbackFunc&& func)
 {
-    spdlog::get(logger)->trace("Set callback for client responds");
+    logging::Get<logger>().trace("Set callback for client responds");
     m_respondCallback = std::move(func);
 }
 
 void JsonRPC::RegisterOutputCallback(OutputCallbackFunc&& func)
 {
-    spdlog::get(logger)->trace("Set output callback");
+    logging::Get<logger>().trace("Set output callback");
     m_outputCallback = std::move(func);
 }
 
 void JsonRPC::Consume(char c)
 {
-    m_buffer += c;
+    if (m_skipLength > 0)
+    {
+        --m_skipLength;
+        return;
+    }
     if (m_validHeader)
     {
-        if (m_buffer.length() != m_contentLength)
+        m_content.Append(&c, 1);
+        if (m_content.Size() != m_contentLength)
             return;
+        m_receiveTime = std::chrono::steady_clock::now();
+        metrics::Increment(metrics::Counter::BytesReceived, m_contentLength);
         try
         {
-            spdlog::get(logger)->debug("");
-            spdlog::get(logger)->debug(">>>>>>>>>>>>>>>>");
-            for (auto& header : m_headers)
-                spdlog::get(logger)->debug(header.first, ": ", header.second);
-            spdlog::get(logger)->debug(m_buffer);
-            spdlog::get(logger)->debug(">>>>>>>>>>>>>>>>");
-            spdlog::get(logger)->debug("");
-
-            m_body = json::parse(m_buffer);
-            const auto method = m_body["method"];
-            if (method.is_string())
+            auto& log = logging::Get<logger>();
+            if (log.should_log(spdlog::level::debug))
             {
-                m_method = method.get<std::string>();
-                if (m_method == "initialize")
-                {
-                    OnInitialize();
-                }
-                else if (!m_initialized)
-                {
-                    spdlog::get(logger)->error("Unexpected first message: '{}'", m_method);
-                    WriteError(ErrorCode::NotInitialized, "Server was not initialized.");
-                    return;
-                }
-                else if (m_method == "$/setTrace")
-                {
-                    OnTracingChanged(m_body);
-                }
-                FireMethodCallback();
+                log.debug(">>>>>>>>>>>>>>>>");
+                for (auto& header : m_headers)
+                    log.debug("{}: {}", header.first, header.second);
+                log.debug(GetBodyForLog());
+                log.debug(">>>>>>>>>>>>>>>>");
+            }
+
+            if (m_bodyStart >= 0)
+            {
+                tracing::WriteComplete("jrpc", "read", m_bodyStart, tracing::Now() - m_bodyStart, {});
+                m_bodyStart = -1;
             }
-            else
             {
-                FireRespondCallback();
+                tracing::Span span("jrpc", "parse");
+                ParseBody();
             }
+            m_outputEncoding = m_inputEncoding;
+            if (m_body.is_array())
+                DispatchBatch();
+            else
+                Dispatch();
+            // the message is over also when it was rejected, the next one starts with a header
             m_isProcessing = false;
         }
         catch (std::exception& e)
         {
-            spdlog::get(logger)->error("Failed to parse request with reason: '{}'\n{}", e.what(), "\n", m_buffer);
-            m_buffer.clear();
+            logging::Get<logger>().error(
+                "Failed to parse request with reason: '{}'\n{}", e.what(), GetBodyForLog());
             WriteError(ErrorCode::ParseError, "Failed to parse request");
+            // the message is over, the next one starts with a header
+            m_isProcessing = false;
             return;
         }
     }
+    else if (m_skipHeader)
+    {
+        SkipHeader(c);
+    }
     else
     {
-        if (ReadHeader())
-            m_buffer.clear();
-
+        m_buffer += c;
+        if (++m_headerSize > m_maxHeaderSize)
+        {
+            // the header comes from the client, it is not buffered past the limit
+            logging::Get<logger>().warn("Skipping the header longer than {} bytes", m_maxHeaderSize);
+            metrics::Increment(metrics::Counter::RejectedMessages);
+            WriteError(
+                ErrorCode::InvalidRequest, "Header exceeds the limit of " + std::to_string(m_maxHeaderSize) + " bytes");
+            m_skipHeader = true;
+            m_headerSize = 0;
+            m_contentLength = 0;
+            m_headers.clear();
+            return;
+        }
+        // the lines are only parsed once they are complete
+        if (m_buffer.size() < 2 || m_buffer.compare(m_buffer.size() - 2, 2, LE) != 0)
+            return;
         if (m_buffer == LE)
         {
             m_buffer.clear();
-            m_validHeader = m_contentLength > 0;
-            if (m_validHeader)
-            {
-                m_buffer.reserve(m_contentLength);
-            }
-            else
-            {
-                WriteError(ErrorCode::InvalidRequest, "Invalid content length");
-            }
+            m_headerSize = 0;
+            OnHeaderEnd();
+            return;
         }
+        ReadHeader();
+        m_buffer.clear();
     }
 }
 
+// Drop the bytes up to the empty line ending the header, only its last bytes are kept
+void JsonRPC::SkipHeader(char c)
+{
+    constexpr std::string_view headerEnd = "\r\n\r\n";
+    m_buffer += c;
+    if (m_buffer.size() >= headerEnd.size() &&
+        std::string_view(m_buffer).substr(m_buffer.size() - headerEnd.size()) == headerEnd)
+    {
+        m_skipHeader = false;
+        m_buffer.clear();
+    }
+    else if (m_buffer.size() > headerEnd.size())
+    {
+        m_buffer.erase(0, m_buffer.size() - headerEnd.size());
+    }
+}
+
+size_t JsonRPC::Consume(const char* data, size_t size)
+{
+    size_t consumed = 0;
+    while (consumed < size && !IsReady())
+    {
+        if (m_skipLength > 0)
+        {
+            const auto count = std::min(size - consumed, m_skipLength);
+            m_skipLength -= count;
+            consumed += count;
+            continue;
+        }
+        // the last byte of the body goes through the per-byte path that processes the message
+        if (m_validHeader && m_content.Size() + 1 < m_contentLength)
+        {
+            const auto count = std::min<size_t>(size - consumed, m_contentLength - m_content.Size() - 1);
+            m_content.Append(data + consumed, count);
+            consumed += count;
+            continue;
+        }
+        Consume(data[consumed++]);
+    }
+    return consumed;
+}
+
+void JsonRPC::OnHeaderEnd()
+{
+    const auto contentType = m_headers.find("content-type");
+    m_inputEncoding = contentType == m_headers.end() ? Encoding::Json : ParseContentType(contentType->second);
+    if (m_contentLength == 0)
+    {
+        WriteError(ErrorCode::InvalidRequest, "Invalid content length");
+        m_headers.clear();
+        return;
+    }
+    if (m_contentLength > m_maxMessageSize)
+    {
+        // the length comes from the client, the body is skipped instead of being buffered
+        logging::Get<logger>().warn(
+            "Skipping the message of {} bytes, the limit is {} bytes", m_contentLength, m_maxMessageSize);
+        metrics::Increment(metrics::Counter::RejectedMessages);
+        WriteError(
+            ErrorCode::InvalidRequest,
+            "Message of " + std::to_string(m_contentLength) + " bytes exceeds the limit of " +
+                std::to_string(m_maxMessageSize) + " bytes");
+        m_skipLength = m_contentLength;
+        m_contentLength = 0;
+        m_headers.clear();
+        return;
+    }
+    m_validHeader = true;
+    if (tracing::IsEnabled())
+        m_bodyStart = tracing::Now();
+    m_content.Begin(m_contentLength);
+}
+
+// Returns false if the message was rejected because the server was not initialized
+void JsonRPC::Dispatch()
+{
+    if (!m_body.is_object())
+    {
+        WriteError(ErrorCode::InvalidRequest, "Message must be an object.");
+        return;
+    }
+    const auto method = m_body.find("method");
+    if (method == m_body.end() || !method->is_string())
+    {
+        metrics::CountMessage(metrics::Direction::Received, {});
+        FireRespondCallback();
+        return;
+    }
+
+    m_method.assign(method->get_ref<const std::string&>());
+    m_methodId = methods::Find(m_method);
+    metrics::CountMessage(metrics::Direction::Received, m_method);
+    if (m_methodId == methods::Method::Initialize)
+    {
+        OnInitialize();
+    }
+    else if (!m_initialized)
+    {
+        logging::Get<logger>().error("Unexpected first message: '{}'", m_method);
+        WriteError(ErrorCode::NotInitialized, "Server was not initialized.");
+        return;
+    }
+    else if (m_methodId == methods::Method::SetTrace)
+    {
+        OnTracingChanged(m_body);
+    }
+    FireMethodCallback();
+}
+
+void JsonRPC::DispatchBatch()
+{
+    if (m_body.empty())
+    {
+        WriteError(ErrorCode::InvalidRequest, "Batch must not be empty.");
+        return;
+    }
+    logging::Get<logger>().debug("Dispatching a batch of {} messages", m_body.size());
+    // the messages share the server state, so they are dispatched in order
+    auto batch = std::move(m_body);
+    m_batchResponses.clear();
+    m_inBatch = true;
+    for (auto& message : batch)
+    {
+        m_body = std::move(message);
+        m_method.clear();
+        m_methodId.reset();
+        Dispatch();
+    }
+}
+
+// Returns true if the response was kept to be sent with the other responses to the batch
+bool JsonRPC::CollectBatchResponse(const std::string& content, std::string_view method) const
+{
+    if (!m_inBatch || !method.empty())
+        return false;
+    m_batchResponses.push_back(m_batchResponses.empty() ? '[' : ',');
+    m_batchResponses.append(content);
+    return true;
+}
+
 bool JsonRPC::IsReady() const
 {
     return !m_isProcessing;
 }
 
-void JsonRPC::Write(const json& data) const
+void JsonRPC::Write(json data) const
 {
-    assert(m_outputCallback);
+    try
+    {
+        std::string_view method;
+        const auto methodValue = data.find("method");
+        if (methodValue != data.end() && methodValue->is_string())
+            method = methodValue->get_ref<const std::string&>();
+        data.emplace("jsonrpc", "2.0");
+        if (m_inBatch && method.empty())
+        {
+            CollectBatchResponse(data.dump(), method);
+        }
+        else if (m_outputEncoding == Encoding::Json)
+        {
+            WriteBody(data.dump(), method);
+        }
+        else
+        {
+            Encode(data, m_outputEncoding, m_encodeBuffer);
+            WriteBody({reinterpret_cast<const char*>(m_encodeBuffer.data()), m_encodeBuffer.size()}, method);
+        }
+    }
+    catch (std::exception& err)
+    {
+        logging::Get<logger>().error("Failed to write message, error: {}", err.what());
+    }
+}
 
-    std::string message;
+void JsonRPC::WriteSerialized(const std::string& content, std::string_view method) const
+{
+    if (CollectBatchResponse(content, method))
+        return;
+    if (m_outputEncoding == Encoding::Json)
+    {
+        WriteBody(content, method);
+        return;
+    }
     try
     {
-        json body = data;
-        body.emplace("jsonrpc", "2.0");
-        std::string content = body.dump();
-        message.append(std::string("Content-Length: ") + std::to_string(content.size()) + LE);
-        message.append(std::string("Content-Type: application/vscode-jsonrpc;charset=utf-8") + LE);
-        message.append(LE);
-        message.append(content);
+        Encode(json::parse(content), m_outputEncoding, m_encodeBuffer);
+        WriteBody({reinterpret_cast<const char*>(m_encodeBuffer.data()), m_encodeBuffer.size()}, method);
+    }
+    catch (std::exception& err)
+    {
+        logging::Get<logger>().error("Failed to write message, error: {}", err.what());
+    }
+}
+
+void JsonRPC::WriteBody(std::string_view content, std::string_view method) const
+{
+    assert(m_outputCallback);
+    tracing::Span span("jrpc", "write");
+    metrics::Increment(metrics::Counter::BytesSent, content.size());
+    metrics::CountMessage(metrics::Direction::Sent, method);
 
-        spdlog::get(logger)->debug("");
-        spdlog::get(logger)->debug("<<<<<<<<<<<<<<<<");
-        spdlog::get(logger)->debug(message);
-        spdlog::get(logger)->debug("<<<<<<<<<<<<<<<<");
-        spdlog::get(logger)->debug("");
+    // the buffer keeps its capacity between messages
+    m_writeBuffer.clear();
+    m_writeBuffer.append("Content-Length: ").append(std::to_string(content.size())).append(LE);
+    m_writeBuffer.append("Content-Type: ").append(GetContentType(m_outputEncoding)).append(LE);
+    m_writeBuffer.append(LE);
+    m_writeBuffer.append(content);
 
-        m_outputCallback(message);
+    auto& log = logging::Get<logger>();
+    if (log.should_log(spdlog::level::debug))
+    {
+        log.debug("<<<<<<<<<<<<<<<<");
+        if (m_outputEncoding == Encoding::Json)
+            log.debug(logging::Truncate(m_writeBuffer));
+        else
+            log.debug("{} bytes of {}", content.size(), GetContentType(m_outputEncoding));
+        log.debug("<<<<<<<<<<<<<<<<");
+    }
+
+    try
+    {
+        m_outputCallback(m_writeBuffer);
     }
     catch (std::exception& err)
     {
-        spdlog::get(logger)->error("Failed to write message: '{}', error: {}", message, err.what());
+        log.error("Failed to write message: '{}', error: {}", logging::Truncate(m_writeBuffer), err.what());
     }
 }
 
 void JsonRPC::Reset()
 {
-    m_method = std::string();
+    if (m_inBatch)
+    {
+        m_inBatch = false;
+        // a batch of notifications is not answered
+        if (!m_batchResponses.empty())
+        {
+            m_batchResponses.push_back(']');
+            WriteSerialized(m_batchResponses);
+        }
+    }
+    m_method.clear();
+    m_methodId.reset();
     m_buffer.clear();
-    m_body.clear();
+    m_content.Clear();
+    // release the whole message, clear() would keep the top level object
+    m_body = nullptr;
     m_headers.clear();
     m_validHeader = false;
     m_contentLength = 0;
+    m_headerSize = 0;
+    m_skipHeader = false;
+    m_inputEncoding = Encoding::Json;
     m_isProcessing = true;
 }
 
@@ -157,15 +452,15 @@ void JsonRPC::LogTrace(const std::string& message, const std::string& verbose)
 {
     if (!m_tracing)
     {
-        spdlog::get(logger)->debug("JRPC tracing is disabled");
-        spdlog::get(logger)->trace("The message was: '{}', verbose: {}", message, verbose);
+        logging::Get<logger>().debug("JRPC tracing is disabled");
+        logging::Get<logger>().trace("The message was: '{}', verbose: {}", message, verbose);
         return;
     }
 
     if (!verbose.empty() && !m_verbosity)
     {
-        spdlog::get(logger)->debug("JRPC verbose tracing is disabled");
-        spdlog::get(logger)->trace("The verbose message was: {}", verbose);
+        logging::Get<logger>().debug("JRPC verbose tracing is disabled");
+        logging::Get<logger>().trace("The verbose message was: {}", verbose);
         return;
     }
 
@@ -181,12 +476,13 @@ void JsonRPC::OnInitialize()
         m_tracing = traceValue != "off";
         m_verbosity = traceValue == "verbose";
         m_initialized = true;
-        spdlog::get(logger)->debug(
+        logging::SetTrace(traceValue);
+        logging::Get<logger>().debug(
             "Tracing options: is verbose: {}, is on: {}", m_verbosity ? "yes" : "no", m_tracing ? "yes" : "no");
     }
     catch (std::exception& err)
     {
-        spdlog::get(logger)->error("Failed to read tracing options, {}", err.what());
+        logging::Get<logger>().error("Failed to read tracing options, {}", err.what());
     }
 }
 
@@ -197,40 +493,83 @@ void JsonRPC::OnTracingChanged(const json& data)
         const auto traceValue = data["params"]["value"].get<std::string>();
         m_tracing = traceValue != "off";
         m_verbosity = traceValue == "verbose";
-        spdlog::get(logger)->debug(
+        logging::SetTrace(traceValue);
+        logging::Get<logger>().debug(
             "Tracing options were changed, is verbose: {}, is on: {}",
             m_verbosity ? "yes" : "no",
             m_tracing ? "yes" : "no");
     }
     catch (std::exception& err)
     {
-        spdlog::get(logger)->error("Failed to read tracing options, {}", err.what());
+        logging::Get<logger>().error("Failed to read tracing options, {}", err.what());
     }
 }
 
-bool JsonRPC::ReadHeader()
+std::chrono::steady_clock::time_point JsonRPC::GetReceiveTime() const
+{
+    return m_receiveTime;
+}
+
+JsonRPC::Encoding JsonRPC::GetEncoding() const
 {
-    std::sregex_iterator next(m_buffer.begin(), m_buffer.end(), m_headerRegex);
-    std::sregex_iterator end;
-    const bool found = std::distance(next, end) > 0;
-    while (next != end)
-    {
-        std::smatch match = *next;
-        std::string key = match.str(1);
-        std::string value = match.str(2);
-        if (key == "Content-Length")
-            m_contentLength = std::stoi(value);
-        m_headers[key] = value;
-        ++next;
-    }
-    return found;
+    return m_outputEncoding;
+}
+
+void JsonRPC::ParseBody()
+{
+    const auto body = m_content.View();
+    switch (m_inputEncoding)
+    {
+        case Encoding::Cbor:
+            m_body = json::from_cbor(body);
+            break;
+        case Encoding::MessagePack:
+            m_body = json::from_msgpack(body);
+            break;
+        default:
+            if (body.size() < documentScanThreshold || !jsonscan::ParseDocumentMessage(body, m_body))
+                m_body = json::parse(body);
+            break;
+    }
+}
+
+std::string JsonRPC::GetBodyForLog() const
+{
+    if (m_inputEncoding == Encoding::Json)
+        return logging::Truncate(m_content.View());
+    return std::to_string(m_content.Size()) + " bytes of " + GetContentType(m_inputEncoding);
+}
+
+// Parses the complete header line in the buffer, a length that is not a number is left at 0 and rejected
+void JsonRPC::ReadHeader()
+{
+    const std::string_view line(m_buffer.data(), m_buffer.size() - 2);
+    const auto separator = line.find(':');
+    if (separator == std::string_view::npos || separator == 0)
+    {
+        logging::Get<logger>().warn("Ignoring the malformed header line '{}'", line);
+        return;
+    }
+    // the names are case-insensitive, they are kept in lower case
+    auto key = ToLower(line.substr(0, separator));
+    auto value = line.substr(separator + 1);
+    const auto start = value.find_first_not_of(" \t");
+    value = start == std::string_view::npos ? std::string_view() : value.substr(start);
+    if (key == "content-length")
+    {
+        size_t length = 0;
+        const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), length);
+        m_contentLength = error == std::errc() && end == value.data() + value.size() ? length : 0;
+    }
+    m_headers[std::move(key)] = std::string(value);
 }
 
 void JsonRPC::FireRespondCallback()
 {
     if (m_respondCallback)
     {
-        spdlog::get(logger)->debug("Calling handler for a client respond");
+        tracing::Span span("jrpc", "dispatch", "(response)");
+        logging::Get<logger>().debug("Calling handler for a client respond");
         m_respondCallback(m_body);
     }
 }
@@ -238,12 +577,30 @@ void JsonRPC::FireRespondCallback()
 void JsonRPC::FireMethodCallback()
 {
     assert(m_outputCallback);
+    tracing::Span span("jrpc", "dispatch", m_method);
+    if (m_methodId)
+    {
+        const auto& handler = m_handlers[static_cast<size_t>(*m_methodId)];
+        if (handler.thunk)
+        {
+            try
+            {
+                logging::Get<logger>().debug("Calling handler for method: '{}'", m_method);
+                handler.thunk(handler.context, m_body);
+            }
+            catch (std::exception& err)
+            {
+                logging::Get<logger>().error("Failed to handle method '{}', err: {}", m_method, err.what());
+            }
+            return;
+        }
+    }
     auto callback = m_callbacks.find(m_method);
     if (callback == m_callbacks.end())
     {
         const bool isRequest = m_body["params"]["id"] != nullptr;
         const bool mustRespond = isRequest || m_method.rfind("$/", 0) == std::string::npos;
-        spdlog::get(logger)->debug(
+        logging::Get<logger>().debug(
             "Got request: {}, respond is required: {}", isRequest ? "yes" : "no", mustRespond ? "yes" : "no");
         if (mustRespond)
         {
@@ -254,20 +611,22 @@ void JsonRPC::FireMethodCallback()
     {
         try
         {
-            spdlog::get(logger)->debug("Calling handler for method: '{}'", m_method);
+            logging::Get<logger>().debug("Calling handler for method: '{}'", m_method);
             callback->second(m_body);
         }
         catch (std::exception& err)
         {
-            spdlog::get(logger)->error("Failed to handle method '{}', err: {}", m_method, err.what());
+            logging::Get<logger>().error("Failed to handle method '{}', err: {}", m_method, err.what());
         }
     }
 }
 
 void JsonRPC::WriteError(JsonRPC::ErrorCode errorCode, const std::string& message) const
 {
-    spdlog::get(logger)->trace("Reporting error: '{}' ({})", message, static_cast<int>(errorCode));
+    logging::Get<logger>().trace("Reporting error: '{}' ({})", message, static_cast<int>(errorCode));
+    const auto id = m_body.is_object() ? m_body.find("id") : m_body.end();
     json obj = {
+        {"id", id != m_body.end() ? *id : json(nullptr)},
         {"error",
          {
              {"code", static_cast<int>(errorCode)},
@@ -0,0 +1,421 @@
+//
+//  jsonscan.cpp
+//  opencl-language-server
+//
+
+#include "jsonscan.hpp"
+#include "methods.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define OCLS_JSONSCAN_SSE2
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+    #define OCLS_JSONSCAN_NEON
+#endif
+
+using namespace nlohmann;
+
+namespace ocls::jsonscan {
+
+namespace {
+
+// Shorter texts are left to nlohmann::json, cutting them out would not pay off
+constexpr size_t minTextSize = 4096;
+
+bool IsStringSpecial(unsigned char c)
+{
+    return c == '"' || c == '\\' || c < 0x20;
+}
+
+#if defined(OCLS_JSONSCAN_SSE2)
+unsigned CountTrailingZeros(unsigned value)
+{
+    #if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return static_cast<unsigned>(index);
+    #else
+    return static_cast<unsigned>(__builtin_ctz(value));
+    #endif
+}
+#endif
+
+// Returns the position of the first quote, backslash or control character at or after the position,
+// or the size if there is none. 16 bytes are checked at once where SIMD is available.
+size_t FindStringSpecial(const char* data, size_t size, size_t position)
+{
+#if defined(OCLS_JSONSCAN_SSE2)
+    const auto quote = _mm_set1_epi8('"');
+    const auto backslash = _mm_set1_epi8('\\');
+    const auto control = _mm_set1_epi8(0x1F);
+    for (; position + 16 <= size; position += 16)
+    {
+        const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + position));
+        // unsigned c <= 0x1F is max(c, 0x1F) == 0x1F
+        const auto special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        const auto mask = static_cast<unsigned>(_mm_movemask_epi8(special));
+        if (mask != 0)
+            return position + CountTrailingZeros(mask);
+    }
+#elif defined(OCLS_JSONSCAN_NEON)
+    const auto quote = vdupq_n_u8('"');
+    const auto backslash = vdupq_n_u8('\\');
+    const auto control = vdupq_n_u8(0x1F);
+    for (; position + 16 <= size; position += 16)
+    {
+        const auto chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(data + position));
+        const auto special =
+            vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)), vcleq_u8(chunk, control));
+        // the scalar loop finds the byte within the chunk
+        if (vmaxvq_u8(special) != 0)
+            break;
+    }
+#endif
+    for (; position < size; ++position)
+    {
+        if (IsStringSpecial(static_cast<unsigned char>(data[position])))
+            return position;
+    }
+    return size;
+}
+
+int ReadHex(const char* data)
+{
+    int value = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        const char c = data[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9')
+            value |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            value |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return value;
+}
+
+void AppendUtf8(std::string& output, uint32_t codepoint)
+{
+    if (codepoint < 0x80)
+    {
+        output.push_back(static_cast<char>(codepoint));
+    }
+    else if (codepoint < 0x800)
+    {
+        output.push_back(static_cast<char>(0xC0 | (codepoint >> 6)));
+        output.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+    }
+    else if (codepoint < 0x10000)
+    {
+        output.push_back(static_cast<char>(0xE0 | (codepoint >> 12)));
+        output.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+        output.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+    }
+    else
+    {
+        output.push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
+        output.push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
+        output.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+        output.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+    }
+}
+
+// The same rules as nlohmann::json applies: no overlong forms, surrogates or code points above U+10FFFF
+bool IsValidUtf8(std::string_view text)
+{
+    const auto* data = reinterpret_cast<const unsigned char*>(text.data());
+    const size_t size = text.size();
+    size_t i = 0;
+    while (i < size)
+    {
+        // skip ASCII 8 bytes at a time
+        if (i + 8 <= size)
+        {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            if ((word & 0x8080808080808080ull) == 0)
+            {
+                i += 8;
+                continue;
+            }
+        }
+        const auto c = data[i];
+        if (c < 0x80)
+        {
+            ++i;
+            continue;
+        }
+        size_t length;
+        unsigned char min = 0x80;
+        unsigned char max = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF)
+        {
+            length = 2;
+        }
+        else if (c >= 0xE0 && c <= 0xEF)
+        {
+            length = 3;
+            if (c == 0xE0)
+                min = 0xA0;
+            else if (c == 0xED)
+                max = 0x9F;
+        }
+        else if (c >= 0xF0 && c <= 0xF4)
+        {
+            length = 4;
+            if (c == 0xF0)
+                min = 0x90;
+            else if (c == 0xF4)
+                max = 0x8F;
+        }
+        else
+        {
+            return false;
+        }
+        if (i + length > size || data[i + 1] < min || data[i + 1] > max)
+            return false;
+        for (size_t k = 2; k < length; ++k)
+        {
+            if (data[i + k] < 0x80 || data[i + k] > 0xBF)
+                return false;
+        }
+        i += length;
+    }
+    return true;
+}
+
+// Only whitespace and a single colon between a key and its value
+bool IsKeyValueSeparator(const char* data, size_t size)
+{
+    bool hasColon = false;
+    for (size_t i = 0; i < size; ++i)
+    {
+        const char c = data[i];
+        if (c == ':' && !hasColon)
+            hasColon = true;
+        else if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+            return false;
+    }
+    return hasColon;
+}
+
+json* FindMember(json& object, const char* key)
+{
+    if (!object.is_object())
+        return nullptr;
+    const auto member = object.find(key);
+    return member == object.end() ? nullptr : &*member;
+}
+
+class TextRestorer
+{
+public:
+    explicit TextRestorer(std::vector<std::string>& texts) : m_texts {texts}, m_restored(texts.size()) {}
+
+    // The cut out texts were replaced with their indices
+    bool Restore(json* value)
+    {
+        if (!value || !value->is_number_unsigned())
+            return true;
+        const auto index = value->get<uint64_t>();
+        if (index >= m_texts.size() || m_restored[index])
+            return false;
+        *value = std::move(m_texts[index]);
+        m_restored[index] = true;
+        ++m_count;
+        return true;
+    }
+
+    bool IsComplete() const
+    {
+        return m_count == m_texts.size();
+    }
+
+private:
+    std::vector<std::string>& m_texts;
+    std::vector<bool> m_restored;
+    size_t m_count = 0;
+};
+
+} // namespace
+
+size_t ReadString(std::string_view json, size_t start, std::string* output)
+{
+    const char* data = json.data();
+    const size_t size = json.size();
+    size_t position = start;
+    while (true)
+    {
+        const auto special = FindStringSpecial(data, size, position);
+        if (special == size)
+            return std::string_view::npos;
+        if (output)
+            output->append(data + position, special - position);
+        const char c = data[special];
+        if (c == '"')
+            return special;
+        if (c != '\\' || special + 1 == size)
+            return std::string_view::npos;
+
+        position = special + 2;
+        char unescaped;
+        switch (data[special + 1])
+        {
+            case '"':
+            case '\\':
+            case '/':
+                unescaped = data[special + 1];
+                break;
+            case 'b':
+                unescaped = '\b';
+                break;
+            case 'f':
+                unescaped = '\f';
+                break;
+            case 'n':
+                unescaped = '\n';
+                break;
+            case 'r':
+                unescaped = '\r';
+                break;
+            case 't':
+                unescaped = '\t';
+                break;
+            case 'u': {
+                if (special + 6 > size)
+                    return std::string_view::npos;
+                const int high = ReadHex(data + special + 2);
+                if (high < 0 || (high >= 0xDC00 && high <= 0xDFFF))
+                    return std::string_view::npos;
+                position = special + 6;
+                auto codepoint = static_cast<uint32_t>(high);
+                if (high >= 0xD800 && high <= 0xDBFF)
+                {
+                    // a surrogate pair
+                    if (position + 6 > size || data[position] != '\\' || data[position + 1] != 'u')
+                        return std::string_view::npos;
+                    const int low = ReadHex(data + position + 2);
+                    if (low < 0xDC00 || low > 0xDFFF)
+                        return std::string_view::npos;
+                    codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + static_cast<uint32_t>(low - 0xDC00);
+                    position += 6;
+                }
+                if (output)
+                    AppendUtf8(*output, codepoint);
+                continue;
+            }
+            default:
+                return std::string_view::npos;
+        }
+        if (output)
+            output->push_back(unescaped);
+    }
+}
+
+bool ParseDocumentMessage(std::string_view body, json& message)
+{
+    // Strings are skipped with the vectorized scan, their quotes are the only structural characters
+    // that matter: a large value of a "text" key is cut out and replaced with its index.
+    const char* data = body.data();
+    const size_t size = body.size();
+    std::vector<std::string> texts;
+    std::string reduced;
+    std::string text;
+    size_t copied = 0;
+    size_t position = 0;
+    bool isAfterTextKey = false;
+    while (position < size)
+    {
+        const auto* quote = static_cast<const char*>(std::memchr(data + position, '"', size - position));
+        if (!quote)
+            break;
+        const auto start = static_cast<size_t>(quote - data);
+        const bool isTextValue = isAfterTextKey && IsKeyValueSeparator(data + position, start - position);
+        size_t end;
+        if (isTextValue)
+        {
+            text.clear();
+            end = ReadString(body, start + 1, &text);
+        }
+        else
+        {
+            end = ReadString(body, start + 1, nullptr);
+        }
+        if (end == std::string_view::npos)
+            return false;
+
+        if (isTextValue && text.size() >= minTextSize)
+        {
+            if (!IsValidUtf8(text))
+                return false;
+            reduced.append(data + copied, start - copied);
+            reduced.append(std::to_string(texts.size()));
+            copied = end + 1;
+            texts.push_back(std::move(text));
+            text = std::string();
+            isAfterTextKey = false;
+        }
+        else
+        {
+            isAfterTextKey = !isTextValue && end - start - 1 == 4 && std::memcmp(data + start + 1, "text", 4) == 0;
+        }
+        position = end + 1;
+    }
+    if (texts.empty())
+        return false;
+    reduced.append(data + copied, size - copied);
+
+    try
+    {
+        message = json::parse(reduced);
+    }
+    catch (const json::exception&)
+    {
+        return false;
+    }
+
+    const auto* method = FindMember(message, "method");
+    if (!method || !method->is_string())
+        return false;
+    const auto methodId = methods::Find(method->get_ref<const std::string&>());
+    auto* params = FindMember(message, "params");
+    if (!params)
+        return false;
+
+    TextRestorer restorer(texts);
+    if (methodId == methods::Method::DidOpen)
+    {
+        auto* textDocument = FindMember(*params, "textDocument");
+        if (!textDocument || !restorer.Restore(FindMember(*textDocument, "text")))
+            return false;
+    }
+    else if (methodId == methods::Method::DidChange)
+    {
+        auto* changes = FindMember(*params, "contentChanges");
+        if (!changes || !changes->is_array())
+            return false;
+        for (auto& change : *changes)
+        {
+            if (!restorer.Restore(FindMember(change, "text")))
+                return false;
+        }
+    }
+    // a large text anywhere else is unusual, the message is parsed as usual then
+    return restorer.IsComplete();
+}
+
+} // namespace ocls::jsonscan
@@ -0,0 +1,250 @@
+//
+//  lineindex.cpp
+//  opencl-language-server
+//
+
+#include "lineindex.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define OCLS_LINEINDEX_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+    #define OCLS_LINEINDEX_NEON
+#endif
+
+namespace ocls {
+
+namespace {
+
+// 16 bytes are checked at once where SIMD is available, 8 bytes otherwise
+bool HasNonAscii(const char* data, size_t size)
+{
+    size_t i = 0;
+#if defined(OCLS_LINEINDEX_SSE2)
+    for (; i + 16 <= size; i += 16)
+    {
+        const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        if (_mm_movemask_epi8(chunk) != 0)
+            return true;
+    }
+#elif defined(OCLS_LINEINDEX_NEON)
+    for (; i + 16 <= size; i += 16)
+    {
+        if (vmaxvq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(data + i))) >= 0x80)
+            return true;
+    }
+#endif
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        if ((word & 0x8080808080808080ull) != 0)
+            return true;
+    }
+    for (; i < size; ++i)
+    {
+        if (static_cast<unsigned char>(data[i]) >= 0x80)
+            return true;
+    }
+    return false;
+}
+
+bool IsContinuation(unsigned char c)
+{
+    return (c & 0xC0) == 0x80;
+}
+
+// Units of the encoding taken by the UTF-8 bytes, a truncated sequence counts as a whole character
+uint32_t CountUnits(const char* data, size_t size, PositionEncoding encoding)
+{
+    uint32_t units = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        const auto c = static_cast<unsigned char>(data[i]);
+        if (IsContinuation(c))
+            continue;
+        // characters outside of the BMP are surrogate pairs in UTF-16
+        units += encoding == PositionEncoding::Utf16 && c >= 0xF0 ? 2 : 1;
+    }
+    return units;
+}
+
+// memcmp of whole blocks finds the differing block, only that one is compared byte by byte
+constexpr size_t compareBlockSize = 64;
+
+size_t GetCommonPrefix(const char* left, const char* right, size_t size)
+{
+    size_t prefix = 0;
+    while (prefix + compareBlockSize <= size && std::memcmp(left + prefix, right + prefix, compareBlockSize) == 0)
+        prefix += compareBlockSize;
+    while (prefix < size && left[prefix] == right[prefix])
+        ++prefix;
+    return prefix;
+}
+
+// The texts end at the pointers
+size_t GetCommonSuffix(const char* leftEnd, const char* rightEnd, size_t size)
+{
+    size_t suffix = 0;
+    while (suffix + compareBlockSize <= size)
+    {
+        const auto offset = suffix + compareBlockSize;
+        if (std::memcmp(leftEnd - offset, rightEnd - offset, compareBlockSize) != 0)
+            break;
+        suffix = offset;
+    }
+    while (suffix < size && *(leftEnd - suffix - 1) == *(rightEnd - suffix - 1))
+        ++suffix;
+    return suffix;
+}
+
+size_t GetSequenceLength(unsigned char c)
+{
+    if (c >= 0xF0)
+        return 4;
+    if (c >= 0xE0)
+        return 3;
+    if (c >= 0xC0)
+        return 2;
+    return 1;
+}
+
+} // namespace
+
+LineIndex::LineIndex() : m_starts {0}, m_nonAscii {0} {}
+
+LineIndex::LineIndex(std::string_view text) : LineIndex()
+{
+    IndexLines(text, 0, text.size(), m_starts);
+    m_nonAscii.assign(m_starts.size(), 0);
+    MarkLines(text, 0, static_cast<uint32_t>(m_starts.size() - 1));
+}
+
+void LineIndex::Update(std::string_view oldText, std::string_view newText)
+{
+    const auto common = std::min(oldText.size(), newText.size());
+    const auto prefix = GetCommonPrefix(oldText.data(), newText.data(), common);
+    const auto suffix =
+        GetCommonSuffix(oldText.data() + oldText.size(), newText.data() + newText.size(), common - prefix);
+    const auto oldEnd = oldText.size() - suffix;
+    const auto newEnd = newText.size() - suffix;
+
+    // the lines starting after a line break in the changed range are replaced
+    const auto first = std::upper_bound(m_starts.begin(), m_starts.end(), prefix) - m_starts.begin();
+    const auto last = std::upper_bound(m_starts.begin(), m_starts.end(), oldEnd) - m_starts.begin();
+    const auto delta = static_cast<int64_t>(newEnd) - static_cast<int64_t>(oldEnd);
+    for (auto start = m_starts.begin() + last; start != m_starts.end(); ++start)
+        *start = static_cast<uint32_t>(*start + delta);
+
+    std::vector<uint32_t> starts;
+    IndexLines(newText, prefix, newEnd, starts);
+    m_starts.erase(m_starts.begin() + first, m_starts.begin() + last);
+    m_starts.insert(m_starts.begin() + first, starts.begin(), starts.end());
+    m_nonAscii.erase(m_nonAscii.begin() + first, m_nonAscii.begin() + last);
+    m_nonAscii.insert(m_nonAscii.begin() + first, starts.size(), 0);
+
+    // the line the change starts on and the inserted lines have changed, the following ones are intact
+    MarkLines(newText, static_cast<uint32_t>(first - 1), static_cast<uint32_t>(first - 1 + starts.size()));
+}
+
+size_t LineIndex::GetLineCount() const
+{
+    return m_starts.size();
+}
+
+uint32_t LineIndex::GetLine(size_t offset) const
+{
+    const auto next = std::upper_bound(m_starts.begin(), m_starts.end(), offset);
+    return static_cast<uint32_t>(next - m_starts.begin() - 1);
+}
+
+size_t LineIndex::GetLineStart(uint32_t line) const
+{
+    return m_starts[std::min<size_t>(line, m_starts.size() - 1)];
+}
+
+bool LineIndex::IsAscii(uint32_t line) const
+{
+    return line >= m_nonAscii.size() || m_nonAscii[line] == 0;
+}
+
+uint32_t LineIndex::GetCharacter(
+    std::string_view text, uint32_t line, size_t byteColumn, PositionEncoding encoding) const
+{
+    line = std::min(line, static_cast<uint32_t>(m_starts.size() - 1));
+    const auto start = m_starts[line];
+    const auto column = std::min(byteColumn, GetLineEnd(text, line) - start);
+    if (encoding == PositionEncoding::Utf8 || IsAscii(line))
+        return static_cast<uint32_t>(column);
+    return CountUnits(text.data() + start, column, encoding);
+}
+
+TextPosition LineIndex::GetPosition(std::string_view text, size_t offset, PositionEncoding encoding) const
+{
+    offset = std::min(offset, text.size());
+    const auto line = GetLine(offset);
+    return {line, GetCharacter(text, line, offset - m_starts[line], encoding)};
+}
+
+size_t LineIndex::GetOffset(std::string_view text, TextPosition position, PositionEncoding encoding) const
+{
+    const auto line = std::min(position.line, static_cast<uint32_t>(m_starts.size() - 1));
+    const size_t start = m_starts[line];
+    const auto end = GetLineEnd(text, line);
+    if (encoding == PositionEncoding::Utf8 || IsAscii(line))
+        return start + std::min<size_t>(position.character, end - start);
+
+    uint32_t units = 0;
+    auto offset = start;
+    while (offset < end)
+    {
+        const auto length = GetSequenceLength(static_cast<unsigned char>(text[offset]));
+        const uint32_t characterUnits = encoding == PositionEncoding::Utf16 && length == 4 ? 2 : 1;
+        // a position inside a surrogate pair refers to the whole character
+        if (units + characterUnits > position.character)
+            break;
+        units += characterUnits;
+        offset += length;
+    }
+    return std::min(offset, end);
+}
+
+size_t LineIndex::GetLineEnd(std::string_view text, uint32_t line) const
+{
+    if (line + 1 >= m_starts.size())
+        return text.size();
+    size_t end = m_starts[line + 1] - 1;
+    if (end > m_starts[line] && text[end - 1] == '\r')
+        --end;
+    return end;
+}
+
+void LineIndex::IndexLines(std::string_view text, size_t begin, size_t end, std::vector<uint32_t>& starts) const
+{
+    // memchr is vectorized by the C library
+    const char* data = text.data();
+    while (begin < end)
+    {
+        const auto* lineBreak = static_cast<const char*>(std::memchr(data + begin, '\n', end - begin));
+        if (!lineBreak)
+            break;
+        begin = static_cast<size_t>(lineBreak - data) + 1;
+        starts.push_back(static_cast<uint32_t>(begin));
+    }
+}
+
+void LineIndex::MarkLines(std::string_view text, uint32_t first, uint32_t last)
+{
+    for (auto line = first; line <= last; ++line)
+    {
+        const size_t start = m_starts[line];
+        const size_t end = line + 1 < m_starts.size() ? m_starts[line + 1] : text.size();
+        m_nonAscii[line] = HasNonAscii(text.data() + start, end - start) ? 1 : 0;
+    }
+}
+
+} // namespace ocls
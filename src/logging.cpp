@@ -0,0 +1,103 @@
+//
+//  logging.cpp
+//  opencl-language-server
+//
+
+#include "logging.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <spdlog/async.h>
+#include <spdlog/sinks/null_sink.h>
+#include <spdlog/sinks/rotating_file_sink.h>
+#include <vector>
+
+namespace ocls::logging {
+
+namespace {
+
+constexpr size_t queueSize = 8192;
+constexpr size_t maxTextSize = 4096;
+constexpr auto flushInterval = std::chrono::seconds(3);
+constexpr const char* moduleLoggers[] = {"clinfo", "diagnostics", "jrpc", "lsp"};
+
+std::atomic<bool> fileLogging {false};
+std::atomic<spdlog::level::level_enum> configuredLevel {spdlog::level::info};
+
+} // namespace
+
+void Configure(const Options& options)
+{
+    try
+    {
+        spdlog::sink_ptr sink;
+        if (options.fileLogging)
+        {
+            // the queued loggers refer to the pool, it is kept when the logging is configured again
+            if (!spdlog::thread_pool())
+                spdlog::init_thread_pool(queueSize, 1);
+            sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(
+                options.filename, options.maxFileSize, options.maxFiles);
+        }
+        else
+        {
+            sink = std::make_shared<spdlog::sinks::null_sink_mt>();
+        }
+        const auto create = [&options, &sink](const char* name) -> std::shared_ptr<spdlog::logger> {
+            if (!options.fileLogging)
+                return std::make_shared<spdlog::logger>(name, sink);
+            return std::make_shared<spdlog::async_logger>(
+                name, sink, spdlog::thread_pool(), spdlog::async_overflow_policy::overrun_oldest);
+        };
+        spdlog::set_default_logger(create("opencl-ls"));
+        for (const auto* name : moduleLoggers)
+        {
+            // the modules keep the handles returned by Get, so a registered logger is updated in place
+            if (const auto logger = spdlog::get(name))
+                logger->sinks() = {sink};
+            else
+                spdlog::register_logger(create(name));
+        }
+        if (options.fileLogging)
+            spdlog::flush_every(flushInterval);
+
+        fileLogging = options.fileLogging;
+        configuredLevel = options.fileLogging ? options.level : spdlog::level::off;
+        spdlog::set_level(configuredLevel);
+        spdlog::flush_on(spdlog::level::err);
+    }
+    catch (const spdlog::spdlog_ex& ex)
+    {
+        std::cerr << "Log init failed: " << ex.what() << std::endl;
+    }
+}
+
+void Shutdown()
+{
+    spdlog::shutdown();
+}
+
+void SetTrace(std::string_view value)
+{
+    if (!fileLogging)
+        return;
+
+    auto level = configuredLevel.load();
+    if (value == "messages")
+        level = std::min(level, spdlog::level::debug);
+    else if (value == "verbose")
+        level = spdlog::level::trace;
+    spdlog::set_level(level);
+}
+
+std::string Truncate(std::string_view text)
+{
+    if (text.size() <= maxTextSize)
+        return std::string(text);
+    std::string result(text.substr(0, maxTextSize));
+    result.append("... (").append(std::to_string(text.size())).append(" bytes)");
+    return result;
+}
+
+} // namespace ocls::logging
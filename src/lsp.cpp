@@ -8,12 +8,36 @@
 #include "lsp.hpp"
 #include "diagnostics.hpp"
 #include "jsonrpc.hpp"
+#include "lineindex.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "scheduler.hpp"
+#include "stringpool.hpp"
+#include "tracing.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <optional>
 #include <spdlog/spdlog.h>
+#include <thread>
 
 #include <queue>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+#if defined(WIN32)
+    #include <climits>
+    #include <io.h>
+    #include <stdio.h>
+#else
+    #include <cerrno>
+    #include <unistd.h>
+#endif
 
 using namespace nlohmann;
 
@@ -21,41 +45,148 @@ namespace ocls {
 
 constexpr char logger[] = "lsp";
 
+// Document uris are interned in the shared string pool and referenced by handle,
+// the server holds a reference to every uri it keeps state for
+using UriHandle = StringPool::Handle;
+
 struct Capabilities
 {
     bool hasConfigurationCapability = false;
     bool supportDidChangeConfiguration = false;
+    bool supportDiagnosticPull = false;
+    bool supportDiagnosticRefresh = false;
+    PositionEncoding positionEncoding = PositionEncoding::Utf16;
+};
+
+// Settings of the client, the defaults are the ones the diagnostics start with
+struct Configuration
+{
+    BuildOptions buildOptions;
+    int64_t maxNumberOfProblems = 100;
+    int64_t deviceID = 0;
 };
 
-class LSPServer final
-    : public ILSPServer
-    , public std::enable_shared_from_this<LSPServer>
+struct Document
+{
+    SharedText text;
+    std::optional<int64_t> version;
+    LineIndex lines;
+    // the text was edited after the document was opened, so it may differ from the file
+    bool modified = false;
+};
+
+// Bytes of the client's stream, read on a thread of its own while the server runs the builds
+struct InputQueue
+{
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::string bytes;
+    bool closed = false;
+};
+
+struct DiagnosticsReport
+{
+    std::string resultId;
+    // of the items alone, they are only published again when it changes
+    uint32_t hash = 0;
+    DiagnosticsList items;
+};
+
+class LSPServer final : public ILSPServer
 {
 public:
-    LSPServer() : m_diagnostics(CreateDiagnostics(CreateCLInfo())) {}
+    LSPServer(InputFunc input, OutputFunc output, std::shared_ptr<IBuildEnvironment> environment)
+        : m_input {std::move(input)}
+        , m_output {std::move(output)}
+        , m_diagnostics(CreateDiagnostics(environment ? std::move(environment) : CreateBuildEnvironment(CreateCLInfo())))
+    {
+        RegisterCallbacks();
+    }
+
+    ~LSPServer()
+    {
+        for (const auto uri : m_uris)
+            m_strings.Release(uri);
+    }
 
     int Run();
     void Interrupt();
+    std::optional<int> Consume(const char *data, size_t size);
+    bool RunScheduledBuild();
+    bool HasScheduledBuild() const;
 
 private:
-    void BuildDiagnosticsRespond(const std::string &uri, const std::string &content);
+    void RegisterCallbacks();
+    std::vector<std::pair<UriHandle, bool>> UpdateDiagnostics(UriHandle uri, const SharedText &content);
+    void ConvertPositions(UriHandle uri, DiagnosticsList &diagnostics) const;
+    std::string GetResultId(UriHandle uri, uint32_t hash) const;
+    bool SetDiagnosticsReport(UriHandle uri, DiagnosticsList items);
+    const DiagnosticsReport &GetDiagnosticsReport(UriHandle uri);
+    void InvalidateDiagnosticsReport(UriHandle uri);
+    void RefreshDiagnostics();
+    void BuildDiagnosticsRespond(
+        UriHandle uri, const SharedText &content, std::chrono::steady_clock::time_point requestTime);
+    void PublishDiagnostics(
+        UriHandle uri, const DiagnosticsList &diagnostics, std::chrono::steady_clock::time_point requestTime);
+    void ScheduleBuild(UriHandle uri, BuildPriority priority);
+    void ScheduleRebuild(UriHandle uri);
+    BuildOptions ParseBuildOptions(const json &options);
+    void ApplyConfiguration(Configuration configuration);
+    void TruncateReports(int64_t previousMaxNumberOfProblems);
+    bool AppendDiagnosticsReport(UriHandle uri, const std::string &previousResultId);
+    std::optional<int64_t> GetDocumentVersion(UriHandle uri) const;
+    UriHandle GetPathUri(const std::string &path);
+    UriHandle InternUri(std::string_view uri);
+    std::optional<UriHandle> FindUri(std::string_view uri) const;
+    void ReleaseUri(UriHandle uri);
     void GetConfiguration();
     void OnInitialize(const json &data);
     void OnInitialized(const json &data);
-    void OnTextOpen(const json &data);
-    void OnTextChanged(const json &data);
+    void OnTextOpen(json &data);
+    void OnTextChanged(json &data);
+    void OnTextClose(const json &data);
+    void OnDocumentDiagnostic(const json &data);
+    void OnWorkspaceDiagnostic(const json &data);
     void OnConfiguration(const json &data);
     void OnRespond(const json &data);
+    void OnStats(const json &data);
     void OnShutdown(const json &data);
-    void OnExit();
+    void OnExit(const json &data);
+    void OnConfigurationChanged(const json &data);
 
 private:
     JsonRPC m_jrpc;
+    InputFunc m_input;
+    OutputFunc m_output;
+    StringPool &m_strings = GetStringPool();
     std::shared_ptr<IDiagnostics> m_diagnostics;
     std::queue<json> m_outQueue;
     Capabilities m_capabilities;
-    std::queue<std::pair<std::string, std::string>> m_requests;
+    Configuration m_configuration;
+    // id -> method of the requests sent to the client that wait for the response
+    std::unordered_map<std::string, std::string> m_requests;
+    // uri -> the opened documents
+    std::unordered_map<UriHandle, Document> m_documents;
+    // uri of an included file -> uri of the document whose build reported problems in it
+    std::unordered_map<UriHandle, UriHandle> m_includers;
+    // uri of a built document -> uris of the included files problems were published for
+    std::unordered_map<UriHandle, std::set<UriHandle>> m_includedFiles;
+    // uri -> the latest diagnostics of the file
+    std::unordered_map<UriHandle, DiagnosticsReport> m_reports;
+    // file path -> uri of the file
+    std::unordered_map<std::string, UriHandle> m_pathUris;
+    // uris the server holds a reference to
+    std::unordered_set<UriHandle> m_uris;
+    // builds of the opened documents, run between the messages in push mode
+    BuildScheduler m_builds;
+    // the document the client has edited last
+    std::optional<UriHandle> m_activeUri;
+    // reused for serializing diagnostics messages
+    std::string m_messageBuffer;
+    // a workspace/diagnostic/refresh request is waiting for the response
+    bool m_refreshPending = false;
     bool m_shutdown = false;
+    std::optional<int> m_exitCode;
     std::atomic<bool> m_interrupted = {false};
 };
 
@@ -63,15 +194,15 @@ void LSPServer::GetConfiguration()
 {
     if (!m_capabilities.hasConfigurationCapability)
     {
-        spdlog::get(logger)->debug("Does not have configuration capability");
+        logging::Get<logger>().debug("Does not have configuration capability");
         return;
     }
-    spdlog::get(logger)->debug("Make configuration request");
+    logging::Get<logger>().debug("Make configuration request");
     json buildOptions = {{"section", "OpenCL.server.buildOptions"}};
     json maxNumberOfProblems = {{"section", "OpenCL.server.maxNumberOfProblems"}};
     json openCLDeviceID = {{"section", "OpenCL.server.deviceID"}};
     const auto requestId = utils::GenerateId();
-    m_requests.push(std::make_pair("workspace/configuration", requestId));
+    m_requests.emplace(requestId, "workspace/configuration");
     m_outQueue.push(
         {{"id", requestId},
          {"method", "workspace/configuration"},
@@ -81,7 +212,20 @@ void LSPServer::GetConfiguration()
 
 void LSPServer::OnInitialize(const json &data)
 {
-    spdlog::get(logger)->debug("Received 'initialize' request");
+    logging::Get<logger>().debug("Received 'initialize' request");
+    m_capabilities.supportDiagnosticPull =
+        data.contains(json::json_pointer("/params/capabilities/textDocument/diagnostic"));
+    const auto refreshSupport = json::json_pointer("/params/capabilities/workspace/diagnostics/refreshSupport");
+    m_capabilities.supportDiagnosticRefresh = data.contains(refreshSupport) && data.at(refreshSupport) == true;
+    m_capabilities.positionEncoding = PositionEncoding::Utf16;
+    const auto positionEncodings = json::json_pointer("/params/capabilities/general/positionEncodings");
+    if (data.contains(positionEncodings))
+    {
+        // compiler columns are bytes, so UTF-8 needs no conversion
+        const auto &encodings = data.at(positionEncodings);
+        if (encodings.is_array() && std::find(encodings.begin(), encodings.end(), "utf-8") != encodings.end())
+            m_capabilities.positionEncoding = PositionEncoding::Utf8;
+    }
     try
     {
         m_capabilities.hasConfigurationCapability =
@@ -89,22 +233,18 @@ void LSPServer::OnInitialize(const json &data)
         m_capabilities.supportDidChangeConfiguration =
             data["params"]["capabilities"]["workspace"]["didChangeConfiguration"]["dynamicRegistration"].get<bool>();
         auto configuration = data["params"]["initializationOptions"]["configuration"];
-
-        auto buildOptions = configuration["buildOptions"];
-        m_diagnostics->SetBuildOptions(buildOptions);
-
-        auto maxNumberOfProblems = configuration["maxNumberOfProblems"].get<int64_t>();
-        m_diagnostics->SetMaxProblemsCount(static_cast<int>(maxNumberOfProblems));
-
-        auto deviceID = configuration["deviceID"].get<int64_t>();
-        m_diagnostics->SetOpenCLDevice(static_cast<uint32_t>(deviceID));
+        ApplyConfiguration(
+            {ParseBuildOptions(configuration["buildOptions"]),
+             configuration["maxNumberOfProblems"].get<int64_t>(),
+             configuration["deviceID"].get<int64_t>()});
     }
     catch (std::exception &err)
     {
-        spdlog::get(logger)->error("Failed to parse initialize parameters, {}", err.what());
+        logging::Get<logger>().error("Failed to parse initialize parameters, {}", err.what());
     }
 
     json capabilities = {
+        {"positionEncoding", m_capabilities.positionEncoding == PositionEncoding::Utf8 ? "utf-8" : "utf-16"},
         {"textDocumentSync",
          {
              {"openClose", true},
@@ -114,16 +254,23 @@ void LSPServer::OnInitialize(const json &data)
              {"save", false},
          }},
     };
+    if (m_capabilities.supportDiagnosticPull)
+    {
+        capabilities["diagnosticProvider"] = {
+            {"interFileDependencies", true},
+            {"workspaceDiagnostics", true},
+        };
+    }
 
     m_outQueue.push({{"id", data["id"]}, {"result", {{"capabilities", capabilities}}}});
 }
 
 void LSPServer::OnInitialized(const json &)
 {
-    spdlog::get(logger)->debug("Received 'initialized' message");
+    logging::Get<logger>().debug("Received 'initialized' message");
     if (!m_capabilities.supportDidChangeConfiguration)
     {
-        spdlog::get(logger)->debug("Does not support didChangeConfiguration registration");
+        logging::Get<logger>().debug("Does not support didChangeConfiguration registration");
         return;
     }
 
@@ -139,180 +286,834 @@ void LSPServer::OnInitialized(const json &)
     m_outQueue.push({{"id", utils::GenerateId()}, {"method", "client/registerCapability"}, {"params", params}});
 }
 
-void LSPServer::BuildDiagnosticsRespond(const std::string &uri, const std::string &content)
+namespace {
+
+// Clients may send a null version, the diagnostics of such documents are published without one
+std::optional<int64_t> GetVersion(const json &textDocument)
 {
-    try
+    const auto version = textDocument.value("version", json());
+    if (!version.is_number_integer())
+        return std::nullopt;
+    return version.get<int64_t>();
+}
+
+uint32_t HashDiagnostics(const DiagnosticsList &diagnostics)
+{
+    uint32_t hash = diagnostics.source.GetHandle();
+    const auto combine = [&hash](const auto &values) {
+        const auto *bytes = reinterpret_cast<const uint8_t *>(values.data());
+        const auto crc = utils::CRC32(bytes, bytes + values.size() * sizeof(values[0]));
+        hash ^= static_cast<uint32_t>(crc) + 0x9e3779b9u + (hash << 6) + (hash >> 2);
+    };
+    combine(diagnostics.lines);
+    combine(diagnostics.characters);
+    combine(diagnostics.severities);
+    combine(diagnostics.messageEnds);
+    combine(diagnostics.messageText);
+    return hash;
+}
+
+} // namespace
+
+std::optional<int64_t> LSPServer::GetDocumentVersion(UriHandle uri) const
+{
+    auto document = m_documents.find(uri);
+    return document == m_documents.end() ? std::nullopt : document->second.version;
+}
+
+UriHandle LSPServer::GetPathUri(const std::string &path)
+{
+    auto uri = m_pathUris.find(path);
+    if (uri == m_pathUris.end())
+        uri = m_pathUris.emplace(path, InternUri(utils::PathToUri(path))).first;
+    return uri->second;
+}
+
+UriHandle LSPServer::InternUri(std::string_view uri)
+{
+    const auto handle = m_strings.Intern(uri);
+    // a single reference is held however many times the uri was seen
+    if (!m_uris.insert(handle).second)
+        m_strings.Release(handle);
+    return handle;
+}
+
+// Returns the handle of a uri the server keeps state for, other uris are not interned for a lookup
+std::optional<UriHandle> LSPServer::FindUri(std::string_view uri) const
+{
+    const auto handle = m_strings.Find(uri);
+    if (!handle || m_uris.find(*handle) == m_uris.end())
+        return std::nullopt;
+    return handle;
+}
+
+// The reference is dropped once no state of the server refers to the uri
+void LSPServer::ReleaseUri(UriHandle uri)
+{
+    if (m_documents.count(uri) > 0 || m_reports.count(uri) > 0 || m_includers.count(uri) > 0 ||
+        m_includedFiles.count(uri) > 0 || m_builds.GetPriority(uri) || m_activeUri == uri)
+        return;
+    if (m_uris.erase(uri) == 0)
+        return;
+    for (auto pathUri = m_pathUris.begin(); pathUri != m_pathUris.end();)
+        pathUri = pathUri->second == uri ? m_pathUris.erase(pathUri) : std::next(pathUri);
+    m_strings.Release(uri);
+}
+
+void LSPServer::PublishDiagnostics(
+    UriHandle uri, const DiagnosticsList &diagnostics, std::chrono::steady_clock::time_point requestTime)
+{
+    tracing::Span span("lsp", "publishDiagnostics");
+    auto &message = m_messageBuffer;
+    message.clear();
+    message.append(R"({"jsonrpc":"2.0","method":"textDocument/publishDiagnostics","params":{"diagnostics":)");
+    SerializeDiagnostics(diagnostics, message);
+    message.append(R"(,"uri":)");
+    utils::AppendJsonString(message, m_strings.Get(uri));
+    if (const auto version = GetDocumentVersion(uri))
+        message.append(R"(,"version":)").append(std::to_string(*version));
+    message.append("}}");
+    m_jrpc.WriteSerialized(message, "textDocument/publishDiagnostics");
+    metrics::Increment(metrics::Counter::PublishedDiagnostics);
+    metrics::Record(
+        metrics::Histogram::ReceiveToPublish,
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - requestTime));
+}
+
+// Appends DocumentDiagnosticReport members of the file to the message buffer, the object is left open.
+// Returns true for a full report, false for an unchanged one.
+bool LSPServer::AppendDiagnosticsReport(UriHandle uri, const std::string &previousResultId)
+{
+    const auto &report = GetDiagnosticsReport(uri);
+    auto &message = m_messageBuffer;
+    if (!previousResultId.empty() && previousResultId == report.resultId)
     {
-        const auto filePath = utils::UriToPath(uri);
-        spdlog::get(logger)->debug("Converted uri '{}' to path '{}'", uri, filePath);
+        message.append(R"({"kind":"unchanged","resultId":)");
+        utils::AppendJsonString(message, report.resultId);
+        return false;
+    }
+    message.append(R"({"items":)");
+    SerializeDiagnostics(report.items, message);
+    message.append(R"(,"kind":"full","resultId":)");
+    utils::AppendJsonString(message, report.resultId);
+    return true;
+}
 
-        json diags = m_diagnostics->Get({filePath, content});
-        m_outQueue.push(
-            {{"method", "textDocument/publishDiagnostics"},
-             {"params",
-              {
-                  {"uri", uri},
-                  {"diagnostics", diags},
-              }}});
+// Builds the document and updates the reports of every file problems were reported for.
+// Returns uris of the updated files along with whether their diagnostics have changed.
+std::vector<std::pair<UriHandle, bool>> LSPServer::UpdateDiagnostics(UriHandle uri, const SharedText &content)
+{
+    const auto filePath = utils::UriToPath(std::string(m_strings.Get(uri)));
+    logging::Get<logger>().debug("Converted uri '{}' to path '{}'", m_strings.Get(uri), filePath);
+
+    // the edited documents the build may include are passed along, the compiler would read them from the disk.
+    // The built one is passed too, so its overlay is not removed and written again by the builds of the others.
+    std::map<std::string, SharedText> overlays;
+    for (const auto &[documentUri, document] : m_documents)
+    {
+        if (document.modified)
+            overlays.emplace(utils::UriToPath(std::string(m_strings.Get(documentUri))), document.text);
+    }
+    auto diagnostics = m_diagnostics->Get({filePath, content, std::move(overlays)});
+    std::vector<std::pair<UriHandle, bool>> updatedFiles;
+    std::set<UriHandle> includedFiles;
+    DiagnosticsList fileDiagnostics;
+    for (auto &[path, diags] : diagnostics)
+    {
+        if (path == filePath)
+        {
+            fileDiagnostics = std::move(diags);
+            continue;
+        }
+        const auto includedUri = GetPathUri(path);
+        logging::Get<logger>().debug("Got diagnostics of included file '{}'", m_strings.Get(includedUri));
+        ConvertPositions(includedUri, diags);
+        const bool changed = SetDiagnosticsReport(includedUri, std::move(diags));
+        updatedFiles.emplace_back(includedUri, changed);
+        m_includers[includedUri] = uri;
+        includedFiles.insert(includedUri);
+    }
+    // Clear included files that no longer have problems
+    for (const auto &includedUri : m_includedFiles[uri])
+    {
+        if (includedFiles.find(includedUri) == includedFiles.end())
+        {
+            const bool changed = SetDiagnosticsReport(includedUri, {});
+            updatedFiles.emplace_back(includedUri, changed);
+        }
+    }
+    m_includedFiles[uri] = std::move(includedFiles);
+    // the result id of the document covers the reports of the included files
+    ConvertPositions(uri, fileDiagnostics);
+    const bool changed = SetDiagnosticsReport(uri, std::move(fileDiagnostics));
+    updatedFiles.emplace(updatedFiles.begin(), uri, changed);
+    return updatedFiles;
+}
+
+// Compiler columns are 1-based bytes, LSP characters are 0-based units of the negotiated encoding.
+// Included files are built from the disk, their columns are only converted if they are open.
+void LSPServer::ConvertPositions(UriHandle uri, DiagnosticsList &diagnostics) const
+{
+    for (auto &character : diagnostics.characters)
+        character = character > 0 ? character - 1 : 0;
+    if (m_capabilities.positionEncoding == PositionEncoding::Utf8)
+        return;
+    const auto document = m_documents.find(uri);
+    if (document == m_documents.end() || !document->second.text)
+        return;
+    const auto &text = *document->second.text;
+    const auto &lines = document->second.lines;
+    for (size_t i = 0; i < diagnostics.size(); ++i)
+    {
+        diagnostics.characters[i] =
+            lines.GetCharacter(text, diagnostics.lines[i], diagnostics.characters[i], m_capabilities.positionEncoding);
+    }
+}
+
+// A pulled report of a document is sent with the reports of its included files as related documents,
+// so they are part of its result id: the client gets a full report when any of them changes.
+std::string LSPServer::GetResultId(UriHandle uri, uint32_t hash) const
+{
+    const auto includedFiles = m_includedFiles.find(uri);
+    if (includedFiles != m_includedFiles.end())
+    {
+        for (const auto includedUri : includedFiles->second)
+        {
+            const auto report = m_reports.find(includedUri);
+            if (report == m_reports.end())
+                continue;
+            for (const auto value : {m_strings.Get(includedUri), std::string_view(report->second.resultId)})
+            {
+                const auto *bytes = reinterpret_cast<const uint8_t *>(value.data());
+                hash ^= static_cast<uint32_t>(utils::CRC32(bytes, bytes + value.size())) + 0x9e3779b9u + (hash << 6) +
+                        (hash >> 2);
+            }
+        }
+    }
+    return std::to_string(hash);
+}
+
+bool LSPServer::SetDiagnosticsReport(UriHandle uri, DiagnosticsList items)
+{
+    const auto hash = HashDiagnostics(items);
+    auto resultId = GetResultId(uri, hash);
+    auto &report = m_reports[uri];
+    if (!report.resultId.empty() && report.hash == hash)
+    {
+        report.resultId = std::move(resultId);
+        return false;
+    }
+    report = {std::move(resultId), hash, std::move(items)};
+    return true;
+}
+
+const DiagnosticsReport &LSPServer::GetDiagnosticsReport(UriHandle uri)
+{
+    auto report = m_reports.find(uri);
+    if (report != m_reports.end())
+    {
+        metrics::Increment(metrics::Counter::CacheHits);
+        return report->second;
+    }
+    metrics::Increment(metrics::Counter::CacheMisses);
+
+    auto target = uri;
+    auto includer = m_includers.find(uri);
+    if (includer != m_includers.end() && m_documents.find(includer->second) != m_documents.end())
+        target = includer->second;
+
+    auto document = m_documents.find(target);
+    if (document != m_documents.end())
+        UpdateDiagnostics(document->first, document->second.text);
+
+    report = m_reports.find(uri);
+    if (report == m_reports.end())
+    {
+        SetDiagnosticsReport(uri, {});
+        report = m_reports.find(uri);
+    }
+    return report->second;
+}
+
+// The client pulls the diagnostics of the changed document, the includer has to be refreshed
+void LSPServer::InvalidateDiagnosticsReport(UriHandle uri)
+{
+    m_reports.erase(uri);
+    auto includer = m_includers.find(uri);
+    if (includer != m_includers.end() && m_reports.erase(includer->second) > 0)
+        RefreshDiagnostics();
+}
+
+// Ask the client to pull the diagnostics again, the results it has are no longer valid
+void LSPServer::RefreshDiagnostics()
+{
+    if (!m_capabilities.supportDiagnosticPull || !m_capabilities.supportDiagnosticRefresh || m_refreshPending)
+        return;
+    logging::Get<logger>().debug("Make diagnostics refresh request");
+    const auto requestId = utils::GenerateId();
+    m_requests.emplace(requestId, "workspace/diagnostic/refresh");
+    m_outQueue.push({{"id", requestId}, {"method", "workspace/diagnostic/refresh"}, {"params", nullptr}});
+    m_refreshPending = true;
+}
+
+void LSPServer::BuildDiagnosticsRespond(
+    UriHandle uri, const SharedText &content, std::chrono::steady_clock::time_point requestTime)
+{
+    tracing::Span span("lsp", "buildDiagnostics", m_strings.Get(uri));
+    try
+    {
+        for (const auto &[fileUri, changed] : UpdateDiagnostics(uri, content))
+        {
+            if (changed)
+            {
+                PublishDiagnostics(fileUri, m_reports[fileUri].items, requestTime);
+            }
+            else
+            {
+                logging::Get<logger>().debug(
+                    "Diagnostics for '{}' did not change, skip publishing", m_strings.Get(fileUri));
+                metrics::Increment(metrics::Counter::SuppressedDiagnostics);
+            }
+        }
     }
     catch (std::exception &err)
     {
         auto msg = std::string("Failed to get diagnostics: ") + err.what();
-        spdlog::get(logger)->error(msg);
+        logging::Get<logger>().error(msg);
         m_jrpc.WriteError(JsonRPC::ErrorCode::InternalError, msg);
     }
 }
 
-void LSPServer::OnTextOpen(const json &data)
+// The build runs once the received messages are handled. The document edited last is built first,
+// the document that was active before is moved behind it.
+void LSPServer::ScheduleBuild(UriHandle uri, BuildPriority priority)
 {
-    spdlog::get(logger)->debug("Received 'textOpen' message");
-    std::string srcUri = data["params"]["textDocument"]["uri"].get<std::string>();
-    std::string content = data["params"]["textDocument"]["text"].get<std::string>();
-    BuildDiagnosticsRespond(srcUri, content);
+    if (priority == BuildPriority::Active)
+    {
+        if (m_activeUri && *m_activeUri != uri)
+            m_builds.Demote(*m_activeUri, BuildPriority::Open);
+        m_activeUri = uri;
+    }
+    if (!m_builds.Enqueue(uri, priority, m_jrpc.GetReceiveTime()))
+        logging::Get<logger>().debug("Build of '{}' is already scheduled", m_strings.Get(uri));
 }
 
-void LSPServer::OnTextChanged(const json &data)
+void LSPServer::OnTextOpen(json &data)
 {
-    spdlog::get(logger)->debug("Received 'textChanged' message");
-    std::string srcUri = data["params"]["textDocument"]["uri"].get<std::string>();
-    std::string content = data["params"]["contentChanges"][0]["text"].get<std::string>();
+    logging::Get<logger>().debug("Received 'textOpen' message");
+    auto &textDocument = data["params"]["textDocument"];
+    const auto srcUri = InternUri(textDocument["uri"].get_ref<const std::string &>());
+    auto &document = m_documents[srcUri];
+    // the text is moved out of the message, which is released after the handler
+    auto text = MakeSharedText(std::move(textDocument["text"].get_ref<std::string &>()));
+    LineIndex lines(*text);
+    document = {std::move(text), GetVersion(textDocument), std::move(lines)};
+    if (m_capabilities.supportDiagnosticPull)
+    {
+        InvalidateDiagnosticsReport(srcUri);
+        return;
+    }
 
-    BuildDiagnosticsRespond(srcUri, content);
+    auto includer = m_includers.find(srcUri);
+    if (includer != m_includers.end() && m_documents.find(includer->second) != m_documents.end())
+    {
+        logging::Get<logger>().debug(
+            "Diagnostics for '{}' were published by the build of '{}'",
+            m_strings.Get(srcUri),
+            m_strings.Get(includer->second));
+        return;
+    }
+    ScheduleBuild(srcUri, BuildPriority::Active);
+}
+
+void LSPServer::OnTextChanged(json &data)
+{
+    logging::Get<logger>().debug("Received 'textChanged' message");
+    const auto &textDocument = data["params"]["textDocument"];
+    const auto srcUri = InternUri(textDocument["uri"].get_ref<const std::string &>());
+    auto &document = m_documents[srcUri];
+    auto text = MakeSharedText(std::move(data["params"]["contentChanges"][0]["text"].get_ref<std::string &>()));
+    // edits are usually small, only the lines between the unchanged head and tail are reindexed
+    if (document.text)
+        document.lines.Update(*document.text, *text);
+    else
+        document.lines = LineIndex(*text);
+    document.text = std::move(text);
+    document.version = GetVersion(textDocument);
+    document.modified = true;
+    if (m_capabilities.supportDiagnosticPull)
+    {
+        InvalidateDiagnosticsReport(srcUri);
+        return;
+    }
+
+    // Problems of an included file come from the build of the document including it,
+    // so rebuild that document instead of building the included file on its own.
+    auto includer = m_includers.find(srcUri);
+    if (includer != m_includers.end())
+    {
+        auto includerDocument = m_documents.find(includer->second);
+        if (includerDocument != m_documents.end())
+        {
+            logging::Get<logger>().debug(
+                "Rebuilding '{}' which includes '{}'", m_strings.Get(includer->second), m_strings.Get(srcUri));
+            ScheduleBuild(includerDocument->first, BuildPriority::Active);
+            return;
+        }
+    }
+    ScheduleBuild(srcUri, BuildPriority::Active);
+}
+
+void LSPServer::OnTextClose(const json &data)
+{
+    logging::Get<logger>().debug("Received 'textClose' message");
+    const auto srcUri = FindUri(data["params"]["textDocument"]["uri"].get_ref<const std::string &>());
+    if (!srcUri)
+        return;
+    m_documents.erase(*srcUri);
+    m_reports.erase(*srcUri);
+    m_builds.Cancel(*srcUri);
+    if (m_activeUri == srcUri)
+        m_activeUri.reset();
+
+    // the problems of the included files came from the build of the closed document
+    std::vector<UriHandle> includedFiles;
+    for (auto includer = m_includers.begin(); includer != m_includers.end();)
+    {
+        if (includer->second != *srcUri)
+        {
+            ++includer;
+            continue;
+        }
+        includedFiles.push_back(includer->first);
+        if (m_documents.find(includer->first) == m_documents.end())
+            m_reports.erase(includer->first);
+        includer = m_includers.erase(includer);
+    }
+    m_includedFiles.erase(*srcUri);
+    for (const auto includedUri : includedFiles)
+        ReleaseUri(includedUri);
+    ReleaseUri(*srcUri);
+}
+
+void LSPServer::OnDocumentDiagnostic(const json &data)
+{
+    logging::Get<logger>().debug("Received 'diagnostic' request");
+    try
+    {
+        const auto &params = data["params"];
+        const auto &uriString = params["textDocument"]["uri"].get_ref<const std::string &>();
+        const auto previousResultId = params.value("previousResultId", std::string());
+        const auto knownUri = FindUri(uriString);
+        if (!knownUri)
+        {
+            // nothing is known about a document that is not open, its report is empty
+            const auto resultId = std::to_string(HashDiagnostics({}));
+            json report = {{"kind", "full"}, {"resultId", resultId}, {"items", json::array()}};
+            if (previousResultId == resultId)
+                report = {{"kind", "unchanged"}, {"resultId", resultId}};
+            m_outQueue.push({{"id", data["id"]}, {"result", std::move(report)}});
+            return;
+        }
+        const auto uri = *knownUri;
+
+        // build before serializing, so that included files are known
+        GetDiagnosticsReport(uri);
+        const auto build = m_includedFiles.find(uri);
+        const auto includedFiles = build == m_includedFiles.end() ? std::set<UriHandle>() : build->second;
+
+        auto &message = m_messageBuffer;
+        message.clear();
+        message.append(R"({"id":)").append(data["id"].dump()).append(R"(,"jsonrpc":"2.0","result":)");
+        const bool isFullReport = AppendDiagnosticsReport(uri, previousResultId);
+        if (isFullReport && !includedFiles.empty())
+        {
+            message.append(R"(,"relatedDocuments":{)");
+            for (const auto &includedUri : includedFiles)
+            {
+                if (message.back() == '}')
+                    message.push_back(',');
+                utils::AppendJsonString(message, m_strings.Get(includedUri));
+                message.push_back(':');
+                AppendDiagnosticsReport(includedUri, "");
+                message.push_back('}');
+            }
+            message.push_back('}');
+        }
+        message.append("}}");
+        m_jrpc.WriteSerialized(message);
+    }
+    catch (std::exception &err)
+    {
+        auto msg = std::string("Failed to get diagnostics: ") + err.what();
+        logging::Get<logger>().error(msg);
+        m_outQueue.push(
+            {{"id", data["id"]},
+             {"error", {{"code", static_cast<int>(JsonRPC::ErrorCode::InternalError)}, {"message", msg}}}});
+    }
+}
+
+void LSPServer::OnWorkspaceDiagnostic(const json &data)
+{
+    logging::Get<logger>().debug("Received 'workspace/diagnostic' request");
+    try
+    {
+        std::unordered_map<UriHandle, std::string> previousResultIds;
+        for (const auto &previous : data["params"].value("previousResultIds", json::array()))
+        {
+            if (const auto uri = FindUri(previous["uri"].get_ref<const std::string &>()))
+                previousResultIds[*uri] = previous["value"].get<std::string>();
+        }
+
+        for (const auto &document : m_documents)
+            GetDiagnosticsReport(document.first);
+
+        auto &message = m_messageBuffer;
+        message.clear();
+        message.append(R"({"id":)").append(data["id"].dump()).append(R"(,"jsonrpc":"2.0","result":{"items":[)");
+        for (const auto &report : m_reports)
+        {
+            const auto uri = report.first;
+            if (message.back() == '}')
+                message.push_back(',');
+            AppendDiagnosticsReport(uri, previousResultIds[uri]);
+            message.append(R"(,"uri":)");
+            utils::AppendJsonString(message, m_strings.Get(uri));
+            message.append(R"(,"version":)");
+            const auto version = GetDocumentVersion(uri);
+            message.append(version ? std::to_string(*version) : "null");
+            message.push_back('}');
+        }
+        message.append("]}}");
+        m_jrpc.WriteSerialized(message);
+    }
+    catch (std::exception &err)
+    {
+        auto msg = std::string("Failed to get workspace diagnostics: ") + err.what();
+        logging::Get<logger>().error(msg);
+        m_outQueue.push(
+            {{"id", data["id"]},
+             {"error", {{"code", static_cast<int>(JsonRPC::ErrorCode::InternalError)}, {"message", msg}}}});
+    }
 }
 
 void LSPServer::OnConfiguration(const json &data)
 {
-    spdlog::get(logger)->debug("Received 'configuration' respond");
+    logging::Get<logger>().debug("Received 'configuration' respond");
     auto result = data["result"];
     if (result.empty())
     {
-        spdlog::get(logger)->warn("Empty result");
+        logging::Get<logger>().warn("Empty result");
         return;
     }
 
     if (result.size() != 3)
     {
-        spdlog::get(logger)->warn("Unexpected result items count");
+        logging::Get<logger>().warn("Unexpected result items count");
         return;
     }
 
     try
     {
-        auto buildOptions = result[0];
-        m_diagnostics->SetBuildOptions(buildOptions);
+        ApplyConfiguration({ParseBuildOptions(result[0]), result[1].get<int64_t>(), result[2].get<int64_t>()});
+    }
+    catch (std::exception &err)
+    {
+        logging::Get<logger>().error("Failed to update settings, {}", err.what());
+    }
+}
 
-        auto maxProblemsCount = result[1].get<int64_t>();
-        m_diagnostics->SetMaxProblemsCount(static_cast<int>(maxProblemsCount));
+// Malformed options would fail every build, they are reported to the user and the current ones are kept
+BuildOptions LSPServer::ParseBuildOptions(const json &options)
+{
+    try
+    {
+        return BuildOptions::Parse(options);
+    }
+    catch (std::invalid_argument &err)
+    {
+        auto msg = std::string("Invalid build options, ") + err.what();
+        logging::Get<logger>().error(msg);
+        // MessageType.Error
+        m_outQueue.push({{"method", "window/showMessage"}, {"params", {{"type", 1}, {"message", msg}}}});
+        return m_configuration.buildOptions;
+    }
+}
 
-        auto deviceID = result[2].get<int64_t>();
-        m_diagnostics->SetOpenCLDevice(static_cast<uint32_t>(deviceID));
+// Clients send the whole configuration on every change, only the settings that differ are applied.
+// Selecting a device and building are expensive, so the results are kept unless they depend on the change.
+void LSPServer::ApplyConfiguration(Configuration configuration)
+{
+    bool rebuild = false;
+    if (configuration.deviceID != m_configuration.deviceID)
+    {
+        m_diagnostics->SetOpenCLDevice(static_cast<uint32_t>(configuration.deviceID));
+        rebuild = true;
     }
-    catch (std::exception &err)
+    if (configuration.buildOptions != m_configuration.buildOptions)
     {
-        spdlog::get(logger)->error("Failed to update settings, {}", err.what());
+        m_diagnostics->SetBuildOptions(configuration.buildOptions);
+        rebuild = true;
     }
+    const auto previousMaxNumberOfProblems = m_configuration.maxNumberOfProblems;
+    if (configuration.maxNumberOfProblems != previousMaxNumberOfProblems)
+        m_diagnostics->SetMaxProblemsCount(static_cast<int>(configuration.maxNumberOfProblems));
+    m_configuration = std::move(configuration);
+
+    if (rebuild)
+    {
+        // the builds of the closed documents are dropped with them
+        logging::Get<logger>().debug("Build settings have changed, rebuilding {} documents", m_includedFiles.size());
+        for (const auto &build : m_includedFiles)
+            ScheduleRebuild(build.first);
+        if (!m_includedFiles.empty())
+            RefreshDiagnostics();
+    }
+    else if (m_configuration.maxNumberOfProblems != previousMaxNumberOfProblems)
+    {
+        TruncateReports(previousMaxNumberOfProblems);
+    }
+    else
+    {
+        logging::Get<logger>().debug("Configuration did not change");
+    }
+}
+
+// In push mode the document is rebuilt after the edited ones and only changed results are published,
+// in pull mode the results of the build are dropped and it is rebuilt on the next request.
+void LSPServer::ScheduleRebuild(UriHandle uri)
+{
+    if (!m_capabilities.supportDiagnosticPull)
+    {
+        if (m_documents.find(uri) != m_documents.end())
+            ScheduleBuild(uri, BuildPriority::Background);
+        return;
+    }
+    m_reports.erase(uri);
+    for (const auto &includedUri : m_includedFiles[uri])
+        m_reports.erase(includedUri);
+}
+
+// Problems of a build are limited in total, its document comes first and then the included files.
+// A lower limit truncates the cached results, a build that reached the previous limit is rebuilt for a higher one.
+void LSPServer::TruncateReports(int64_t previousMaxNumberOfProblems)
+{
+    const auto maxNumberOfProblems = static_cast<size_t>(std::max<int64_t>(m_configuration.maxNumberOfProblems, 0));
+    std::vector<UriHandle> truncatedBuilds;
+    bool refresh = false;
+    for (const auto &[uri, includedFiles] : m_includedFiles)
+    {
+        std::vector<UriHandle> files {uri};
+        files.insert(files.end(), includedFiles.begin(), includedFiles.end());
+        size_t count = 0;
+        bool truncated = false;
+        for (const auto fileUri : files)
+        {
+            auto report = m_reports.find(fileUri);
+            if (report == m_reports.end())
+                continue;
+            count += report->second.items.size();
+            if (count <= maxNumberOfProblems)
+                continue;
+            auto items = report->second.items;
+            items.truncate(items.size() - std::min(count - maxNumberOfProblems, items.size()));
+            count = maxNumberOfProblems;
+            if (!SetDiagnosticsReport(fileUri, std::move(items)))
+                continue;
+            truncated = true;
+            refresh = true;
+            if (!m_capabilities.supportDiagnosticPull)
+                PublishDiagnostics(fileUri, report->second.items, m_jrpc.GetReceiveTime());
+        }
+        // the result id of the document covers the truncated reports of the included files
+        auto report = m_reports.find(uri);
+        if (truncated && report != m_reports.end())
+            report->second.resultId = GetResultId(uri, report->second.hash);
+        if (count >= static_cast<size_t>(std::max<int64_t>(previousMaxNumberOfProblems, 0)) &&
+            count < maxNumberOfProblems)
+            truncatedBuilds.push_back(uri);
+    }
+    for (const auto uri : truncatedBuilds)
+        ScheduleRebuild(uri);
+    // the pulled reports the client has are no longer valid
+    if (refresh || !truncatedBuilds.empty())
+        RefreshDiagnostics();
 }
 
 void LSPServer::OnRespond(const json &data)
 {
-    spdlog::get(logger)->debug("Received client respond");
-    const auto id = data["id"];
-    if (!m_requests.empty())
+    logging::Get<logger>().debug("Received client respond");
+    // the client may answer the requests in any order
+    const auto id = data.find("id");
+    const auto request =
+        id != data.end() && id->is_string() ? m_requests.find(id->get_ref<const std::string &>()) : m_requests.end();
+    if (request == m_requests.end())
     {
-        auto request = m_requests.front();
-        if (id == request.second && request.first == "workspace/configuration")
-            OnConfiguration(data);
-        m_requests.pop();
+        logging::Get<logger>().debug("The respond does not match a pending request");
+        return;
     }
+    const auto method = std::move(request->second);
+    m_requests.erase(request);
+    if (method == "workspace/configuration")
+        OnConfiguration(data);
+    else if (method == "workspace/diagnostic/refresh")
+        m_refreshPending = false;
+}
+
+void LSPServer::OnStats(const json &data)
+{
+    logging::Get<logger>().debug("Received '$/ocls/stats' request");
+    if (data.contains("id"))
+        m_outQueue.push({{"id", data["id"]}, {"result", metrics::GetSnapshot()}});
 }
 
 void LSPServer::OnShutdown(const json &data)
 {
-    spdlog::get(logger)->debug("Received 'shutdown' request");
+    logging::Get<logger>().debug("Received 'shutdown' request");
     m_outQueue.push({{"id", data["id"]}, {"result", nullptr}});
     m_shutdown = true;
 }
 
-void LSPServer::OnExit()
+void LSPServer::OnExit(const json &)
 {
-    spdlog::get(logger)->debug("Received 'exit', after 'shutdown': {}", m_shutdown ? "yes" : "no");
-    if (m_shutdown)
-        exit(EXIT_SUCCESS);
-    else
-        exit(EXIT_FAILURE);
+    logging::Get<logger>().debug("Received 'exit', after 'shutdown': {}", m_shutdown ? "yes" : "no");
+    m_exitCode = m_shutdown ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (const auto cancelled = m_builds.CancelAll())
+        logging::Get<logger>().debug("Cancelled {} scheduled builds", cancelled);
 }
 
-int LSPServer::Run()
+void LSPServer::OnConfigurationChanged(const json &)
 {
-    spdlog::get(logger)->info("Setting up...");
-    auto self = this->shared_from_this();
-    // clang-format off
+    GetConfiguration();
+}
+
+void LSPServer::RegisterCallbacks()
+{
+    logging::Get<logger>().info("Setting up...");
+    // the callbacks are owned by the server, so they must not keep it alive
+    auto self = this;
     // Register handlers for methods
-    m_jrpc.RegisterMethodCallback("initialize", [self](const json &request)
-    {
-        self->OnInitialize(request);
-    });
-    m_jrpc.RegisterMethodCallback("initialized", [self](const json &request)
-    {
-        self->OnInitialized(request);
-    });
-    m_jrpc.RegisterMethodCallback("shutdown", [self](const json &request)
-    {
-        self->OnShutdown(request);
-    });
-    m_jrpc.RegisterMethodCallback("exit", [self](const json &)
-    {
-        self->OnExit();
-    });
-    m_jrpc.RegisterMethodCallback("textDocument/didOpen", [self](const json &request)
-    {
-        self->OnTextOpen(request);
-    });
-    m_jrpc.RegisterMethodCallback("textDocument/didChange", [self](const json &request)
-    {
-        self->OnTextChanged(request);
-    });
-    m_jrpc.RegisterMethodCallback("workspace/didChangeConfiguration", [self](const json &)
-    {
-        self->GetConfiguration();
-    });
+    using methods::Method;
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnInitialize>(Method::Initialize, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnInitialized>(Method::Initialized, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnShutdown>(Method::Shutdown, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnExit>(Method::Exit, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnTextOpen>(Method::DidOpen, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnTextChanged>(Method::DidChange, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnTextClose>(Method::DidClose, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnDocumentDiagnostic>(Method::DocumentDiagnostic, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnWorkspaceDiagnostic>(Method::WorkspaceDiagnostic, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnConfigurationChanged>(Method::DidChangeConfiguration, this);
+    m_jrpc.RegisterMethodHandler<&LSPServer::OnStats>(Method::Stats, this);
+    // clang-format off
     // Register handler for client responds
     m_jrpc.RegisterInputCallback([self](const json &respond)
     {
         self->OnRespond(respond);
     });
     // Register handler for message delivery
-    m_jrpc.RegisterOutputCallback([](const std::string &message)
+    m_jrpc.RegisterOutputCallback([self](const std::string &message)
     {
-        #if defined(WIN32)
-            printf_s("%s", message.c_str());
-            fflush(stdout);
-        #else
-            std::cout << message << std::flush;
-        #endif    
+        self->m_output(message);
     });
-    // clang-format off
-    
-    spdlog::get(logger)->info("Listening...");
-    char c;
-    while (std::cin.get(c))
+    // clang-format on
+}
+
+int LSPServer::Run()
+{
+    logging::Get<logger>().info("Listening...");
+    // the reader may be blocked on the input when the server exits, it is left to end with the process
+    auto queue = std::make_shared<InputQueue>();
+    std::thread([queue, input = m_input] {
+        std::vector<char> buffer(64 * 1024);
+        while (const auto size = input(buffer.data(), buffer.size()))
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->bytes.append(buffer.data(), size);
+            queue->ready.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->closed = true;
+        queue->ready.notify_one();
+    }).detach();
+
+    // the received bytes are handled before each build, so a build never waits for more than the one running
+    std::string bytes;
+    while (true)
     {
-        if(m_interrupted.load()) {
+        bool closed;
+        {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            if (m_builds.empty())
+                queue->ready.wait(lock, [&queue] { return !queue->bytes.empty() || queue->closed; });
+            bytes.swap(queue->bytes);
+            closed = queue->closed;
+        }
+        if (m_interrupted.load())
+        {
             return EINTR;
         }
-        m_jrpc.Consume(c);
-        if (m_jrpc.IsReady())
+        if (!bytes.empty())
+        {
+            if (const auto exitCode = Consume(bytes.data(), bytes.size()))
+            {
+                return *exitCode;
+            }
+            bytes.clear();
+        }
+        else if (!RunScheduledBuild() && closed)
+        {
+            return 0;
+        }
+    }
+}
+
+std::optional<int> LSPServer::Consume(const char *data, size_t size)
+{
+    size_t offset = 0;
+    while (offset < size && !m_exitCode)
+    {
+        try
         {
+            offset += m_jrpc.Consume(data + offset, size - offset);
+        }
+        catch (std::exception &err)
+        {
+            // a malformed message must not take down the server or the other clients of the daemon
+            logging::Get<logger>().error("Failed to consume the message: {}", err.what());
+            m_jrpc.WriteError(JsonRPC::ErrorCode::InternalError, "Failed to consume the message");
             m_jrpc.Reset();
+            continue;
+        }
+        if (m_jrpc.IsReady())
+        {
+            metrics::SetGauge(metrics::Gauge::OutgoingQueue, static_cast<int64_t>(m_outQueue.size()));
+            metrics::SetGauge(metrics::Gauge::PendingServerRequests, static_cast<int64_t>(m_requests.size()));
             while (!m_outQueue.empty())
             {
-                auto data = m_outQueue.front();
-                m_jrpc.Write(data);
+                m_jrpc.Write(std::move(m_outQueue.front()));
                 m_outQueue.pop();
             }
+            m_jrpc.Reset();
         }
     }
-    return 0;
+    return m_exitCode;
+}
+
+bool LSPServer::RunScheduledBuild()
+{
+    const auto build = m_builds.Pop();
+    if (!build)
+        return false;
+    auto document = m_documents.find(build->key);
+    if (document != m_documents.end())
+        BuildDiagnosticsRespond(build->key, document->second.text, build->requestTime);
+    return !m_builds.empty();
+}
+
+bool LSPServer::HasScheduledBuild() const
+{
+    return !m_builds.empty();
 }
 
 void LSPServer::Interrupt() 
@@ -320,9 +1121,42 @@ void LSPServer::Interrupt()
     m_interrupted.store(true);
 }
 
+size_t ReadStandardInput(char *data, size_t size)
+{
+    // whatever the pipe holds is returned at once, std::cin would deliver it byte by byte
+#if defined(WIN32)
+    const auto count = _read(_fileno(stdin), data, static_cast<unsigned>(std::min<size_t>(size, INT_MAX)));
+    return count > 0 ? static_cast<size_t>(count) : 0;
+#else
+    while (true)
+    {
+        const auto count = read(STDIN_FILENO, data, size);
+        if (count >= 0)
+            return static_cast<size_t>(count);
+        if (errno != EINTR)
+            return 0;
+    }
+#endif
+}
+
 std::shared_ptr<ILSPServer> CreateLSPServer()
 {
-    return std::shared_ptr<ILSPServer>(new LSPServer());
+    return CreateLSPServer(
+        ReadStandardInput,
+        [](const std::string &message) {
+#if defined(WIN32)
+            printf_s("%s", message.c_str());
+            fflush(stdout);
+#else
+            std::cout << message << std::flush;
+#endif
+        });
+}
+
+std::shared_ptr<ILSPServer> CreateLSPServer(
+    ILSPServer::InputFunc input, ILSPServer::OutputFunc output, std::shared_ptr<IBuildEnvironment> environment)
+{
+    return std::make_shared<LSPServer>(std::move(input), std::move(output), std::move(environment));
 }
 
 } // namespace ocls
@@ -8,20 +8,30 @@
 #include <iostream>
 
 #include "clinfo.hpp"
+#include "daemon.hpp"
+#include "jsonrpc.hpp"
+#include "logging.hpp"
 #include "lsp.hpp"
+#include "metrics.hpp"
+#include "session.hpp"
+#include "tracing.hpp"
 #include "version.hpp"
 
 #include <CLI/CLI.hpp>
 #include <csignal>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
-#include <spdlog/sinks/basic_file_sink.h>
-#include <spdlog/sinks/null_sink.h>
 
 #if defined(WIN32)
     #include <fcntl.h>
     #include <io.h>
     #include <stdio.h>
+#else
+    #include <pthread.h>
+    #include <thread>
+#endif
+#if defined(__linux__)
+    #include <malloc.h>
 #endif
 
 using namespace ocls;
@@ -29,6 +39,7 @@ using namespace ocls;
 namespace {
 
 std::shared_ptr<ILSPServer> server;
+std::shared_ptr<IDaemon> daemonServer;
 
 static void SignalHandler(int)
 {
@@ -37,38 +48,45 @@ static void SignalHandler(int)
     {
         server->Interrupt();
     }
+    if (daemonServer)
+    {
+        daemonServer->Stop();
+    }
 }
 
-void ConfigureLogging(bool fileLogging, std::string filename, spdlog::level::level_enum level)
+// Logs the server statistics on SIGUSR1. The signal is blocked and awaited by a dedicated thread,
+// so it must be called before any other thread is started, including the logging thread.
+void SetupStatsDump()
 {
-    try
+#if !defined(WIN32)
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0)
     {
-        spdlog::sink_ptr sink;
-        if (fileLogging)
-        {
-            sink = std::make_shared<spdlog::sinks::basic_file_sink_st>(filename);
-        }
-        else
-        {
-            sink = std::make_shared<spdlog::sinks::null_sink_st>();
-        }
-        spdlog::set_default_logger(std::make_shared<spdlog::logger>("opencl-ls", sink));
-        spdlog::set_level(level);
-        std::vector<std::shared_ptr<spdlog::logger>> subLoggers = {
-            std::make_shared<spdlog::logger>("clinfo", sink),
-            std::make_shared<spdlog::logger>("diagnostics", sink),
-            std::make_shared<spdlog::logger>("jrpc", sink),
-            std::make_shared<spdlog::logger>("lsp", sink)};
-        for (const auto& logger : subLoggers)
+        std::cerr << "Cannot block SIGUSR1, statistics dump is disabled" << std::endl;
+        return;
+    }
+    std::thread([signals] {
+        int signal = 0;
+        while (sigwait(&signals, &signal) == 0)
         {
-            logger->set_level(level);
-            spdlog::register_logger(logger);
+            // the default logger is gone once logging is shut down
+            if (const auto log = spdlog::default_logger())
+                log->info("Statistics: {}", metrics::GetSnapshot().dump());
         }
-    }
-    catch (const spdlog::spdlog_ex& ex)
-    {
-        std::cerr << "Log init failed: " << ex.what() << std::endl;
-    }
+    }).detach();
+#endif
+}
+
+// Document texts can take megabytes. glibc raises its mmap threshold every time such a block is freed,
+// so the following ones come from the heap and fragment it over a long session. With a fixed threshold
+// they stay in mappings of their own, returned to the system as soon as the text is replaced.
+void SetupAllocator()
+{
+#if defined(__GLIBC__)
+    mallopt(M_MMAP_THRESHOLD, 1024 * 1024);
+#endif
 }
 
 inline void SetupBinaryStreamMode()
@@ -90,8 +108,22 @@ int main(int argc, char* argv[])
 {
     bool flagLogTofile = false;
     bool flagCLInfo = false;
+    std::string optRecordFile;
+    std::string optReplayFile;
+    double optReplaySpeed = 1.0;
+    std::string optTraceFile;
+    std::string optListenSocket;
+    std::string optConnectSocket;
+    int optPort = -1;
+    std::string optTokenFile;
+    size_t optReceiveBufferSize = 0;
+    size_t optSendBufferSize = 0;
     std::string optLogFile = "opencl-language-server.log";
-    spdlog::level::level_enum optLogLevel = spdlog::level::trace;
+    spdlog::level::level_enum optLogLevel = spdlog::level::info;
+    size_t optLogMaxSize = 10;
+    size_t optLogMaxFiles = 3;
+    size_t optMaxMessageSize = 64;
+    size_t optSpoolThreshold = 8;
 
     CLI::App app {"OpenCL Language Server"};
     app.add_flag("-i,--clinfo", flagCLInfo, "Show information about available OpenCL devices");
@@ -107,6 +139,70 @@ int main(int argc, char* argv[])
              spdlog::level::critical}))
         ->required(false)
         ->capture_default_str();
+    app.add_option("--log-max-size", optLogMaxSize, "Size of the log file in megabytes before it is rotated")
+        ->check(CLI::PositiveNumber)
+        ->required(false)
+        ->capture_default_str();
+    app.add_option("--log-max-files", optLogMaxFiles, "Number of rotated log files to keep")
+        ->check(CLI::PositiveNumber)
+        ->required(false)
+        ->capture_default_str();
+    app.add_option("--max-message-size", optMaxMessageSize, "Size of the largest accepted message in megabytes")
+        ->check(CLI::PositiveNumber)
+        ->required(false)
+        ->capture_default_str();
+    app.add_option(
+           "--spool-threshold",
+           optSpoolThreshold,
+           "Size in megabytes from which messages are received into a memory mapping, 0 to disable")
+        ->required(false)
+        ->capture_default_str();
+    auto optRecord =
+        app.add_option("--record", optRecordFile, "Record the session with timestamps to the file")->required(false);
+    auto optReplay =
+        app.add_option("--replay", optReplayFile, "Replay the recorded session and report latency percentiles")
+            ->required(false)
+            ->excludes(optRecord);
+    app.add_option("--replay-speed", optReplaySpeed, "Replay speed multiplier, 0 to replay without delays")
+        ->check(CLI::NonNegativeNumber)
+        ->required(false)
+        ->capture_default_str();
+    app.add_option("--trace-file", optTraceFile, "Write spans in the Chrome trace event format to the file")
+        ->required(false);
+    auto optListen =
+        app.add_option("--listen", optListenSocket, "Serve multiple clients on the Unix domain socket (Linux only)")
+            ->required(false)
+            ->excludes(optRecord)
+            ->excludes(optReplay);
+    auto optToken =
+        app.add_option("--token-file", optTokenFile, "Write the token TCP clients have to send first to the file")
+            ->required(false);
+    auto optTcpPort =
+        app.add_option("--port", optPort, "Serve multiple clients on the loopback TCP port (Linux only)")
+            ->check(CLI::Range(0, 65535))
+            ->required(false)
+            ->excludes(optRecord)
+            ->excludes(optReplay)
+            ->excludes(optListen)
+            ->needs(optToken);
+    app.add_option("--connect", optConnectSocket, "Relay stdio to the server listening on the Unix domain socket")
+        ->required(false)
+        ->excludes(optRecord)
+        ->excludes(optReplay)
+        ->excludes(optListen)
+        ->excludes(optTcpPort);
+    app.add_option(
+           "--socket-receive-buffer",
+           optReceiveBufferSize,
+           "SO_RCVBUF of the client sockets in bytes, 0 for the system default")
+        ->required(false)
+        ->capture_default_str();
+    app.add_option(
+           "--socket-send-buffer",
+           optSendBufferSize,
+           "SO_SNDBUF of the client sockets in bytes, 0 for the system default")
+        ->required(false)
+        ->capture_default_str();
     app.add_flag_callback(
         "-v,--version",
         []() {
@@ -117,20 +213,130 @@ int main(int argc, char* argv[])
 
     CLI11_PARSE(app, argc, argv);
 
-    ConfigureLogging(flagLogTofile, optLogFile, optLogLevel);
+    SetupAllocator();
+    SetupStatsDump();
+    logging::Options logOptions;
+    logOptions.fileLogging = flagLogTofile;
+    logOptions.filename = optLogFile;
+    logOptions.level = optLogLevel;
+    logOptions.maxFileSize = optLogMaxSize * 1024 * 1024;
+    logOptions.maxFiles = optLogMaxFiles;
+    logging::Configure(logOptions);
+
+    JsonRPC::Limits limits;
+    limits.maxMessageSize = optMaxMessageSize * 1024 * 1024;
+    limits.buffer.spoolThreshold = optSpoolThreshold * 1024 * 1024;
+    JsonRPC::SetDefaultLimits(limits);
 
     if (flagCLInfo)
     {
         const auto clinfo = CreateCLInfo();
         const auto jsonBody = clinfo->json();
         std::cout << jsonBody.dump() << std::endl;
+        logging::Shutdown();
         exit(0);
     }
 
-    SetupBinaryStreamMode();
+    if (!optConnectSocket.empty())
+    {
+        const auto exitCode = RelayToDaemon(optConnectSocket);
+        logging::Shutdown();
+        return exitCode;
+    }
+
+    if (!optTraceFile.empty())
+    {
+        try
+        {
+            tracing::Start(optTraceFile);
+        }
+        catch (const std::exception& err)
+        {
+            std::cerr << err.what() << std::endl;
+            logging::Shutdown();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!optReplayFile.empty())
+    {
+        try
+        {
+            const auto report = ReplaySession(LoadSession(optReplayFile), optReplaySpeed);
+            tracing::Stop();
+            std::cout << report.dump() << std::endl;
+        }
+        catch (const std::exception& err)
+        {
+            tracing::Stop();
+            std::cerr << "Replay failed: " << err.what() << std::endl;
+            logging::Shutdown();
+            return EXIT_FAILURE;
+        }
+        logging::Shutdown();
+        exit(0);
+    }
 
     std::signal(SIGINT, SignalHandler);
 
-    server = CreateLSPServer();
-    return server->Run();
+    if (!optListenSocket.empty() || optPort >= 0)
+    {
+        DaemonOptions daemonOptions;
+        daemonOptions.receiveBufferSize = optReceiveBufferSize;
+        daemonOptions.sendBufferSize = optSendBufferSize;
+        daemonOptions.tokenFile = optTokenFile;
+        try
+        {
+            daemonServer = optPort >= 0 ? CreateDaemon(static_cast<uint16_t>(optPort), daemonOptions)
+                                        : CreateDaemon(optListenSocket, daemonOptions);
+        }
+        catch (const std::exception& err)
+        {
+            std::cerr << err.what() << std::endl;
+            tracing::Stop();
+            logging::Shutdown();
+            return EXIT_FAILURE;
+        }
+        std::signal(SIGTERM, SignalHandler);
+        const auto exitCode = daemonServer->Run();
+        daemonServer.reset();
+        tracing::Stop();
+        logging::Shutdown();
+        return exitCode;
+    }
+
+    SetupBinaryStreamMode();
+
+    if (!optRecordFile.empty())
+    {
+        std::shared_ptr<SessionRecorder> recorder;
+        try
+        {
+            recorder = std::make_shared<SessionRecorder>(optRecordFile);
+        }
+        catch (const std::exception& err)
+        {
+            std::cerr << err.what() << std::endl;
+            logging::Shutdown();
+            return EXIT_FAILURE;
+        }
+        server = CreateLSPServer(
+            [recorder](char* data, size_t size) {
+                size = ReadStandardInput(data, size);
+                recorder->RecordInput(data, size);
+                return size;
+            },
+            [recorder](const std::string& message) {
+                recorder->RecordOutput(message);
+                std::cout << message << std::flush;
+            });
+    }
+    else
+    {
+        server = CreateLSPServer();
+    }
+    const auto exitCode = server->Run();
+    tracing::Stop();
+    logging::Shutdown();
+    return exitCode;
 }
@@ -0,0 +1,124 @@
+//
+//  messagebuffer.cpp
+//  opencl-language-server
+//
+
+#include "messagebuffer.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if !defined(WIN32)
+    #include <sys/mman.h>
+#endif
+
+namespace ocls {
+
+namespace {
+constexpr char logger[] = "jrpc";
+} // namespace
+
+MessageBuffer::MessageBuffer(const Options& options) : m_options {options} {}
+
+MessageBuffer::~MessageBuffer()
+{
+    Unmap();
+}
+
+void MessageBuffer::Begin(size_t size)
+{
+    Clear();
+    m_expectedSize = size;
+    if (m_options.spoolThreshold > 0 && size >= m_options.spoolThreshold && Map(size))
+        return;
+    m_storage.reserve(size);
+}
+
+void MessageBuffer::Append(const char* data, size_t size)
+{
+    size = std::min(size, m_expectedSize - m_size);
+    if (m_mapping)
+        std::memcpy(m_mapping + m_size, data, size);
+    else
+        m_storage.append(data, size);
+    m_size += size;
+}
+
+std::string_view MessageBuffer::View() const
+{
+    if (m_mapping)
+        return {m_mapping, m_size};
+    return m_storage;
+}
+
+size_t MessageBuffer::Size() const
+{
+    return m_size;
+}
+
+size_t MessageBuffer::Capacity() const
+{
+    return m_mapping ? m_mappingSize : m_storage.capacity();
+}
+
+bool MessageBuffer::IsSpooled() const
+{
+    return m_mapping != nullptr;
+}
+
+void MessageBuffer::Clear()
+{
+    if (m_expectedSize > 0)
+        m_usualSize = m_usualSize - m_usualSize / 8 + m_expectedSize / 8;
+    m_size = 0;
+    m_expectedSize = 0;
+    Unmap();
+    m_storage.clear();
+    // one large message must not pin its memory for the rest of the session
+    if (m_storage.capacity() > std::max(m_options.retainedCapacity, 4 * m_usualSize))
+    {
+        logging::Get<logger>().debug(
+            "Releasing {} bytes of the message buffer, the usual message is {} bytes",
+            m_storage.capacity(),
+            m_usualSize);
+        std::string().swap(m_storage);
+    }
+}
+
+bool MessageBuffer::Map(size_t size)
+{
+#if !defined(WIN32)
+    #if defined(MAP_NORESERVE)
+    constexpr int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    #else
+    constexpr int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    #endif
+    // the pages are only committed as the body arrives
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        logging::Get<logger>().warn("Failed to map {} bytes for the message, it is buffered in memory", size);
+        return false;
+    }
+    m_mapping = static_cast<char*>(mapping);
+    m_mappingSize = size;
+    logging::Get<logger>().debug("Spooling the message of {} bytes into a mapping", size);
+    return true;
+#else
+    (void)size;
+    return false;
+#endif
+}
+
+void MessageBuffer::Unmap()
+{
+#if !defined(WIN32)
+    if (m_mapping)
+        munmap(m_mapping, m_mappingSize);
+#endif
+    m_mapping = nullptr;
+    m_mappingSize = 0;
+}
+
+} // namespace ocls
@@ -0,0 +1,346 @@
+//
+//  metrics.cpp
+//  opencl-language-server
+//
+
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+using namespace nlohmann;
+
+namespace ocls::metrics {
+
+namespace {
+
+constexpr auto countersCount = static_cast<size_t>(Counter::Count);
+constexpr auto gaugesCount = static_cast<size_t>(Gauge::Count);
+constexpr auto histogramsCount = static_cast<size_t>(Histogram::Count);
+
+constexpr std::array<const char*, countersCount> counterNames {
+    "publishedDiagnostics",
+    "suppressedDiagnostics",
+    "bytesReceived",
+    "bytesSent",
+    "rejectedMessages",
+    "buildsStarted",
+    "buildsCancelled",
+    "buildsCoalesced",
+    "cacheHits",
+    "cacheMisses",
+    "pausedInputs",
+    "rejectedClients",
+};
+
+constexpr std::array<const char*, gaugesCount> gaugeNames {
+    "outgoingQueue",
+    "pendingServerRequests",
+    "connections",
+};
+
+constexpr std::array<const char*, histogramsCount> histogramNames {
+    "receiveToPublish",
+    "build",
+    "queueActive",
+    "queueOpen",
+    "queueBackground",
+};
+
+// Histogram buckets are log-linear: values below 16 have their own buckets, larger values
+// are split into 16 linear sub-buckets per power of two.
+constexpr unsigned subBucketBits = 4;
+constexpr size_t subBuckets = size_t(1) << subBucketBits;
+constexpr size_t bucketsCount = (64 - subBucketBits + 1) * subBuckets;
+
+// Methods are assigned slots in the order they are first seen, the last slot counts the rest.
+constexpr size_t maxMethods = 64;
+constexpr char responseName[] = "(response)";
+constexpr char otherName[] = "(other)";
+
+using Value = std::atomic<uint64_t>;
+
+struct HistogramShard
+{
+    std::array<Value, bucketsCount> buckets {};
+    Value sum {};
+    Value max {};
+};
+
+struct Shard
+{
+    std::array<Value, countersCount> counters {};
+    std::array<std::array<Value, maxMethods + 1>, 2> messages {};
+    std::array<HistogramShard, histogramsCount> histograms {};
+};
+
+struct GaugeValue
+{
+    std::atomic<int64_t> value {};
+    std::atomic<int64_t> max {};
+};
+
+std::mutex shardsMutex;
+// shards are never released, so that counts of finished threads are kept
+std::vector<std::unique_ptr<Shard>> shards;
+
+std::array<GaugeValue, gaugesCount> gauges {};
+
+std::mutex methodsMutex;
+std::array<std::string, maxMethods> methodNames;
+std::atomic<size_t> methodsCount {0};
+
+Shard& GetShard()
+{
+    thread_local Shard* shard = [] {
+        auto newShard = std::make_unique<Shard>();
+        std::lock_guard<std::mutex> lock(shardsMutex);
+        shards.push_back(std::move(newShard));
+        return shards.back().get();
+    }();
+    return *shard;
+}
+
+// Only the owning thread writes to its shard, so a plain load and store is enough,
+// readers see either the old or the new value.
+void Add(Value& value, uint64_t delta)
+{
+    value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+template <typename Func>
+uint64_t Sum(Func&& get)
+{
+    std::lock_guard<std::mutex> lock(shardsMutex);
+    uint64_t sum = 0;
+    for (const auto& shard : shards)
+        sum += get(*shard).load(std::memory_order_relaxed);
+    return sum;
+}
+
+unsigned Log2(uint64_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<unsigned>(index);
+#else
+    return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+}
+
+size_t GetBucketIndex(uint64_t value)
+{
+    if (value < subBuckets)
+        return static_cast<size_t>(value);
+    const auto exponent = Log2(value);
+    const auto shift = exponent - subBucketBits;
+    return (exponent - subBucketBits + 1) * subBuckets + static_cast<size_t>((value >> shift) - subBuckets);
+}
+
+// The largest value that falls into the bucket
+uint64_t GetBucketUpperBound(size_t index)
+{
+    if (index < subBuckets)
+        return index;
+    const auto shift = index / subBuckets - 1;
+    const auto subBucket = index % subBuckets;
+    return ((subBuckets + subBucket + 1) << shift) - 1;
+}
+
+size_t GetMethodIndex(std::string_view method)
+{
+    if (method.empty())
+        method = responseName;
+    auto count = methodsCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (methodNames[i] == method)
+            return i;
+    }
+
+    std::lock_guard<std::mutex> lock(methodsMutex);
+    count = methodsCount.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (methodNames[i] == method)
+            return i;
+    }
+    if (count == maxMethods)
+        return maxMethods;
+    methodNames[count] = std::string(method);
+    methodsCount.store(count + 1, std::memory_order_release);
+    return count;
+}
+
+struct HistogramData
+{
+    std::array<uint64_t, bucketsCount> buckets {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    uint64_t GetPercentile(double percentile) const
+    {
+        if (count == 0)
+            return 0;
+        const auto rank = std::max<uint64_t>(
+            1, static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(count))));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketsCount; ++i)
+        {
+            seen += buckets[i];
+            if (seen >= rank)
+                return std::min(GetBucketUpperBound(i), max);
+        }
+        return max;
+    }
+};
+
+HistogramData Merge(Histogram histogram)
+{
+    HistogramData data;
+    std::lock_guard<std::mutex> lock(shardsMutex);
+    for (const auto& shard : shards)
+    {
+        const auto& source = shard->histograms[static_cast<size_t>(histogram)];
+        for (size_t i = 0; i < bucketsCount; ++i)
+        {
+            const auto value = source.buckets[i].load(std::memory_order_relaxed);
+            data.buckets[i] += value;
+            data.count += value;
+        }
+        data.sum += source.sum.load(std::memory_order_relaxed);
+        data.max = std::max(data.max, source.max.load(std::memory_order_relaxed));
+    }
+    return data;
+}
+
+} // namespace
+
+void Increment(Counter counter, uint64_t value)
+{
+    Add(GetShard().counters[static_cast<size_t>(counter)], value);
+}
+
+uint64_t Get(Counter counter)
+{
+    return Sum([counter](const Shard& shard) -> const Value& { return shard.counters[static_cast<size_t>(counter)]; });
+}
+
+const char* GetName(Counter counter)
+{
+    return counterNames[static_cast<size_t>(counter)];
+}
+
+void SetGauge(Gauge gauge, int64_t value)
+{
+    auto& target = gauges[static_cast<size_t>(gauge)];
+    target.value.store(value, std::memory_order_relaxed);
+    auto max = target.max.load(std::memory_order_relaxed);
+    while (value > max && !target.max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+    {}
+}
+
+void Record(Histogram histogram, std::chrono::microseconds value)
+{
+    const auto micros = static_cast<uint64_t>(std::max<int64_t>(value.count(), 0));
+    auto& target = GetShard().histograms[static_cast<size_t>(histogram)];
+    Add(target.buckets[GetBucketIndex(micros)], 1);
+    Add(target.sum, micros);
+    if (micros > target.max.load(std::memory_order_relaxed))
+        target.max.store(micros, std::memory_order_relaxed);
+}
+
+uint64_t GetPercentile(Histogram histogram, double percentile)
+{
+    return Merge(histogram).GetPercentile(percentile);
+}
+
+void CountMessage(Direction direction, std::string_view method)
+{
+    Add(GetShard().messages[static_cast<size_t>(direction)][GetMethodIndex(method)], 1);
+}
+
+uint64_t GetMessageCount(Direction direction, std::string_view method)
+{
+    const auto index = GetMethodIndex(method);
+    return Sum([direction, index](const Shard& shard) -> const Value& {
+        return shard.messages[static_cast<size_t>(direction)][index];
+    });
+}
+
+json GetSnapshot()
+{
+    json counters = json::object();
+    for (size_t i = 0; i < countersCount; ++i)
+        counters[counterNames[i]] = Get(static_cast<Counter>(i));
+
+    json gaugesObject = json::object();
+    for (size_t i = 0; i < gaugesCount; ++i)
+    {
+        gaugesObject[gaugeNames[i]] = {
+            {"value", gauges[i].value.load(std::memory_order_relaxed)},
+            {"max", gauges[i].max.load(std::memory_order_relaxed)},
+        };
+    }
+
+    json messages = {{"received", json::object()}, {"sent", json::object()}};
+    const auto count = methodsCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i <= maxMethods; ++i)
+    {
+        if (i >= count && i != maxMethods)
+            continue;
+        const auto direction = [i](Direction direction) {
+            return Sum([direction, i](const Shard& shard) -> const Value& {
+                return shard.messages[static_cast<size_t>(direction)][i];
+            });
+        };
+        const char* name = i == maxMethods ? otherName : methodNames[i].c_str();
+        if (const auto received = direction(Direction::Received))
+            messages["received"][name] = received;
+        if (const auto sent = direction(Direction::Sent))
+            messages["sent"][name] = sent;
+    }
+
+    json histograms = json::object();
+    for (size_t i = 0; i < histogramsCount; ++i)
+    {
+        const auto data = Merge(static_cast<Histogram>(i));
+        json buckets = json::array();
+        for (size_t b = 0; b < bucketsCount; ++b)
+        {
+            if (data.buckets[b] > 0)
+                buckets.push_back({GetBucketUpperBound(b), data.buckets[b]});
+        }
+        histograms[histogramNames[i]] = {
+            {"count", data.count},
+            {"mean", data.count > 0 ? static_cast<double>(data.sum) / static_cast<double>(data.count) : 0.0},
+            {"max", data.max},
+            {"p50", data.GetPercentile(50)},
+            {"p90", data.GetPercentile(90)},
+            {"p99", data.GetPercentile(99)},
+            {"p999", data.GetPercentile(99.9)},
+            {"buckets", std::move(buckets)},
+        };
+    }
+
+    return {
+        {"counters", std::move(counters)},
+        {"messages", std::move(messages)},
+        {"gauges", std::move(gaugesObject)},
+        {"histograms", std::move(histograms)},
+    };
+}
+
+} // namespace ocls::metrics
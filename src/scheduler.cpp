@@ -0,0 +1,161 @@
+//
+//  scheduler.cpp
+//  opencl-language-server
+//
+
+#include "scheduler.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+
+namespace ocls {
+
+namespace {
+
+constexpr metrics::Histogram queueHistograms[] = {
+    metrics::Histogram::QueueActive,
+    metrics::Histogram::QueueOpen,
+    metrics::Histogram::QueueBackground,
+};
+static_assert(std::size(queueHistograms) == static_cast<size_t>(BuildPriority::Count));
+
+} // namespace
+
+BuildScheduler::BuildScheduler(const Options& options) : m_options {options} {}
+
+bool BuildScheduler::Enqueue(Key key, BuildPriority priority, Clock::time_point requestTime)
+{
+    auto queued = m_queued.find(key);
+    if (queued == m_queued.end())
+    {
+        GetQueue(priority).push_back({key, requestTime});
+        m_queued.emplace(key, Queued {priority, requestTime});
+        return true;
+    }
+
+    // the build has not started, so it will see the latest document anyway
+    metrics::Increment(metrics::Counter::BuildsCoalesced);
+    queued->second.requestTime = std::max(queued->second.requestTime, requestTime);
+    if (priority < queued->second.priority)
+    {
+        Insert(*Remove(key, queued->second.priority), priority);
+        queued->second.priority = priority;
+    }
+    return false;
+}
+
+void BuildScheduler::Demote(Key key, BuildPriority priority)
+{
+    auto queued = m_queued.find(key);
+    if (queued == m_queued.end() || queued->second.priority >= priority)
+        return;
+    Insert(*Remove(key, queued->second.priority), priority);
+    queued->second.priority = priority;
+}
+
+bool BuildScheduler::Cancel(Key key)
+{
+    auto queued = m_queued.find(key);
+    if (queued == m_queued.end())
+        return false;
+    Remove(key, queued->second.priority);
+    m_queued.erase(queued);
+    metrics::Increment(metrics::Counter::BuildsCancelled);
+    return true;
+}
+
+size_t BuildScheduler::CancelAll()
+{
+    const auto count = m_queued.size();
+    for (auto& queue : m_queues)
+        queue.clear();
+    m_queued.clear();
+    if (count > 0)
+        metrics::Increment(metrics::Counter::BuildsCancelled, count);
+    return count;
+}
+
+std::optional<BuildScheduler::Build> BuildScheduler::Pop(Clock::time_point now)
+{
+    // the oldest build of every queue competes, each aging interval it waited raises its rank by one
+    Queue* next = nullptr;
+    int64_t nextRank = 0;
+    size_t nextIndex = 0;
+    for (size_t i = 0; i < m_queues.size(); ++i)
+    {
+        auto& queue = m_queues[i];
+        if (queue.empty())
+            continue;
+        const auto waited = std::max(now - queue.front().enqueueTime, Clock::duration::zero());
+        const auto steps = m_options.agingInterval.count() > 0 ? waited / m_options.agingInterval : 0;
+        const auto rank = static_cast<int64_t>(i) - static_cast<int64_t>(steps);
+        if (!next || rank < nextRank)
+        {
+            next = &queue;
+            nextRank = rank;
+            nextIndex = i;
+        }
+    }
+    if (!next)
+        return std::nullopt;
+
+    const auto entry = next->front();
+    next->pop_front();
+    auto queued = m_queued.find(entry.key);
+    const Build build {entry.key, queued->second.requestTime};
+    m_queued.erase(queued);
+    metrics::Record(
+        queueHistograms[nextIndex],
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::max(now - entry.enqueueTime, Clock::duration::zero())));
+    return build;
+}
+
+std::optional<BuildPriority> BuildScheduler::GetPriority(Key key) const
+{
+    const auto queued = m_queued.find(key);
+    if (queued == m_queued.end())
+        return std::nullopt;
+    return queued->second.priority;
+}
+
+size_t BuildScheduler::size() const
+{
+    return m_queued.size();
+}
+
+bool BuildScheduler::empty() const
+{
+    return m_queued.empty();
+}
+
+BuildScheduler::Queue& BuildScheduler::GetQueue(BuildPriority priority)
+{
+    return m_queues[static_cast<size_t>(priority)];
+}
+
+void BuildScheduler::Insert(const Entry& entry, BuildPriority priority)
+{
+    // the entry keeps its place in time, so the time it already waited counts towards its aging
+    auto& queue = GetQueue(priority);
+    const auto position =
+        std::upper_bound(queue.begin(), queue.end(), entry.enqueueTime, [](Clock::time_point time, const Entry& other) {
+            return time < other.enqueueTime;
+        });
+    queue.insert(position, entry);
+}
+
+std::optional<BuildScheduler::Entry> BuildScheduler::Remove(Key key, BuildPriority priority)
+{
+    // the queues are as long as the number of open documents
+    auto& queue = GetQueue(priority);
+    const auto entry =
+        std::find_if(queue.begin(), queue.end(), [key](const Entry& other) { return other.key == key; });
+    if (entry == queue.end())
+        return std::nullopt;
+    auto removed = *entry;
+    queue.erase(entry);
+    return removed;
+}
+
+} // namespace ocls
@@ -0,0 +1,458 @@
+//
+//  session.cpp
+//  opencl-language-server
+//
+
+#include "session.hpp"
+#include "jsonrpc.hpp"
+#include "logging.hpp"
+#include "lsp.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <queue>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+using namespace nlohmann;
+
+namespace ocls {
+
+namespace {
+
+constexpr char logger[] = "lsp";
+constexpr std::string_view headerDelimiter = "\r\n\r\n";
+
+using Clock = std::chrono::steady_clock;
+
+int64_t ToMicroseconds(Clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+constexpr char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Returns the value of the header field, the name is in lower case and ends with the colon
+std::string_view GetHeader(std::string_view headers, std::string_view name)
+{
+    while (!headers.empty())
+    {
+        const auto end = std::min(headers.find("\r\n"), headers.size());
+        auto line = headers.substr(0, end);
+        headers.remove_prefix(std::min(end + 2, headers.size()));
+        if (line.size() < name.size() ||
+            !std::equal(name.begin(), name.end(), line.begin(), [](char a, char b) {
+                return a == std::tolower(static_cast<unsigned char>(b));
+            }))
+            continue;
+        line.remove_prefix(name.size());
+        const auto start = line.find_first_not_of(" \t");
+        return start == std::string_view::npos ? std::string_view() : line.substr(start);
+    }
+    return {};
+}
+
+size_t ParseContentLength(std::string_view headers)
+{
+    size_t length = 0;
+    for (auto c : GetHeader(headers, "content-length:"))
+    {
+        if (c >= '0' && c <= '9')
+            length = length * 10 + static_cast<size_t>(c - '0');
+    }
+    return length;
+}
+
+std::string_view GetHeaders(std::string_view message)
+{
+    const auto pos = message.find(headerDelimiter);
+    return pos == std::string_view::npos ? std::string_view() : message.substr(0, pos + 2);
+}
+
+std::string_view GetBody(std::string_view message)
+{
+    const auto pos = message.find(headerDelimiter);
+    return pos == std::string_view::npos ? message : message.substr(pos + headerDelimiter.size());
+}
+
+std::string EncodeBase64(std::string_view data)
+{
+    std::string result;
+    result.reserve((data.size() + 2) / 3 * 4);
+    for (size_t i = 0; i < data.size(); i += 3)
+    {
+        const auto count = std::min<size_t>(3, data.size() - i);
+        uint32_t value = 0;
+        for (size_t j = 0; j < 3; ++j)
+            value = value << 8 | (j < count ? static_cast<unsigned char>(data[i + j]) : 0u);
+        for (size_t j = 0; j < 4; ++j)
+            result.push_back(j <= count ? base64Alphabet[(value >> (18 - 6 * j)) & 0x3f] : '=');
+    }
+    return result;
+}
+
+// Throws std::invalid_argument if the text is not base64
+std::string DecodeBase64(std::string_view text)
+{
+    if (text.size() % 4 != 0)
+        throw std::invalid_argument("invalid base64 length");
+    std::string result;
+    result.reserve(text.size() / 4 * 3);
+    for (size_t i = 0; i < text.size(); i += 4)
+    {
+        uint32_t value = 0;
+        size_t padding = 0;
+        for (size_t j = 0; j < 4; ++j)
+        {
+            const auto c = text[i + j];
+            const auto* digit = c == '\0' ? nullptr : std::strchr(base64Alphabet, c);
+            // the padding is only allowed at the end
+            if (c == '=' && i + 4 == text.size() && j >= 2)
+                ++padding;
+            else if (!digit || padding > 0)
+                throw std::invalid_argument("invalid base64 character");
+            value = value << 6 | (digit ? static_cast<uint32_t>(digit - base64Alphabet) : 0u);
+        }
+        for (size_t j = 0; j < 3 - padding; ++j)
+            result.push_back(static_cast<char>((value >> (16 - 8 * j)) & 0xff));
+    }
+    return result;
+}
+
+// Returns a discarded value if the body is invalid
+json Decode(std::string_view body, JsonRPC::Encoding encoding)
+{
+    switch (encoding)
+    {
+        case JsonRPC::Encoding::Cbor:
+            return json::from_cbor(body.begin(), body.end(), true, false);
+        case JsonRPC::Encoding::MessagePack:
+            return json::from_msgpack(body.begin(), body.end(), true, false);
+        default:
+            return json::parse(body, nullptr, false);
+    }
+}
+
+std::string Encode(const json& body, JsonRPC::Encoding encoding)
+{
+    std::vector<uint8_t> bytes;
+    switch (encoding)
+    {
+        case JsonRPC::Encoding::Cbor:
+            json::to_cbor(body, bytes);
+            break;
+        case JsonRPC::Encoding::MessagePack:
+            json::to_msgpack(body, bytes);
+            break;
+        default:
+            return body.dump();
+    }
+    return std::string(bytes.begin(), bytes.end());
+}
+
+struct ServerRequest
+{
+    json id;
+    std::string method;
+};
+
+// Returns the id and method of a request the server sent to the client, only the top level 'id' and 'method'
+// of JSON are kept, so the parameters of large notifications are not stored
+std::optional<ServerRequest> GetServerRequest(std::string_view message)
+{
+    const auto encoding = JsonRPC::ParseContentType(GetHeader(GetHeaders(message), "content-type:"));
+    const auto body = encoding != JsonRPC::Encoding::Json
+                          ? Decode(GetBody(message), encoding)
+                          : json::parse(
+                                GetBody(message),
+                                [](int depth, json::parse_event_t event, json& parsed) {
+                                    return event != json::parse_event_t::key || depth != 1 || parsed == "id" ||
+                                           parsed == "method";
+                                },
+                                false);
+    if (!body.is_object() || !body.contains("id") || !body.contains("method") || !body["method"].is_string())
+        return std::nullopt;
+    return ServerRequest {body["id"], body["method"].get<std::string>()};
+}
+
+std::string Frame(std::string_view body, std::string_view contentType)
+{
+    std::string message = "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    if (!contentType.empty())
+        message.append("Content-Type: ").append(contentType).append("\r\n");
+    return message.append("\r\n").append(body);
+}
+
+json GetLatencyStats(std::vector<int64_t> latencies)
+{
+    if (latencies.empty())
+        return {{"count", 0}};
+
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&latencies](double p) {
+        const auto rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(latencies.size())));
+        return latencies[rank > 0 ? rank - 1 : 0];
+    };
+    return {
+        {"count", latencies.size()},
+        {"p50", percentile(50)},
+        {"p95", percentile(95)},
+        {"p99", percentile(99)},
+        {"max", latencies.back()},
+    };
+}
+
+} // namespace
+
+SessionRecorder::SessionRecorder(const std::string& path) : m_file(path, std::ios::out | std::ios::trunc)
+{
+    if (!m_file)
+    {
+        throw std::runtime_error("Failed to open the session file '" + path + "'");
+    }
+    m_start = Clock::now();
+}
+
+void SessionRecorder::RecordInput(const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        if (m_bodyOffset == 0)
+        {
+            m_input.push_back(*data++);
+            --size;
+            if (m_input.size() < headerDelimiter.size() ||
+                std::string_view(m_input).substr(m_input.size() - headerDelimiter.size()) != headerDelimiter)
+                continue;
+            m_bodyOffset = m_input.size();
+            m_contentLength = ParseContentLength(m_input);
+        }
+        // the body is appended at once
+        const auto count = std::min(size, m_contentLength - (m_input.size() - m_bodyOffset));
+        m_input.append(data, count);
+        data += count;
+        size -= count;
+        if (m_input.size() - m_bodyOffset < m_contentLength)
+            return;
+
+        const std::string_view input(m_input);
+        Write(true, input.substr(0, m_bodyOffset), input.substr(m_bodyOffset));
+        m_input.clear();
+        m_bodyOffset = 0;
+        m_contentLength = 0;
+    }
+}
+
+void SessionRecorder::RecordOutput(const std::string& message)
+{
+    Write(false, GetHeaders(message), GetBody(message));
+}
+
+void SessionRecorder::Write(bool inbound, std::string_view headers, std::string_view body)
+{
+    json frame = {
+        {"time", ToMicroseconds(Clock::now() - m_start)},
+        {"direction", inbound ? "in" : "out"},
+    };
+    const auto contentType = GetHeader(headers, "content-type:");
+    if (JsonRPC::ParseContentType(contentType) == JsonRPC::Encoding::Json)
+    {
+        frame["message"] = body;
+    }
+    else
+    {
+        // the binary bodies are not valid UTF-8, they would be corrupted as JSON strings
+        frame["message"] = EncodeBase64(body);
+        frame["contentType"] = contentType;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_file << frame.dump(-1, ' ', false, json::error_handler_t::replace) << '\n';
+    m_file.flush();
+}
+
+std::vector<SessionFrame> LoadSession(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error("Failed to open the session file '" + path + "'");
+    }
+
+    std::vector<SessionFrame> frames;
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+        if (line.empty())
+            continue;
+        try
+        {
+            const auto frame = json::parse(line);
+            auto contentType = frame.value("contentType", std::string());
+            auto message = frame.at("message").get<std::string>();
+            frames.push_back(
+                {frame.at("time").get<int64_t>(),
+                 frame.at("direction").get<std::string>() == "in",
+                 contentType.empty() ? std::move(message) : DecodeBase64(message),
+                 std::move(contentType)});
+        }
+        catch (const std::exception& err)
+        {
+            throw std::runtime_error(
+                "Invalid session frame at line " + std::to_string(lineNumber) + ": " + err.what());
+        }
+    }
+    return frames;
+}
+
+json ReplaySession(
+    const std::vector<SessionFrame>& frames, double speed, std::function<void(const std::string&)> observer)
+{
+    struct Request
+    {
+        int64_t time;
+        std::string method;
+        std::string frame;
+        bool isResponse;
+        // of the recorded server request a response answers, empty if it was not recorded
+        std::string answeredMethod;
+        JsonRPC::Encoding encoding;
+        std::string contentType;
+    };
+
+    std::vector<Request> requests;
+    size_t requestBytes = 0;
+    // recorded id of a server request -> its method
+    std::unordered_map<std::string, std::string> recordedRequests;
+    for (const auto& frame : frames)
+    {
+        if (!frame.inbound)
+        {
+            if (auto serverRequest = GetServerRequest(Frame(frame.message, frame.contentType)))
+                recordedRequests[serverRequest->id.dump()] = std::move(serverRequest->method);
+            continue;
+        }
+        std::string method = "(invalid)";
+        std::string answeredMethod;
+        bool isResponse = false;
+        const auto encoding = JsonRPC::ParseContentType(frame.contentType);
+        const auto body = Decode(frame.message, encoding);
+        if (body.is_object())
+        {
+            isResponse = !body.contains("method");
+            if (isResponse)
+            {
+                method = "(response)";
+                const auto recorded = recordedRequests.find(body.value("id", json()).dump());
+                if (recorded != recordedRequests.end())
+                    answeredMethod = recorded->second;
+            }
+            else if (body["method"].is_string())
+            {
+                method = body["method"].get<std::string>();
+            }
+        }
+        requests.push_back(
+            {frame.time,
+             std::move(method),
+             Frame(frame.message, frame.contentType),
+             isResponse,
+             std::move(answeredMethod),
+             encoding,
+             frame.contentType});
+        requestBytes += requests.back().frame.size();
+    }
+    if (requests.empty())
+    {
+        throw std::runtime_error("The session has no client messages");
+    }
+
+    // The recorded client responses refer to the ids the recording server generated. The builds may run at other
+    // times than recorded, so the requests of this server can come in another order: a response is matched with
+    // the oldest unanswered request of the method it answered.
+    std::unordered_map<std::string, std::queue<json>> serverRequestIds;
+    std::vector<int64_t> latencies(requests.size(), -1);
+    size_t outputMessages = 0;
+    size_t outputBytes = 0;
+    const auto start = Clock::now();
+
+    const auto scheduledTime = [&](size_t i) {
+        const auto delay = static_cast<double>(requests[i].time - requests.front().time) / speed;
+        return start + std::chrono::microseconds(static_cast<int64_t>(delay));
+    };
+    auto output = [&](const std::string& message) {
+        ++outputMessages;
+        outputBytes += message.size();
+        if (auto serverRequest = GetServerRequest(message))
+            serverRequestIds[serverRequest->method].push(std::move(serverRequest->id));
+        if (observer)
+            observer(message);
+    };
+
+    logging::Get<logger>().info("Replaying {} messages at speed {}", requests.size(), speed);
+    // the server is driven the way the daemon drives it, the scheduled builds run until the next message is due
+    auto server = CreateLSPServer(nullptr, output);
+    std::optional<int> exitCode;
+    for (size_t index = 0; index < requests.size() && !exitCode; ++index)
+    {
+        auto& request = requests[index];
+        Clock::time_point arrival = Clock::now();
+        if (speed > 0)
+        {
+            arrival = scheduledTime(index);
+            std::this_thread::sleep_until(arrival);
+        }
+        auto ids = serverRequestIds.find(request.answeredMethod);
+        if (request.isResponse && ids != serverRequestIds.end() && !ids->second.empty())
+        {
+            auto body = Decode(GetBody(request.frame), request.encoding);
+            body["id"] = std::move(ids->second.front());
+            ids->second.pop();
+            request.frame = Frame(Encode(body, request.encoding), request.contentType);
+        }
+        exitCode = server->Consume(request.frame.data(), request.frame.size());
+        const bool isLast = index + 1 == requests.size();
+        while ((speed <= 0 || isLast || Clock::now() < scheduledTime(index + 1)) && server->RunScheduledBuild())
+        {
+        }
+        // the latency includes the builds the message scheduled, unless the next message preempted them
+        latencies[index] = ToMicroseconds(Clock::now() - arrival);
+    }
+    const auto duration = ToMicroseconds(Clock::now() - start);
+    const auto seconds = std::max(static_cast<double>(duration) / 1e6, 1e-6);
+
+    std::map<std::string, std::vector<int64_t>> methodLatencies;
+    std::vector<int64_t> allLatencies;
+    for (size_t i = 0; i < requests.size(); ++i)
+    {
+        if (latencies[i] < 0)
+            continue;
+        methodLatencies[requests[i].method].push_back(latencies[i]);
+        allLatencies.push_back(latencies[i]);
+    }
+
+    json latency;
+    latency["all"] = GetLatencyStats(allLatencies);
+    for (auto& [method, values] : methodLatencies)
+        latency[method] = GetLatencyStats(std::move(values));
+
+    return {
+        {"exitCode", exitCode ? json(*exitCode) : json(nullptr)},
+        {"duration", duration},
+        {"input", {{"messages", allLatencies.size()}, {"bytes", requestBytes}}},
+        {"output", {{"messages", outputMessages}, {"bytes", outputBytes}}},
+        {"throughput",
+         {{"messagesPerSecond", static_cast<double>(allLatencies.size()) / seconds},
+          {"bytesPerSecond", static_cast<double>(requestBytes) / seconds}}},
+        {"latency", std::move(latency)},
+    };
+}
+
+} // namespace ocls
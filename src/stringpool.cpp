@@ -0,0 +1,151 @@
+//
+//  stringpool.cpp
+//  opencl-language-server
+//
+
+#include "stringpool.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept> // std::length_error
+#include <utility>
+
+namespace ocls {
+
+StringPool::StringPool(size_t capacity) : m_capacity {std::min(std::max<size_t>(capacity, 1), MaxCapacity)}
+{
+    Intern("");
+}
+
+StringPool::Handle StringPool::Intern(std::string_view str)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_requests;
+    m_requestedBytes += str.size();
+    auto it = m_index.find(str);
+    if (it != m_index.end())
+    {
+        // a string interned more times than can be counted is never released
+        auto& references = m_references[it->second];
+        if (references < std::numeric_limits<uint32_t>::max())
+            ++references;
+        return it->second;
+    }
+
+    if (!m_free.empty())
+    {
+        const auto handle = m_free.back();
+        m_free.pop_back();
+        auto& stored = m_storage[handle / ChunkSize][handle % ChunkSize];
+        stored.assign(str.data(), str.size());
+        m_index.emplace(stored, handle);
+        m_references[handle] = 1;
+        m_storedBytes += str.size();
+        return handle;
+    }
+
+    const auto handle = m_size.load(std::memory_order_relaxed);
+    if (handle >= m_capacity)
+        throw std::length_error("string pool is exhausted");
+    const auto chunkIndex = handle / ChunkSize;
+
+    if (!m_storage[chunkIndex])
+    {
+        m_storage[chunkIndex] = std::make_unique<std::string[]>(ChunkSize);
+        m_chunks[chunkIndex].store(m_storage[chunkIndex].get(), std::memory_order_release);
+    }
+    auto& stored = m_storage[chunkIndex][handle % ChunkSize];
+    stored.assign(str.data(), str.size());
+    m_index.emplace(stored, static_cast<Handle>(handle));
+    m_references.push_back(1);
+    m_storedBytes += str.size();
+    m_size.store(handle + 1, std::memory_order_release);
+    return static_cast<Handle>(handle);
+}
+
+std::optional<StringPool::Handle> StringPool::Find(std::string_view str) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto it = m_index.find(str);
+    if (it == m_index.end())
+        return std::nullopt;
+    return it->second;
+}
+
+void StringPool::Retain(Handle handle)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (handle == Empty || handle >= m_references.size() || m_references[handle] == 0 ||
+        m_references[handle] == std::numeric_limits<uint32_t>::max())
+        return;
+    ++m_references[handle];
+}
+
+void StringPool::Release(Handle handle)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (handle == Empty || handle >= m_references.size() || m_references[handle] == 0 ||
+        m_references[handle] == std::numeric_limits<uint32_t>::max())
+        return;
+    if (--m_references[handle] > 0)
+        return;
+    auto& stored = m_storage[handle / ChunkSize][handle % ChunkSize];
+    m_index.erase(stored);
+    m_storedBytes -= stored.size();
+    std::string().swap(stored);
+    m_free.push_back(handle);
+}
+
+std::string_view StringPool::Get(Handle handle) const
+{
+    const auto* chunk = m_chunks[handle / ChunkSize].load(std::memory_order_acquire);
+    return chunk[handle % ChunkSize];
+}
+
+size_t StringPool::Size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_size.load(std::memory_order_relaxed) - m_free.size();
+}
+
+StringPool::Stats StringPool::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return {m_size.load(std::memory_order_relaxed) - m_free.size(), m_storedBytes, m_requests, m_requestedBytes};
+}
+
+StringPool& GetStringPool()
+{
+    // never destroyed, the objects released at exit, such as a global server, still drop their references
+    static auto* pool = new StringPool();
+    return *pool;
+}
+
+PooledString::PooledString(std::string_view str) : m_handle {GetStringPool().Intern(str)} {}
+
+PooledString::PooledString(const PooledString& other) : m_handle {other.m_handle}
+{
+    GetStringPool().Retain(m_handle);
+}
+
+PooledString::PooledString(PooledString&& other) noexcept : m_handle {std::exchange(other.m_handle, StringPool::Empty)}
+{
+}
+
+PooledString& PooledString::operator=(PooledString other) noexcept
+{
+    std::swap(m_handle, other.m_handle);
+    return *this;
+}
+
+PooledString::~PooledString()
+{
+    GetStringPool().Release(m_handle);
+}
+
+std::string_view PooledString::Get() const
+{
+    return GetStringPool().Get(m_handle);
+}
+
+} // namespace ocls
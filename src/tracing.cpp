@@ -0,0 +1,115 @@
+//
+//  tracing.cpp
+//  opencl-language-server
+//
+
+#include "tracing.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+
+namespace ocls::tracing {
+
+namespace internal {
+std::atomic<bool> enabled {false};
+} // namespace internal
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t flushThreshold = 1 << 20;
+
+std::mutex mutex;
+std::ofstream file;
+std::string buffer;
+bool firstEvent = true;
+Clock::time_point startTime;
+std::atomic<uint32_t> threadsCount {0};
+
+uint32_t GetThreadId()
+{
+    thread_local const uint32_t id = ++threadsCount;
+    return id;
+}
+
+void AppendEvent(std::string_view event)
+{
+    buffer.append(firstEvent ? "\n" : ",\n").append(event);
+    firstEvent = false;
+}
+
+void Flush()
+{
+    file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    file.flush();
+    buffer.clear();
+}
+
+} // namespace
+
+void Start(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (internal::enabled)
+        return;
+
+    file.open(path, std::ios::out | std::ios::trunc);
+    if (!file)
+    {
+        throw std::runtime_error("Failed to open the trace file '" + path + "'");
+    }
+    startTime = Clock::now();
+    firstEvent = true;
+    buffer = "[";
+    AppendEvent(R"({"name":"process_name","ph":"M","pid":1,"args":{"name":"opencl-language-server"}})");
+    internal::enabled = true;
+}
+
+void Stop()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!internal::enabled)
+        return;
+
+    internal::enabled = false;
+    buffer.append("\n]\n");
+    Flush();
+    file.close();
+}
+
+int64_t Now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - startTime).count();
+}
+
+void WriteComplete(const char* category, const char* name, int64_t start, int64_t duration, std::string_view detail)
+{
+    std::string event;
+    event.reserve(128 + detail.size());
+    event.append(R"({"name":")").append(name);
+    event.append(R"(","cat":")").append(category);
+    event.append(R"(","ph":"X","ts":)").append(std::to_string(start));
+    event.append(R"(,"dur":)").append(std::to_string(duration));
+    event.append(R"(,"pid":1,"tid":)").append(std::to_string(GetThreadId()));
+    if (!detail.empty())
+    {
+        event.append(R"(,"args":{"detail":)");
+        utils::AppendJsonString(event, detail);
+        event.append("}");
+    }
+    event.append("}");
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // the span may end after tracing was stopped
+    if (!internal::enabled)
+        return;
+    AppendEvent(event);
+    if (buffer.size() >= flushThreshold)
+        Flush();
+}
+
+} // namespace ocls::tracing
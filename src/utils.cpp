@@ -89,6 +89,35 @@ std::string UriToPath(const std::string& uri)
     return uri;
 }
 
+// Limited file path -> uri converter, the inverse of UriToPath
+std::string PathToUri(const std::string& path)
+{
+    std::string uri = "file://";
+#if defined(WIN32)
+    uri.append("/");
+#endif
+    for (auto c : path)
+    {
+        switch (c)
+        {
+            case ':':
+                uri.append("%3A");
+                break;
+            case ' ':
+                uri.append("%20");
+                break;
+#if defined(WIN32)
+            case '\\':
+                uri.push_back('/');
+                break;
+#endif
+            default:
+                uri.push_back(c);
+        }
+    }
+    return uri;
+}
+
 bool EndsWith(const std::string& str, const std::string& suffix)
 {
     return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
@@ -102,6 +131,109 @@ void RemoveNullTerminator(std::string& str)
     }
 }
 
+namespace {
+
+// Returns the length of a valid UTF-8 sequence starting at 'pos' or 0.
+size_t GetUTF8SequenceLength(std::string_view str, size_t pos)
+{
+    const auto lead = static_cast<unsigned char>(str[pos]);
+    size_t length = 0;
+    if (lead >= 0xC2 && lead <= 0xDF)
+        length = 2;
+    else if (lead >= 0xE0 && lead <= 0xEF)
+        length = 3;
+    else if (lead >= 0xF0 && lead <= 0xF4)
+        length = 4;
+    else
+        return 0;
+
+    if (pos + length > str.size())
+        return 0;
+    for (size_t i = 1; i < length; ++i)
+    {
+        if ((static_cast<unsigned char>(str[pos + i]) & 0xC0) != 0x80)
+            return 0;
+    }
+    const auto second = static_cast<unsigned char>(str[pos + 1]);
+    if ((lead == 0xE0 && second < 0xA0) || (lead == 0xED && second > 0x9F) || (lead == 0xF0 && second < 0x90) ||
+        (lead == 0xF4 && second > 0x8F))
+        return 0; // overlong encodings, surrogates and code points above U+10FFFF
+    return length;
+}
+
+} // namespace
+
+void AppendJsonString(std::string& out, std::string_view str)
+{
+    constexpr char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    size_t pos = 0;
+    while (pos < str.size())
+    {
+        // copy runs of characters that need no escaping at once
+        size_t end = pos;
+        while (end < str.size())
+        {
+            const auto c = static_cast<unsigned char>(str[end]);
+            if (c < 0x20 || c == '"' || c == '\\' || c >= 0x80)
+                break;
+            ++end;
+        }
+        out.append(str.data() + pos, end - pos);
+        pos = end;
+        if (pos == str.size())
+            break;
+
+        const auto c = static_cast<unsigned char>(str[pos]);
+        if (c >= 0x80)
+        {
+            const auto length = GetUTF8SequenceLength(str, pos);
+            if (length == 0)
+            {
+                out.append("\\ufffd");
+                ++pos;
+            }
+            else
+            {
+                out.append(str.data() + pos, length);
+                pos += length;
+            }
+            continue;
+        }
+
+        switch (c)
+        {
+            case '"':
+                out.append("\\\"");
+                break;
+            case '\\':
+                out.append("\\\\");
+                break;
+            case '\b':
+                out.append("\\b");
+                break;
+            case '\f':
+                out.append("\\f");
+                break;
+            case '\n':
+                out.append("\\n");
+                break;
+            case '\r':
+                out.append("\\r");
+                break;
+            case '\t':
+                out.append("\\t");
+                break;
+            default:
+                out.append("\\u00");
+                out.push_back(hex[c >> 4]);
+                out.push_back(hex[c & 0xF]);
+        }
+        ++pos;
+    }
+    out.push_back('"');
+}
+
 namespace internal {
 // Generates a lookup table for the checksums of all 8-bit values.
 std::array<std::uint_fast32_t, 256> GenerateCRCLookupTable()
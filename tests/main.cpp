@@ -7,11 +7,37 @@
 
 #include <gtest/gtest.h>
 
+#include "buildoptions.hpp"
+#include "clinfo.hpp"
+#include "daemon.hpp"
 #include "diagnostics.hpp"
 #include "jsonrpc.hpp"
+#include "jsonscan.hpp"
+#include "lineindex.hpp"
+#include "logging.hpp"
+#include "lsp.hpp"
+#include "metrics.hpp"
+#include "opencl_mock.hpp"
+#include "scheduler.hpp"
+#include "session.hpp"
+#include "tracing.hpp"
+#include "utils.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/null_sink.h>
+#include <sstream>
+#include <thread>
+#include <tuple>
+
+#if defined(__linux__)
+    #include <netinet/in.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
 
 using namespace ocls;
 using namespace nlohmann;
@@ -50,12 +76,91 @@ std::string ParseResponse(std::string str)
     return str;
 }
 
+// 'initialize' request of a client that pushes diagnostics and has no configuration capability
+json BuildInitializeRequest()
+{
+    return {
+        {"jsonrpc", "2.0"},
+        {"id", 0},
+        {"method", "initialize"},
+        {"params",
+         {{"processId", 60650},
+          {"trace", "off"},
+          {"capabilities",
+           {{"workspace", {{"configuration", false}, {"didChangeConfiguration", {{"dynamicRegistration", false}}}}}}},
+          {"initializationOptions",
+           {{"configuration", {{"buildOptions", json::array()}, {"maxNumberOfProblems", 100}, {"deviceID", 0}}}}}}}};
+}
+
+#if defined(__linux__)
+int ConnectTo(const std::string& path)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int ConnectTo(uint16_t port)
+{
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void SendTo(int fd, const json& message)
+{
+    const auto request = BuildRequest(message);
+    ASSERT_EQ(write(fd, request.data(), request.size()), static_cast<ssize_t>(request.size()));
+}
+
+// Returns the next message body, or null once the connection is closed
+json ReceiveFrom(int fd, std::string& buffer)
+{
+    while (true)
+    {
+        const auto headerEnd = buffer.find("\r\n\r\n");
+        if (headerEnd != std::string::npos)
+        {
+            const auto length = std::stoul(buffer.substr(buffer.find(':') + 1));
+            if (buffer.size() >= headerEnd + 4 + length)
+            {
+                auto body = json::parse(buffer.substr(headerEnd + 4, length));
+                buffer.erase(0, headerEnd + 4 + length);
+                return body;
+            }
+        }
+        char chunk[4096];
+        const auto size = read(fd, chunk, sizeof(chunk));
+        if (size <= 0)
+            return nullptr;
+        buffer.append(chunk, static_cast<size_t>(size));
+    }
+}
+#endif
+
 const std::string initRequest = BuildRequest(json::object(
         {{"jsonrpc", "2.0"},
          {"id", 0},
          {"method", "initialize"},
          {"params", {{"processId", 60650}, {"trace", "off"}}}}));
 
+constexpr char lspLogger[] = "lsp";
+
 const auto InitializeJsonRPC = [](JsonRPC& jrpc) {
     jrpc.RegisterOutputCallback([](const std::string&) {});
     jrpc.RegisterMethodCallback("initialize", [](const json&) {});
@@ -118,6 +223,1437 @@ TEST(JsonRPCTest, RespondToUnsupportedMethod)
     Send(request, jrpc);
 }
 
+TEST(JsonRPCTest, NegotiateBinaryEncodings)
+{
+    JsonRPC jrpc;
+    InitializeJsonRPC(jrpc);
+    jrpc.RegisterMethodCallback("textDocument/hover", [&jrpc](const json& request) {
+        EXPECT_EQ(request["params"]["text"], "__kernel void f() {}");
+        jrpc.Write({{"id", request["id"]}, {"result", nullptr}});
+    });
+    const json request = {
+        {"jsonrpc", "2.0"},
+        {"id", 1},
+        {"method", "textDocument/hover"},
+        {"params", {{"text", "__kernel void f() {}"}}}};
+    using Decoder = std::function<json(const std::string&)>;
+    const std::vector<std::tuple<std::string, std::vector<uint8_t>, Decoder>> encodings = {
+        {"application/cbor", json::to_cbor(request), [](const std::string& body) { return json::from_cbor(body); }},
+        {"application/msgpack",
+         json::to_msgpack(request),
+         [](const std::string& body) { return json::from_msgpack(body); }},
+    };
+    for (const auto& [contentType, body, decode] : encodings)
+    {
+        std::string response;
+        jrpc.RegisterOutputCallback([&response](const std::string& message) { response = message; });
+        // the header names are case-insensitive
+        std::string message = "content-length: " + std::to_string(body.size()) + "\r\n";
+        message.append("CONTENT-TYPE: " + contentType + "\r\n\r\n");
+        message.append(body.begin(), body.end());
+        Send(message, jrpc);
+        jrpc.Reset();
+
+        // the response is in the encoding of the request
+        const auto headerEnd = response.find("\r\n\r\n");
+        ASSERT_NE(headerEnd, std::string::npos);
+        EXPECT_NE(response.find("Content-Type: " + contentType), std::string::npos);
+        const auto decoded = decode(response.substr(headerEnd + 4));
+        EXPECT_EQ(decoded["id"], 1);
+        EXPECT_EQ(decoded["jsonrpc"], "2.0");
+    }
+}
+
+TEST(JsonRPCTest, DispatchBatch)
+{
+    JsonRPC jrpc;
+    InitializeJsonRPC(jrpc);
+    std::vector<std::string> dispatched;
+    jrpc.RegisterMethodCallback("textDocument/hover", [&jrpc, &dispatched](const json& request) {
+        dispatched.push_back("hover");
+        jrpc.Write({{"id", request["id"]}, {"result", request["params"]}});
+    });
+    jrpc.RegisterMethodCallback("textDocument/didOpen", [&dispatched](const json&) {
+        dispatched.push_back("didOpen");
+    });
+    std::vector<json> responses;
+    jrpc.RegisterOutputCallback(
+        [&responses](const std::string& message) { responses.push_back(json::parse(ParseResponse(message))); });
+
+    const json batch = {
+        {{"jsonrpc", "2.0"}, {"method", "textDocument/didOpen"}, {"params", json::object()}},
+        {{"jsonrpc", "2.0"}, {"id", 1}, {"method", "textDocument/hover"}, {"params", {{"line", 1}}}},
+        {{"jsonrpc", "2.0"}, {"id", 2}, {"method", "textDocument/unknown"}, {"params", json::object()}},
+        42,
+        {{"jsonrpc", "2.0"}, {"id", 3}, {"method", "textDocument/hover"}, {"params", {{"line", 3}}}},
+    };
+    Send(BuildRequest(batch), jrpc);
+    EXPECT_TRUE(jrpc.IsReady());
+    // the responses are sent as one message once the batch is done
+    EXPECT_TRUE(responses.empty());
+    jrpc.Reset();
+
+    EXPECT_EQ(dispatched, std::vector<std::string>({"didOpen", "hover", "hover"}));
+    ASSERT_EQ(responses.size(), 1u);
+    const auto& response = responses.front();
+    ASSERT_TRUE(response.is_array());
+    ASSERT_EQ(response.size(), 4u);
+    EXPECT_EQ(response[0]["id"], 1);
+    EXPECT_EQ(response[0]["result"]["line"], 1);
+    EXPECT_EQ(response[1]["id"], 2);
+    EXPECT_EQ(response[1]["error"]["code"], static_cast<int>(JsonRPC::ErrorCode::MethodNotFound));
+    EXPECT_TRUE(response[2]["id"].is_null());
+    EXPECT_EQ(response[2]["error"]["code"], static_cast<int>(JsonRPC::ErrorCode::InvalidRequest));
+    EXPECT_EQ(response[3]["id"], 3);
+
+    // notifications only, nothing to respond
+    responses.clear();
+    Send(BuildRequest(json::array({batch[0], batch[0]})), jrpc);
+    jrpc.Reset();
+    EXPECT_TRUE(responses.empty());
+}
+
+TEST(JsonRPCTest, DispatchStaticAndRuntimeHandlers)
+{
+    struct Handler
+    {
+        std::vector<std::string> uris;
+        void OnTextOpen(const json& request)
+        {
+            uris.push_back(request["params"]["textDocument"]["uri"].get<std::string>());
+        }
+    };
+
+    JsonRPC jrpc;
+    InitializeJsonRPC(jrpc);
+    Handler handler;
+    jrpc.RegisterMethodHandler<&Handler::OnTextOpen>(methods::Method::DidOpen, &handler);
+    bool isCallbackCalled = false;
+    jrpc.RegisterMethodCallback("textDocument/didOpen", [&isCallbackCalled](const json&) { isCallbackCalled = true; });
+    int extensionCalls = 0;
+    jrpc.RegisterMethodCallback("$/custom/extension", [&extensionCalls](const json&) { ++extensionCalls; });
+
+    Send(
+        BuildRequest(
+            {{"jsonrpc", "2.0"},
+             {"method", "textDocument/didOpen"},
+             {"params", {{"textDocument", {{"uri", "file:///kernel.cl"}}}}}}),
+        jrpc);
+    jrpc.Reset();
+    Send(BuildRequest({{"jsonrpc", "2.0"}, {"method", "$/custom/extension"}, {"params", nullptr}}), jrpc);
+    jrpc.Reset();
+
+    EXPECT_EQ(handler.uris, std::vector<std::string>({"file:///kernel.cl"}));
+    EXPECT_FALSE(isCallbackCalled);
+    EXPECT_EQ(extensionCalls, 1);
+}
+
+TEST(JsonRPCTest, BoundInboundMessages)
+{
+    JsonRPC::Limits limits;
+    limits.maxMessageSize = 16 * 1024;
+    limits.buffer.spoolThreshold = 4 * 1024;
+    JsonRPC jrpc(limits);
+    InitializeJsonRPC(jrpc);
+    std::vector<json> responses;
+    jrpc.RegisterOutputCallback(
+        [&responses](const std::string& message) { responses.push_back(json::parse(ParseResponse(message))); });
+    std::vector<size_t> sizes;
+    jrpc.RegisterMethodCallback("$/custom/text", [&sizes](const json& request) {
+        sizes.push_back(request["params"]["text"].get<std::string>().size());
+    });
+    const auto buildText = [](size_t size) {
+        return BuildRequest(
+            {{"jsonrpc", "2.0"}, {"method", "$/custom/text"}, {"params", {{"text", std::string(size, 'x')}}}});
+    };
+
+    // the oversized message is skipped and the stream stays in sync, the large one is spooled
+    const auto stream = buildText(32 * 1024) + buildText(8 * 1024) + buildText(16);
+    const auto rejectedBefore = metrics::Get(metrics::Counter::RejectedMessages);
+    size_t offset = 0;
+    while (offset < stream.size())
+    {
+        offset += jrpc.Consume(stream.data() + offset, stream.size() - offset);
+        if (jrpc.IsReady())
+            jrpc.Reset();
+    }
+
+    ASSERT_EQ(responses.size(), 1u);
+    EXPECT_EQ(responses[0]["error"]["code"], static_cast<int64_t>(JsonRPC::ErrorCode::InvalidRequest));
+    EXPECT_EQ(metrics::Get(metrics::Counter::RejectedMessages) - rejectedBefore, 1u);
+    EXPECT_EQ(sizes, std::vector<size_t>({8 * 1024, 16}));
+
+    MessageBuffer buffer({4 * 1024 * 1024, 64 * 1024});
+    const std::string body(1024 * 1024, 'x');
+    buffer.Begin(body.size());
+    buffer.Append(body.data(), body.size());
+    EXPECT_EQ(buffer.View(), body);
+    EXPECT_FALSE(buffer.IsSpooled());
+    // the capacity of an outlier is released, the usual size is kept
+    buffer.Clear();
+    EXPECT_LE(buffer.Capacity(), 64 * 1024u);
+    buffer.Begin(32 * 1024);
+    buffer.Append(body.data(), 32 * 1024);
+    buffer.Clear();
+    EXPECT_GE(buffer.Capacity(), 32 * 1024u);
+}
+
+TEST(JsonRPCTest, RejectMalformedHeaders)
+{
+    JsonRPC::Limits limits;
+    limits.maxHeaderSize = 1024;
+    JsonRPC jrpc(limits);
+    InitializeJsonRPC(jrpc);
+    std::vector<json> responses;
+    jrpc.RegisterOutputCallback(
+        [&responses](const std::string& message) { responses.push_back(json::parse(ParseResponse(message))); });
+    size_t received = 0;
+    jrpc.RegisterMethodCallback("$/custom/ping", [&received](const json&) { ++received; });
+    const auto ping = BuildRequest({{"jsonrpc", "2.0"}, {"method", "$/custom/ping"}});
+
+    // the lengths that do not fit or are not numbers, and a header line without an end
+    const auto stream = "Content-Length: 99999999999999999999999999\r\n\r\n" + ping +
+                        "Content-Length: 12abc\r\n\r\n" + ping + "Content-Length: -1\r\n\r\n" + ping +
+                        "X-Padding: " + std::string(64 * 1024, 'x') + "\r\n\r\n" + ping;
+    const auto rejectedBefore = metrics::Get(metrics::Counter::RejectedMessages);
+    size_t offset = 0;
+    while (offset < stream.size())
+    {
+        offset += jrpc.Consume(stream.data() + offset, stream.size() - offset);
+        if (jrpc.IsReady())
+            jrpc.Reset();
+    }
+
+    ASSERT_EQ(responses.size(), 4u);
+    for (const auto& response : responses)
+        EXPECT_EQ(response["error"]["code"], static_cast<int64_t>(JsonRPC::ErrorCode::InvalidRequest));
+    EXPECT_EQ(metrics::Get(metrics::Counter::RejectedMessages) - rejectedBefore, 1u);
+    EXPECT_EQ(received, 4u);
+}
+
+TEST(JsonRPCTest, InitializeAfterRejectedRequest)
+{
+    JsonRPC jrpc;
+    std::vector<json> responses;
+    jrpc.RegisterOutputCallback(
+        [&responses](const std::string& message) { responses.push_back(json::parse(ParseResponse(message))); });
+    size_t initialized = 0;
+    jrpc.RegisterMethodCallback("initialize", [&initialized](const json&) { ++initialized; });
+
+    const auto stream =
+        BuildRequest({{"jsonrpc", "2.0"}, {"id", 1}, {"method", "textDocument/hover"}, {"params", {}}}) + initRequest;
+    size_t offset = 0;
+    while (offset < stream.size())
+    {
+        offset += jrpc.Consume(stream.data() + offset, stream.size() - offset);
+        if (jrpc.IsReady())
+            jrpc.Reset();
+    }
+
+    ASSERT_EQ(responses.size(), 1u);
+    EXPECT_EQ(responses[0]["error"]["code"], static_cast<int64_t>(JsonRPC::ErrorCode::NotInitialized));
+    EXPECT_EQ(initialized, 1u);
+}
+
+TEST(JsonScanTest, ParseDocumentMessages)
+{
+    std::string text;
+    while (text.size() < 64 * 1024)
+        text.append("float4 v = (float4)(0.5f); // \"quoted\" \\ tab\t \u00e9 \u20ac \U0001F600 \xF0\x9F\x98\x80\n");
+    const json didOpen = {
+        {"jsonrpc", "2.0"},
+        {"method", "textDocument/didOpen"},
+        {"params", {{"textDocument", {{"uri", "file:///kernel.cl"}, {"version", 1}, {"text", text}}}}}};
+    const json didChange = {
+        {"jsonrpc", "2.0"},
+        {"method", "textDocument/didChange"},
+        {"params",
+         {{"textDocument", {{"uri", "file:///kernel.cl"}, {"version", 2}}},
+          {"contentChanges", {{{"text", text}}, {{"text", "short"}}, {{"text", text + "tail"}}}}}}};
+    for (const auto& message : {didOpen, didChange})
+    {
+        // escapes written by dump and by other clients
+        for (const auto& body : {message.dump(), message.dump(-1, ' ', true)})
+        {
+            json parsed;
+            ASSERT_TRUE(jsonscan::ParseDocumentMessage(body, parsed));
+            EXPECT_EQ(parsed, message);
+        }
+    }
+    const std::string surrogates = R"("\uD83D\uDE00 \u00e9 \/")";
+    std::string unescaped;
+    EXPECT_EQ(jsonscan::ReadString(surrogates, 1, &unescaped), surrogates.size() - 1);
+    EXPECT_EQ(unescaped, "\xF0\x9F\x98\x80 \xC3\xA9 /");
+
+    // unusual messages are left to nlohmann::json
+    json parsed;
+    auto other = didOpen;
+    other["method"] = "textDocument/hover";
+    EXPECT_FALSE(jsonscan::ParseDocumentMessage(other.dump(), parsed));
+    auto small = didOpen;
+    small["params"]["textDocument"]["text"] = "__kernel void f() {}";
+    EXPECT_FALSE(jsonscan::ParseDocumentMessage(small.dump(), parsed));
+    auto extra = didOpen;
+    extra["params"]["text"] = text;
+    EXPECT_FALSE(jsonscan::ParseDocumentMessage(extra.dump(), parsed));
+    auto invalid = didOpen.dump();
+    invalid.insert(invalid.find("float4"), "\\q");
+    EXPECT_FALSE(jsonscan::ParseDocumentMessage(invalid, parsed));
+    auto invalidUtf8 = didOpen.dump();
+    invalidUtf8.insert(invalidUtf8.find("float4"), "\xC0\xAF");
+    EXPECT_FALSE(jsonscan::ParseDocumentMessage(invalidUtf8, parsed));
+}
+
+TEST(LineIndexTest, ConvertPositions)
+{
+    // 'é' is 2 bytes and 1 UTF-16 unit, the emoji is 4 bytes and 2 UTF-16 units
+    const std::string text = "__kernel void f()\r\n{\n    // é\U0001F600 x\n    int y;\n}";
+    const LineIndex index(text);
+    ASSERT_EQ(index.GetLineCount(), 5u);
+    EXPECT_TRUE(index.IsAscii(0));
+    EXPECT_FALSE(index.IsAscii(2));
+    EXPECT_EQ(index.GetLine(index.GetLineStart(3)), 3u);
+
+    // the byte column of 'x'
+    const size_t column = std::string("    // é\U0001F600 ").size();
+    EXPECT_EQ(index.GetCharacter(text, 2, column, PositionEncoding::Utf8), column);
+    EXPECT_EQ(index.GetCharacter(text, 2, column, PositionEncoding::Utf16), 11u);
+    EXPECT_EQ(index.GetCharacter(text, 2, column, PositionEncoding::Utf32), 10u);
+    // columns are clamped to the line content, without the line break
+    EXPECT_EQ(index.GetCharacter(text, 0, 100, PositionEncoding::Utf16), 17u);
+    for (const auto encoding : {PositionEncoding::Utf8, PositionEncoding::Utf16, PositionEncoding::Utf32})
+    {
+        for (size_t offset = 0; offset <= text.size(); ++offset)
+        {
+            const auto isCharacterStart = offset == text.size() || (text[offset] & 0xC0) != 0x80;
+            if (!isCharacterStart || (offset > 0 && text[offset - 1] == '\r'))
+                continue;
+            EXPECT_EQ(index.GetOffset(text, index.GetPosition(text, offset, encoding), encoding), offset);
+        }
+    }
+
+    // the updated index matches the index of the new text
+    std::string previous = text;
+    LineIndex updated = index;
+    const std::vector<std::tuple<size_t, size_t, std::string>> edits = {
+        {0, 0, "// header\n"},
+        {12, 3, "é\n\n"},
+        {20, 0, "\n"},
+        {5, 30, ""},
+        {0, 0, "\U0001F600"},
+    };
+    for (const auto& [offset, count, insertion] : edits)
+    {
+        std::string next = previous;
+        next.replace(offset, count, insertion);
+        updated.Update(previous, next);
+        const LineIndex rebuilt(next);
+        ASSERT_EQ(updated.GetLineCount(), rebuilt.GetLineCount());
+        for (uint32_t line = 0; line < rebuilt.GetLineCount(); ++line)
+        {
+            EXPECT_EQ(updated.GetLineStart(line), rebuilt.GetLineStart(line));
+            EXPECT_EQ(updated.IsAscii(line), rebuilt.IsAscii(line));
+        }
+        previous = std::move(next);
+    }
+}
+
+TEST(BuildSchedulerTest, PrioritizeAndAge)
+{
+    using namespace std::chrono_literals;
+    BuildScheduler scheduler;
+    const auto start = BuildScheduler::Clock::now();
+    const auto coalescedBefore = metrics::Get(metrics::Counter::BuildsCoalesced);
+    const auto cancelledBefore = metrics::Get(metrics::Counter::BuildsCancelled);
+    EXPECT_FALSE(scheduler.Pop(start));
+
+    EXPECT_TRUE(scheduler.Enqueue(1, BuildPriority::Background, start));
+    EXPECT_TRUE(scheduler.Enqueue(2, BuildPriority::Open, start));
+    EXPECT_TRUE(scheduler.Enqueue(3, BuildPriority::Background, start + 1ms));
+    EXPECT_TRUE(scheduler.Enqueue(4, BuildPriority::Active, start + 2ms));
+    // a repeated request is merged and raises the priority, the later request time is kept
+    EXPECT_FALSE(scheduler.Enqueue(3, BuildPriority::Active, start + 3ms));
+    EXPECT_FALSE(scheduler.Enqueue(2, BuildPriority::Background, start + 4ms));
+    EXPECT_EQ(scheduler.size(), 4u);
+    EXPECT_EQ(scheduler.GetPriority(2), BuildPriority::Open);
+    EXPECT_EQ(metrics::Get(metrics::Counter::BuildsCoalesced) - coalescedBefore, 2u);
+
+    // the build keeps its enqueue time, so it goes before the later one of its new priority
+    auto build = scheduler.Pop(start + 5ms);
+    ASSERT_TRUE(build);
+    EXPECT_EQ(build->key, 3u);
+    EXPECT_EQ(build->requestTime, start + 3ms);
+    scheduler.Demote(4, BuildPriority::Open);
+    scheduler.Demote(2, BuildPriority::Active);
+    EXPECT_EQ(scheduler.GetPriority(2), BuildPriority::Open);
+    EXPECT_EQ(scheduler.Pop(start + 5ms)->key, 2u);
+    EXPECT_EQ(scheduler.Pop(start + 5ms)->key, 4u);
+
+    // a background build waiting for more than two aging intervals is ranked above a new active one
+    EXPECT_TRUE(scheduler.Enqueue(5, BuildPriority::Active, start + 2s));
+    EXPECT_EQ(scheduler.Pop(start + 2s)->key, 5u);
+    EXPECT_TRUE(scheduler.Enqueue(5, BuildPriority::Active, start + 3s));
+    EXPECT_EQ(scheduler.Pop(start + 3s)->key, 1u);
+    EXPECT_EQ(scheduler.Pop(start + 3s)->key, 5u);
+    EXPECT_TRUE(scheduler.empty());
+
+    EXPECT_TRUE(scheduler.Enqueue(6, BuildPriority::Open, start));
+    EXPECT_TRUE(scheduler.Enqueue(7, BuildPriority::Background, start));
+    EXPECT_TRUE(scheduler.Cancel(6));
+    EXPECT_FALSE(scheduler.Cancel(6));
+    EXPECT_EQ(scheduler.CancelAll(), 1u);
+    EXPECT_FALSE(scheduler.Pop(start));
+    EXPECT_EQ(metrics::Get(metrics::Counter::BuildsCancelled) - cancelledBefore, 2u);
+    EXPECT_EQ(metrics::GetSnapshot()["histograms"]["queueBackground"]["max"], 3000000u);
+}
+
+TEST(UtilsTest, PathToUriRoundTrip)
+{
+#if defined(WIN32)
+    const std::string path = "c:/Users/dev/my kernels/include/common.h";
+    EXPECT_EQ(utils::PathToUri(path), "file:///c%3A/Users/dev/my%20kernels/include/common.h");
+#else
+    const std::string path = "/home/dev/my kernels/include/common.h";
+    EXPECT_EQ(utils::PathToUri(path), "file:///home/dev/my%20kernels/include/common.h");
+#endif
+    EXPECT_EQ(utils::UriToPath(utils::PathToUri(path)), path);
+}
+
+TEST(StringPoolTest, InternStoresStringsOnce)
+{
+    StringPool pool;
+    const auto first = pool.Intern("no previous prototype for function");
+    const auto second = pool.Intern(std::string("no previous prototype for function"));
+    EXPECT_EQ(first, second);
+    EXPECT_NE(first, pool.Intern("unused variable"));
+    EXPECT_EQ(pool.Intern(""), StringPool::Empty);
+    EXPECT_EQ(pool.Get(first), "no previous prototype for function");
+
+    const auto stats = pool.GetStats();
+    EXPECT_EQ(stats.strings, 3u);
+    EXPECT_EQ(stats.storedBytes, 49u);
+    EXPECT_EQ(stats.requestedBytes, 83u);
+}
+
+TEST(StringPoolTest, ThrowWhenExhausted)
+{
+    StringPool pool(3);
+    const auto kernel = pool.Intern("kernel.cl");
+    const auto header = pool.Intern("common.h");
+    EXPECT_THROW(pool.Intern("other.h"), std::length_error);
+    // the strings already interned stay usable
+    EXPECT_EQ(pool.Intern("kernel.cl"), kernel);
+    EXPECT_EQ(pool.Get(header), "common.h");
+    EXPECT_EQ(pool.Size(), 3u);
+
+    DiagnosticsList diagnostics;
+    diagnostics.push_back(0, 0, 1, "first");
+    diagnostics.push_back(1, 0, 2, "second");
+    diagnostics.push_back(2, 0, 2, "third");
+    diagnostics.truncate(2);
+    EXPECT_EQ(diagnostics.messageText, "firstsecond");
+    EXPECT_EQ(diagnostics.message(1), "second");
+}
+
+TEST(StringPoolTest, ReleaseUnreferencedStrings)
+{
+    StringPool pool(4);
+    const auto uri = pool.Intern("file:///kernel.cl");
+    EXPECT_EQ(pool.Intern("file:///kernel.cl"), uri);
+    EXPECT_EQ(pool.Find("file:///kernel.cl"), uri);
+    EXPECT_FALSE(pool.Find("file:///other.cl"));
+
+    // the string stays until the last reference is dropped, then its slot is reused
+    pool.Release(uri);
+    EXPECT_EQ(pool.Get(uri), "file:///kernel.cl");
+    pool.Release(uri);
+    EXPECT_FALSE(pool.Find("file:///kernel.cl"));
+    EXPECT_EQ(pool.Size(), 1u);
+    EXPECT_EQ(pool.Intern("file:///other.cl"), uri);
+    pool.Release(StringPool::Empty);
+    EXPECT_EQ(pool.Find(""), StringPool::Empty);
+}
+
+TEST(BuildOptionsTest, CanonicalizeOptions)
+{
+    const auto options = BuildOptions::Parse(
+        {"-cl-std=CL2.0  -I ./include/ -DB=2", "-cl-mad-enable -cl-fast-relaxed-math", "-DA -I/opt/cl -Iinclude -w"});
+    EXPECT_EQ(
+        options.GetString(), "-cl-std=CL2.0 -cl-fast-relaxed-math -cl-mad-enable -DA=1 -DB=2 -Iinclude -I/opt/cl -w");
+    EXPECT_EQ(options.GetIncludePaths(), (std::vector<std::string> {"include", "/opt/cl"}));
+
+    // the order of the defines and flags does not matter, the search order of the include paths does
+    const auto reordered = BuildOptions::Parse(
+        {"-w", "-cl-fast-relaxed-math -D A=1 -DB=2 -cl-mad-enable -cl-std=CL2.0 -I include -I /opt/cl/"});
+    EXPECT_EQ(reordered, options);
+    EXPECT_EQ(reordered.GetKey(), options.GetKey());
+    EXPECT_NE(
+        BuildOptions::Parse({"-I/opt/cl -Iinclude"}).GetKey(), BuildOptions::Parse({"-Iinclude -I/opt/cl"}).GetKey());
+    EXPECT_EQ(BuildOptions::Parse(json::array()), BuildOptions());
+    EXPECT_EQ(BuildOptions().GetKey(), BuildOptions::Parse({" "}).GetKey());
+
+    // a later definition of a macro replaces the earlier one
+    const auto redefined = BuildOptions::Parse({"-DA=1 -UB -DA=2 \"-DC=a b\" \"-I/my include\""});
+    EXPECT_EQ(redefined.GetString(), "-DA=2 -UB -D\"C=a b\" -I\"/my include\"");
+
+    // vendor options are passed through in their order, with the separate arguments of unknown options
+    const auto vendor = BuildOptions::Parse({"-cl-nv-verbose -cl-nv-maxrregcount=32 -cl-mad-enable",
+                                             "-cl-intel-greater-than-4GB-buffer-required -cl-ext=+cl_khr_fp64",
+                                             "-s \"/my kernels/a.cl\" -w"});
+    EXPECT_EQ(vendor.GetFlags(), (std::set<std::string> {"-cl-mad-enable"}));
+    EXPECT_EQ(vendor.GetOtherOptions(),
+              (std::vector<std::string> {"-cl-nv-verbose", "-cl-nv-maxrregcount=32",
+                                         "-cl-intel-greater-than-4GB-buffer-required", "-cl-ext=+cl_khr_fp64",
+                                         "-s \"/my kernels/a.cl\"", "-w"}));
+
+    for (const auto* malformed :
+         {"-D", "-D1A", "-DA(x", "-Ix -I", "-cl-std=CL9.9", "stray", "-cl-mad-enable stray", "-DA stray", "\"-DA"})
+        EXPECT_THROW(BuildOptions::Parse({malformed}), std::invalid_argument) << malformed;
+    EXPECT_THROW(BuildOptions::Parse({1}), std::invalid_argument);
+    EXPECT_THROW(BuildOptions::Parse("-DA"), std::invalid_argument);
+}
+
+TEST(DiagnosticsTest, SerializeDiagnostics)
+{
+    DiagnosticsList diagnostics;
+    diagnostics.source = PooledString("kernel.cl");
+    diagnostics.push_back(12, 5, 2, "no previous prototype for function 'getChannel'");
+    diagnostics.push_back(3, 1, 1, "expected \"\\\" before \t\xff");
+
+    std::string out;
+    SerializeDiagnostics(diagnostics, out);
+    const auto position = [](int line, int character) { return json {{"line", line}, {"character", character}}; };
+    const json expected = {
+        {{"source", "kernel.cl"},
+         {"range", {{"start", position(12, 5)}, {"end", position(12, 5)}}},
+         {"severity", 2},
+         {"message", "no previous prototype for function 'getChannel'"}},
+        {{"source", "kernel.cl"},
+         {"range", {{"start", position(3, 1)}, {"end", position(3, 1)}}},
+         {"severity", 1},
+         {"message", "expected \"\\\" before \t\xef\xbf\xbd"}},
+    };
+    EXPECT_EQ(json::parse(out), expected);
+}
+
+TEST(DiagnosticsTest, ParseBuildLog)
+{
+    mock::Reset();
+    mock::SetBuildLog(
+        "<program source>:3:5: error: use of undeclared identifier 'x'\n"
+        "    x = 1;\n"
+        "    ^\n"
+        "<program source>:7:12: warning: unused variable 'y'\n"
+        "    int y;\n"
+        "        ^\n");
+    auto diagnostics = CreateDiagnostics(CreateCLInfo());
+    const auto result = diagnostics->Get({"/kernels/kernel.cl", MakeSharedText("__kernel void f() { x = 1; }"), {}});
+    mock::Reset();
+
+    ASSERT_EQ(result.size(), 1u);
+    ASSERT_EQ(result.count("/kernels/kernel.cl"), 1u);
+    const auto& list = result.at("/kernels/kernel.cl");
+    ASSERT_EQ(list.size(), 2u);
+    EXPECT_EQ(list.lines[0], 2u);
+    EXPECT_EQ(list.characters[0], 5u);
+    EXPECT_EQ(list.severities[0], 1);
+    EXPECT_EQ(list.message(0), "use of undeclared identifier 'x'");
+    EXPECT_EQ(list.lines[1], 6u);
+    EXPECT_EQ(list.severities[1], 2);
+    EXPECT_EQ(list.message(1), "unused variable 'y'");
+}
+
+TEST(DiagnosticsTest, ReleasePooledStringsWithResults)
+{
+    const auto directory = std::filesystem::temp_directory_path() / "opencl-ls-pool-test";
+    std::filesystem::create_directories(directory);
+    std::ofstream(directory / "common.h") << "";
+    const auto filePath = (directory / "kernel.cl").string();
+    mock::Reset();
+    mock::SetBuildLog(
+        "<program source>:1:1: warning: in the kernel\n"
+        "common.h:1:1: error: in the header\n");
+    auto diagnostics = CreateDiagnostics(CreateCLInfo());
+    auto& pool = GetStringPool();
+    const auto size = pool.Size();
+
+    for (int i = 0; i < 20; ++i)
+    {
+        const auto result = diagnostics->Get(
+            {filePath,
+             MakeSharedText("#include \"common.h\""),
+             {{(directory / "common.h").string(), MakeSharedText(std::to_string(i))}}});
+        ASSERT_EQ(result.size(), 2u);
+        EXPECT_EQ(result.at(filePath).source.Get(), "kernel.cl");
+        EXPECT_EQ(result.at((directory / "common.h").string()).source.Get(), "common.h");
+    }
+    EXPECT_EQ(pool.Size(), size);
+    mock::Reset();
+    std::filesystem::remove_all(directory);
+}
+
+namespace {
+
+// A server whose messages are collected, the builds it schedules run after every message
+class LSPServerTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        mock::Reset();
+        server = CreateLSPServer(nullptr, [this](const std::string& message) {
+            messages.push_back(json::parse(message.substr(message.find("\r\n\r\n") + 4)));
+        });
+    }
+
+    void TearDown() override
+    {
+        server.reset();
+        mock::Reset();
+        if (!directory.empty())
+            std::filesystem::remove_all(directory);
+    }
+
+    // Returns the messages the server sent in response
+    const std::vector<json>& Send(const json& message)
+    {
+        messages.clear();
+        const auto request = BuildRequest(message);
+        server->Consume(request.data(), request.size());
+        while (server->RunScheduledBuild())
+        {
+        }
+        return messages;
+    }
+
+    const std::vector<json>& Initialize(const json& request = BuildInitializeRequest())
+    {
+        return Send(request);
+    }
+
+    const std::vector<json>& Open(const std::string& uri, const json& version, const std::string& text)
+    {
+        return Send(
+            {{"jsonrpc", "2.0"},
+             {"method", "textDocument/didOpen"},
+             {"params", {{"textDocument", {{"uri", uri}, {"version", version}, {"text", text}}}}}});
+    }
+
+    const std::vector<json>& Change(const std::string& uri, int version, const std::string& text)
+    {
+        return Send(
+            {{"jsonrpc", "2.0"},
+             {"method", "textDocument/didChange"},
+             {"params",
+              {{"textDocument", {{"uri", uri}, {"version", version}}}, {"contentChanges", {{{"text", text}}}}}}});
+    }
+
+    const std::vector<json>& Close(const std::string& uri)
+    {
+        return Send(
+            {{"jsonrpc", "2.0"}, {"method", "textDocument/didClose"}, {"params", {{"textDocument", {{"uri", uri}}}}}});
+    }
+
+    // Returns the result of the pull, null if the server did not answer alone
+    json Pull(const std::string& uri, const std::string& previousResultId = "")
+    {
+        json params = {{"textDocument", {{"uri", uri}}}};
+        if (!previousResultId.empty())
+            params["previousResultId"] = previousResultId;
+        Send({{"jsonrpc", "2.0"}, {"id", 1}, {"method", "textDocument/diagnostic"}, {"params", params}});
+        return messages.size() == 1 ? messages[0]["result"] : json();
+    }
+
+    // Returns the id of the configuration request the server sends for the change
+    json ChangeConfiguration()
+    {
+        Send({{"jsonrpc", "2.0"}, {"method", "workspace/didChangeConfiguration"}, {"params", json::object()}});
+        EXPECT_EQ(messages.size(), 1u);
+        return messages.empty() ? json() : messages.back()["id"];
+    }
+
+    const std::vector<json>& Respond(const json& id, const json& result)
+    {
+        return Send({{"jsonrpc", "2.0"}, {"id", id}, {"result", result}});
+    }
+
+    // Creates a directory for the files of the test, it is removed with the test
+    std::filesystem::path CreateDirectory(const std::string& name)
+    {
+        directory = std::filesystem::temp_directory_path() / name;
+        std::filesystem::create_directories(directory);
+        return directory;
+    }
+
+    std::vector<json> messages;
+    std::shared_ptr<ILSPServer> server;
+    std::filesystem::path directory;
+};
+
+} // namespace
+
+TEST_F(LSPServerTest, SuppressUnchangedDiagnostics)
+{
+    mock::SetBuildLog("<program source>:1:1: warning: unchanged\n");
+    Initialize();
+    // a document without a version is published without one
+    Open("file:///kernel.cl", nullptr, "x");
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_EQ(messages.back()["params"]["diagnostics"].size(), 1u);
+    EXPECT_FALSE(messages.back()["params"].contains("version"));
+
+    // the edit leaves the build log as it was, so the same diagnostics are not sent again
+    const auto suppressedBefore = metrics::Get(metrics::Counter::SuppressedDiagnostics);
+    Change("file:///kernel.cl", 2, "x");
+    EXPECT_EQ(mock::GetBuildCount(), 2u);
+    EXPECT_TRUE(messages.empty());
+    EXPECT_EQ(metrics::Get(metrics::Counter::SuppressedDiagnostics) - suppressedBefore, 1u);
+
+    mock::SetBuildLog("");
+    Change("file:///kernel.cl", 3, "y");
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_EQ(messages.back()["params"]["version"], 3);
+    EXPECT_TRUE(messages.back()["params"]["diagnostics"].empty());
+}
+
+TEST_F(LSPServerTest, RebuildOnEffectiveConfigurationChanges)
+{
+    mock::SetBuildLog(
+        "<program source>:1:1: warning: first\n"
+        "<program source>:2:1: warning: second\n"
+        "<program source>:3:1: warning: third\n");
+    // answers the configuration request of the server, returns the number of problems published afterwards
+    const auto configure = [this](const json& buildOptions, int maxNumberOfProblems) {
+        Respond(ChangeConfiguration(), {buildOptions, maxNumberOfProblems, 0});
+        return messages.empty() ? -1 : static_cast<int>(messages.back()["params"]["diagnostics"].size());
+    };
+
+    auto initialize = BuildInitializeRequest();
+    initialize["params"]["capabilities"]["workspace"]["configuration"] = true;
+    Initialize(initialize);
+    Open("file:///kernel.cl", 1, "x");
+    ASSERT_EQ(mock::GetBuildCount(), 1u);
+
+    // an unchanged configuration keeps the results, a lower limit truncates them without building
+    EXPECT_EQ(configure(json::array(), 100), -1);
+    EXPECT_EQ(configure(json::array(), 2), 2);
+    EXPECT_EQ(mock::GetBuildCount(), 1u);
+    // the results were truncated by the previous limit, so a higher one needs a build
+    EXPECT_EQ(configure(json::array(), 10), 3);
+    EXPECT_EQ(mock::GetBuildCount(), 2u);
+    EXPECT_EQ(configure(json::array(), 20), -1);
+    EXPECT_EQ(configure({"-DVALUE=1"}, 20), -1);
+    EXPECT_EQ(mock::GetBuildCount(), 3u);
+    // the same options written differently and malformed options do not reach the compiler
+    EXPECT_EQ(configure({"  -D VALUE=1 "}, 20), -1);
+    configure({"-D"}, 20);
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_EQ(messages.front()["method"], "window/showMessage");
+    EXPECT_EQ(mock::GetBuildCount(), 3u);
+}
+
+TEST_F(LSPServerTest, PublishIncludedFilesFromOneBuild)
+{
+    CreateDirectory("opencl-ls-include-test");
+    std::filesystem::create_directories(directory / "include");
+    std::ofstream(directory / "kernel.cl") << "#include \"common.h\"";
+    std::ofstream(directory / "include" / "common.h") << "disk";
+    const auto uri = utils::PathToUri((directory / "kernel.cl").string());
+    const auto headerUri = utils::PathToUri((directory / "include" / "common.h").string());
+
+    // the emulated compiler reports the text of the first common.h in the search order
+    std::vector<std::string> overlayDirectories;
+    mock::SetBuildLogCallback([&overlayDirectories, this](const std::string&, const std::string& options) {
+        std::istringstream tokens(options);
+        std::string token;
+        while (tokens >> token)
+        {
+            const auto header = std::filesystem::path(token.substr(2)) / "common.h";
+            if (token.compare(0, 2, "-I") != 0 || !std::filesystem::exists(header))
+                continue;
+            if (token.substr(2) != (directory / "include").string())
+                overlayDirectories.push_back(token.substr(2));
+            std::ifstream file(header);
+            const std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            return "<program source>:1:1: warning: kernel\n" + header.string() + ":1:2: warning: " + text + "\n";
+        }
+        return std::string("<program source>:1:1: error: 'common.h' file not found\n");
+    });
+    const auto publishedMessage = [this](const std::string& documentUri) {
+        for (const auto& message : messages)
+        {
+            if (message["params"]["uri"] == documentUri && !message["params"]["diagnostics"].empty())
+                return message["params"]["diagnostics"][0]["message"].get<std::string>();
+        }
+        return std::string();
+    };
+
+    auto initialize = BuildInitializeRequest();
+    initialize["params"]["initializationOptions"]["configuration"]["buildOptions"] = {
+        "-I" + (directory / "include").string()};
+    Initialize(initialize);
+    Open(uri, 1, "#include \"common.h\"");
+    EXPECT_EQ(mock::GetBuildCount(), 1u);
+    ASSERT_EQ(messages.size(), 2u);
+    EXPECT_EQ(publishedMessage(uri), "kernel");
+    EXPECT_EQ(publishedMessage(headerUri), "disk");
+
+    // the includer is rebuilt with the edited header instead of the file
+    Open(headerUri, 1, "disk");
+    Change(headerUri, 2, "edited");
+    EXPECT_EQ(mock::GetBuildCount(), 2u);
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_EQ(publishedMessage(headerUri), "edited");
+    EXPECT_EQ(messages[0]["params"]["version"], 2);
+
+    // the overlay directory is kept between the builds and removed with the server
+    Change(headerUri, 3, "again");
+    EXPECT_EQ(publishedMessage(headerUri), "again");
+    ASSERT_EQ(overlayDirectories.size(), 2u);
+    EXPECT_EQ(overlayDirectories[0], overlayDirectories[1]);
+    // the overlay of a closed document is removed, the build reads the file again
+    Close(headerUri);
+    Change(uri, 2, "#include \"common.h\"");
+    EXPECT_EQ(publishedMessage(headerUri), "disk");
+    EXPECT_EQ(overlayDirectories.size(), 2u);
+    server.reset();
+    EXPECT_FALSE(std::filesystem::exists(overlayDirectories[0]));
+}
+
+TEST_F(LSPServerTest, PullDiagnostics)
+{
+    CreateDirectory("opencl-ls-pull-test");
+    std::ofstream(directory / "kernel.cl") << "#include \"common.h\"";
+    std::ofstream(directory / "common.h") << "";
+    const auto uri = utils::PathToUri((directory / "kernel.cl").string());
+    const auto headerUri = utils::PathToUri((directory / "common.h").string());
+    mock::SetBuildLog(
+        "<program source>:1:1: warning: kernel\n"
+        "common.h:1:1: warning: header\n");
+
+    auto initialize = BuildInitializeRequest();
+    initialize["params"]["capabilities"]["textDocument"]["diagnostic"] = json::object();
+    initialize["params"]["capabilities"]["workspace"]["diagnostics"] = {{"refreshSupport", true}};
+    Initialize(initialize);
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_TRUE(messages[0]["result"]["capabilities"].contains("diagnosticProvider"));
+    Open(uri, 1, "#include \"common.h\"");
+    EXPECT_TRUE(messages.empty());
+    EXPECT_EQ(mock::GetBuildCount(), 0u);
+
+    // the first pull builds the document, the problems of the header come as a related document
+    auto report = Pull(uri);
+    EXPECT_EQ(mock::GetBuildCount(), 1u);
+    EXPECT_EQ(report["kind"], "full");
+    ASSERT_EQ(report["items"].size(), 1u);
+    EXPECT_EQ(report["items"][0]["message"], "kernel");
+    ASSERT_TRUE(report["relatedDocuments"].contains(headerUri));
+    EXPECT_EQ(report["relatedDocuments"][headerUri]["kind"], "full");
+    EXPECT_EQ(report["relatedDocuments"][headerUri]["items"][0]["message"], "header");
+    const auto resultId = report["resultId"].get<std::string>();
+
+    // the cached report is unchanged for the client that has it
+    report = Pull(uri, resultId);
+    EXPECT_EQ(report, json({{"kind", "unchanged"}, {"resultId", resultId}}));
+    EXPECT_EQ(Pull(uri, "outdated")["kind"], "full");
+    EXPECT_EQ(mock::GetBuildCount(), 1u);
+
+    Send(
+        {{"jsonrpc", "2.0"},
+         {"id", 2},
+         {"method", "workspace/diagnostic"},
+         {"params", {{"previousResultIds", {{{"uri", uri}, {"value", resultId}}}}}}});
+    ASSERT_EQ(messages.size(), 1u);
+    std::map<std::string, json> items;
+    for (const auto& item : messages[0]["result"]["items"])
+        items[item["uri"].get<std::string>()] = item;
+    ASSERT_EQ(items.size(), 2u);
+    EXPECT_EQ(items[uri]["kind"], "unchanged");
+    EXPECT_EQ(items[uri]["version"], 1);
+    EXPECT_EQ(items[headerUri]["kind"], "full");
+    EXPECT_TRUE(items[headerUri]["version"].is_null());
+
+    // opening or editing the header invalidates the report of its includer, the client is asked to pull it again
+    const auto refreshed = [this] {
+        if (messages.size() != 1 || messages[0]["method"] != "workspace/diagnostic/refresh")
+            return false;
+        Respond(messages[0]["id"], nullptr);
+        return true;
+    };
+    Open(headerUri, 1, "");
+    EXPECT_TRUE(refreshed());
+    EXPECT_EQ(Pull(uri, resultId)["kind"], "unchanged");
+    EXPECT_EQ(mock::GetBuildCount(), 2u);
+    mock::SetBuildLog("<program source>:1:1: warning: kernel\n");
+    Change(headerUri, 2, ";");
+    EXPECT_TRUE(refreshed());
+    report = Pull(uri, resultId);
+    EXPECT_EQ(mock::GetBuildCount(), 3u);
+    EXPECT_EQ(report["kind"], "full");
+    EXPECT_TRUE(report["relatedDocuments"].is_null());
+    EXPECT_TRUE(Pull(headerUri)["items"].empty());
+}
+
+TEST_F(LSPServerTest, RefreshPulledDiagnosticsOnConfigurationChanges)
+{
+    mock::SetBuildLog(
+        "<program source>:1:1: warning: first\n"
+        "<program source>:2:1: warning: second\n");
+    // answers the configuration request of the server, returns the methods of the requests sent afterwards
+    const auto configure = [this](const json& buildOptions, int maxNumberOfProblems) {
+        Respond(ChangeConfiguration(), {buildOptions, maxNumberOfProblems, 0});
+        std::vector<std::string> methods;
+        for (const auto& message : messages)
+            methods.push_back(message.value("method", ""));
+        // the refresh is answered, so the next one is sent
+        for (const auto& message : std::vector<json>(messages))
+            Respond(message["id"], nullptr);
+        return methods;
+    };
+    const std::string uri = "file:///refresh/kernel.cl";
+    const std::vector<std::string> refresh = {"workspace/diagnostic/refresh"};
+
+    auto initialize = BuildInitializeRequest();
+    initialize["params"]["capabilities"]["workspace"]["configuration"] = true;
+    initialize["params"]["capabilities"]["workspace"]["diagnostics"] = {{"refreshSupport", true}};
+    initialize["params"]["capabilities"]["textDocument"]["diagnostic"] = json::object();
+    Initialize(initialize);
+    Open(uri, 1, "x");
+    EXPECT_EQ(Pull(uri)["items"].size(), 2u);
+    EXPECT_EQ(mock::GetBuildCount(), 1u);
+
+    // the invalidated results are rebuilt on the next pull, which the client is asked for
+    EXPECT_EQ(configure({"-DVALUE=1"}, 100), refresh);
+    EXPECT_EQ(Pull(uri)["items"].size(), 2u);
+    EXPECT_EQ(mock::GetBuildCount(), 2u);
+    EXPECT_EQ(configure({"-DVALUE=1"}, 1), refresh);
+    EXPECT_EQ(Pull(uri)["items"].size(), 1u);
+    EXPECT_EQ(mock::GetBuildCount(), 2u);
+    EXPECT_TRUE(configure({"-DVALUE=1"}, 1).empty());
+
+    // the responses are matched by id, a configuration answered before the pending refresh is applied
+    std::string buildOptions;
+    mock::SetBuildLogCallback([&buildOptions](const std::string&, const std::string& options) {
+        buildOptions = options;
+        return std::string("<program source>:1:1: warning: first\n");
+    });
+    Respond(ChangeConfiguration(), {{"-DVALUE=2"}, 1, 0});
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_EQ(messages[0]["method"], "workspace/diagnostic/refresh");
+    const auto refreshId = messages[0]["id"];
+    Respond(ChangeConfiguration(), {{"-DVALUE=3"}, 1, 0});
+    Respond(refreshId, nullptr);
+    EXPECT_EQ(Pull(uri)["items"].size(), 1u);
+    EXPECT_EQ(mock::GetBuildCount(), 3u);
+    EXPECT_EQ(buildOptions, "-DVALUE=3");
+
+    // nothing is left to refresh once the document is closed
+    Close(uri);
+    EXPECT_TRUE(configure({"-DVALUE=4"}, 1).empty());
+    EXPECT_EQ(mock::GetBuildCount(), 3u);
+}
+
+TEST_F(LSPServerTest, ReleaseUrisOfClosedDocuments)
+{
+    mock::SetBuildLog(
+        "<program source>:1:1: warning: unused variable 'a'\n"
+        "common.h:2:1: warning: unused variable 'b'\n");
+    // included files are only reported if they exist
+    CreateDirectory("opencl-ls-release-test");
+    std::ofstream(directory / "kernel.cl") << "x";
+    std::ofstream(directory / "common.h") << "";
+    const auto uri = utils::PathToUri((directory / "kernel.cl").string());
+    const auto headerUri = utils::PathToUri((directory / "common.h").string());
+    auto& pool = GetStringPool();
+
+    Initialize();
+    Open(uri, 1, "x");
+    EXPECT_TRUE(pool.Find(uri));
+    EXPECT_TRUE(pool.Find(headerUri));
+
+    // a request about an unknown document is answered without keeping its uri
+    const auto report = Pull("file:///release/unknown.cl");
+    EXPECT_EQ(report["kind"], "full");
+    EXPECT_TRUE(report["items"].empty());
+    EXPECT_FALSE(pool.Find("file:///release/unknown.cl"));
+
+    Close(uri);
+    EXPECT_FALSE(pool.Find(uri));
+    EXPECT_FALSE(pool.Find(headerUri));
+}
+
+TEST(CLInfoTest, ReportMockDevices)
+{
+    mock::Device gpu;
+    gpu.name = "Mock GPU";
+    mock::Device cpu;
+    cpu.name = "Mock CPU";
+    cpu.type = CL_DEVICE_TYPE_CPU;
+    mock::SetDevices({gpu, cpu});
+    const auto info = CreateCLInfo()->json();
+    mock::Reset();
+
+    ASSERT_EQ(info["PLATFORMS"].size(), 1u);
+    const auto& devices = info["PLATFORMS"][0]["DEVICES"];
+    ASSERT_EQ(devices.size(), 2u);
+    EXPECT_EQ(devices[0]["CL_DEVICE_NAME"], "Mock GPU");
+    EXPECT_EQ(devices[1]["CL_DEVICE_NAME"], "Mock CPU");
+    EXPECT_EQ(devices[1]["CL_DEVICE_TYPE"], json::array({"CL_DEVICE_TYPE_CPU"}));
+}
+
+TEST(SessionTest, RecordAndReplay)
+{
+    const auto path = (std::filesystem::temp_directory_path() / "opencl-ls-session-test.jsonl").string();
+    auto initialize = BuildInitializeRequest();
+    initialize["params"]["capabilities"]["workspace"] = {
+        {"configuration", true}, {"didChangeConfiguration", {{"dynamicRegistration", true}}}};
+    // the responses carry the ids of the requests of the recording server
+    const std::vector<json> messages = {
+        initialize,
+        {{"jsonrpc", "2.0"}, {"method", "initialized"}, {"params", json::object()}},
+        {{"jsonrpc", "2.0"}, {"id", "registration"}, {"result", nullptr}},
+        {{"jsonrpc", "2.0"}, {"method", "workspace/didChangeConfiguration"}, {"params", {{"settings", nullptr}}}},
+        {{"jsonrpc", "2.0"}, {"id", "configuration"}, {"result", {{"-DREPLAYED"}, 100, 0}}},
+        {{"jsonrpc", "2.0"},
+         {"method", "textDocument/didOpen"},
+         {"params",
+          {{"textDocument", {{"uri", "file:///replay.cl"}, {"version", 1}, {"text", "__kernel void f() {}"}}}}}},
+        {{"jsonrpc", "2.0"}, {"id", 1}, {"method", "shutdown"}, {"params", nullptr}},
+        {{"jsonrpc", "2.0"}, {"method", "exit"}, {"params", nullptr}},
+    };
+    // index of a client message -> the request the recording server sent after it
+    const std::map<size_t, json> serverRequests = {
+        {1, {{"jsonrpc", "2.0"}, {"id", "registration"}, {"method", "client/registerCapability"}}},
+        {3, {{"jsonrpc", "2.0"}, {"id", "configuration"}, {"method", "workspace/configuration"}}},
+    };
+    {
+        SessionRecorder recorder(path);
+        for (size_t i = 0; i < messages.size(); ++i)
+        {
+            // split within the header and the body
+            const auto request = BuildRequest(messages[i]);
+            for (size_t offset = 0; offset < request.size(); offset += 7)
+                recorder.RecordInput(request.data() + offset, std::min<size_t>(7, request.size() - offset));
+            if (serverRequests.count(i) > 0)
+                recorder.RecordOutput(BuildRequest(serverRequests.at(i)));
+        }
+        recorder.RecordOutput(BuildRequest(json {{"jsonrpc", "2.0"}, {"id", 1}, {"result", nullptr}}));
+    }
+
+    const auto frames = LoadSession(path);
+    std::filesystem::remove(path);
+    ASSERT_EQ(frames.size(), messages.size() + serverRequests.size() + 1);
+    std::vector<json> inbound;
+    for (const auto& frame : frames)
+    {
+        if (frame.inbound)
+            inbound.push_back(json::parse(frame.message));
+    }
+    EXPECT_EQ(inbound, messages);
+    EXPECT_FALSE(frames[2].inbound);
+    EXPECT_FALSE(frames.back().inbound);
+
+    // the configuration only reaches the build if its response is matched with the request of the replaying server
+    mock::SetBuildLogCallback([](const std::string&, const std::string& options) {
+        return options.find("-DREPLAYED") != std::string::npos ? "<program source>:1:1: warning: replayed\n" : "";
+    });
+    std::vector<json> responses;
+    const auto report = ReplaySession(frames, 0, [&responses](const std::string& message) {
+        responses.push_back(json::parse(message.substr(message.find("\r\n\r\n") + 4)));
+    });
+    mock::Reset();
+    EXPECT_EQ(report["exitCode"], 0);
+    EXPECT_EQ(report["input"]["messages"], messages.size());
+    EXPECT_EQ(report["output"]["messages"], responses.size());
+    EXPECT_EQ(report["latency"]["all"]["count"], messages.size());
+    EXPECT_EQ(report["latency"]["initialize"]["count"], 1);
+
+    ASSERT_EQ(responses.size(), 5u);
+    EXPECT_EQ(responses[0]["id"], 0);
+    EXPECT_TRUE(responses[0]["result"].contains("capabilities"));
+    EXPECT_EQ(responses[1]["method"], "client/registerCapability");
+    EXPECT_EQ(responses[2]["method"], "workspace/configuration");
+    EXPECT_EQ(responses[3]["method"], "textDocument/publishDiagnostics");
+    ASSERT_EQ(responses[3]["params"]["diagnostics"].size(), 1u);
+    EXPECT_EQ(responses[3]["params"]["diagnostics"][0]["message"], "replayed");
+    EXPECT_EQ(responses[4], (json {{"jsonrpc", "2.0"}, {"id", 1}, {"result", nullptr}}));
+
+    // a session cut before 'exit' has no exit code
+    const std::vector<SessionFrame> unfinished(frames.begin(), frames.begin() + 2);
+    EXPECT_TRUE(ReplaySession(unfinished, 0)["exitCode"].is_null());
+}
+
+TEST(SessionTest, ReplayResponsesByMethod)
+{
+    auto initialize = BuildInitializeRequest();
+    initialize["params"]["capabilities"]["workspace"]["configuration"] = true;
+    initialize["params"]["capabilities"]["workspace"]["diagnostics"] = {{"refreshSupport", true}};
+    initialize["params"]["capabilities"]["textDocument"]["diagnostic"] = json::object();
+    const json didChangeConfiguration = {
+        {"jsonrpc", "2.0"}, {"method", "workspace/didChangeConfiguration"}, {"params", json::object()}};
+    const json pull = {
+        {"jsonrpc", "2.0"},
+        {"id", 1},
+        {"method", "textDocument/diagnostic"},
+        {"params", {{"textDocument", {{"uri", "file:///replay.cl"}}}}}};
+    // the client answers the second configuration request before the refresh that was sent first
+    const std::vector<std::pair<bool, json>> messages = {
+        {true, initialize},
+        {true,
+         {{"jsonrpc", "2.0"},
+          {"method", "textDocument/didOpen"},
+          {"params", {{"textDocument", {{"uri", "file:///replay.cl"}, {"version", 1}, {"text", "x"}}}}}}},
+        {true, pull},
+        {true, didChangeConfiguration},
+        {false, {{"jsonrpc", "2.0"}, {"id", "first"}, {"method", "workspace/configuration"}}},
+        {true, {{"jsonrpc", "2.0"}, {"id", "first"}, {"result", {{"-DFIRST"}, 100, 0}}}},
+        {false, {{"jsonrpc", "2.0"}, {"id", "refresh"}, {"method", "workspace/diagnostic/refresh"}}},
+        {true, didChangeConfiguration},
+        {false, {{"jsonrpc", "2.0"}, {"id", "second"}, {"method", "workspace/configuration"}}},
+        {true, {{"jsonrpc", "2.0"}, {"id", "second"}, {"result", {{"-DSECOND"}, 100, 0}}}},
+        {true, {{"jsonrpc", "2.0"}, {"id", "refresh"}, {"result", nullptr}}},
+        {true, pull},
+    };
+    std::vector<SessionFrame> frames;
+    for (const auto& [inbound, message] : messages)
+        frames.push_back({0, inbound, message.dump(), {}});
+
+    std::vector<std::string> buildOptions;
+    mock::SetBuildLogCallback([&buildOptions](const std::string&, const std::string& options) {
+        buildOptions.push_back(options);
+        return std::string();
+    });
+    ReplaySession(frames, 0);
+    mock::Reset();
+    EXPECT_EQ(buildOptions, (std::vector<std::string> {"", "-DSECOND=1"}));
+}
+
+TEST(SessionTest, RecordBinaryMessages)
+{
+    const auto path = (std::filesystem::temp_directory_path() / "opencl-ls-binary-session-test.jsonl").string();
+    const std::vector<json> messages = {
+        BuildInitializeRequest(),
+        {{"jsonrpc", "2.0"}, {"id", 1}, {"method", "shutdown"}, {"params", nullptr}},
+        {{"jsonrpc", "2.0"}, {"method", "exit"}, {"params", nullptr}},
+    };
+    const auto frame = [](const json& message) {
+        const auto body = json::to_cbor(message);
+        std::string request = "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        request.append("content-type: application/cbor\r\n\r\n").append(body.begin(), body.end());
+        return request;
+    };
+    {
+        SessionRecorder recorder(path);
+        for (const auto& message : messages)
+        {
+            const auto request = frame(message);
+            recorder.RecordInput(request.data(), request.size());
+        }
+        recorder.RecordOutput(frame({{"jsonrpc", "2.0"}, {"id", 1}, {"result", nullptr}}));
+    }
+
+    const auto frames = LoadSession(path);
+    std::filesystem::remove(path);
+    ASSERT_EQ(frames.size(), messages.size() + 1);
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        EXPECT_EQ(frames[i].contentType, "application/cbor");
+        const auto expected =
+            i < messages.size() ? messages[i] : json {{"jsonrpc", "2.0"}, {"id", 1}, {"result", nullptr}};
+        EXPECT_EQ(json::from_cbor(frames[i].message), expected);
+    }
+
+    // the server answers in the encoding of the replayed messages
+    std::vector<json> responses;
+    const auto report = ReplaySession(frames, 0, [&responses](const std::string& message) {
+        EXPECT_NE(message.find("Content-Type: application/cbor"), std::string::npos);
+        responses.push_back(json::from_cbor(message.substr(message.find("\r\n\r\n") + 4)));
+    });
+    EXPECT_EQ(report["exitCode"], 0);
+    EXPECT_EQ(report["latency"]["initialize"]["count"], 1);
+    EXPECT_EQ(report["latency"]["shutdown"]["count"], 1);
+    ASSERT_EQ(responses.size(), 2u);
+    EXPECT_TRUE(responses[0]["result"].contains("capabilities"));
+    EXPECT_EQ(responses[1]["id"], 1);
+}
+
+TEST(TracingTest, WriteCompleteEvents)
+{
+    const auto path = (std::filesystem::temp_directory_path() / "opencl-ls-trace-test.json").string();
+    {
+        tracing::Span span("test", "disabled");
+    }
+    tracing::Start(path);
+    {
+        tracing::Span outer("test", "outer", "kernel \"1\".cl");
+        tracing::Span inner("test", "inner");
+    }
+    tracing::Stop();
+    {
+        tracing::Span span("test", "stopped");
+    }
+
+    std::ifstream file(path);
+    const auto events = json::parse(file);
+    file.close();
+    std::filesystem::remove(path);
+    ASSERT_TRUE(events.is_array());
+    ASSERT_EQ(events.size(), 3u);
+    EXPECT_EQ(events[0]["ph"], "M");
+    EXPECT_EQ(events[1]["name"], "inner");
+    EXPECT_EQ(events[2]["name"], "outer");
+    EXPECT_EQ(events[2]["ph"], "X");
+    EXPECT_EQ(events[2]["cat"], "test");
+    EXPECT_EQ(events[2]["args"]["detail"], "kernel \"1\".cl");
+    EXPECT_LE(events[2]["ts"].get<int64_t>(), events[1]["ts"].get<int64_t>());
+    EXPECT_GE(events[2]["dur"].get<int64_t>(), events[1]["dur"].get<int64_t>());
+}
+
+TEST(LoggingTest, FollowClientTrace)
+{
+    const auto path = (std::filesystem::temp_directory_path() / "opencl-ls-logging-test.log").string();
+    logging::Options options;
+    options.fileLogging = true;
+    options.filename = path;
+    options.level = spdlog::level::warn;
+    // the handle is cached before the logging is configured, the way the modules get theirs
+    auto& logger = logging::Get<lspLogger>();
+    logging::Configure(options);
+    EXPECT_EQ(spdlog::get("lsp").get(), &logger);
+    const auto level = [&logger] { return logger.level(); };
+    EXPECT_EQ(level(), spdlog::level::warn);
+    logger.warn("written through the cached handle");
+    logger.flush();
+    std::ifstream file(path);
+    const std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    EXPECT_NE(text.find("written through the cached handle"), std::string::npos);
+    logging::SetTrace("messages");
+    EXPECT_EQ(level(), spdlog::level::debug);
+    logging::SetTrace("verbose");
+    EXPECT_EQ(level(), spdlog::level::trace);
+    logging::SetTrace("off");
+    EXPECT_EQ(level(), spdlog::level::warn);
+
+    // nothing is logged without file logging, whatever the client asks for
+    options.fileLogging = false;
+    logging::Configure(options);
+    EXPECT_EQ(level(), spdlog::level::off);
+    logging::SetTrace("verbose");
+    EXPECT_EQ(level(), spdlog::level::off);
+    std::error_code error;
+    std::filesystem::remove(path, error);
+}
+
+TEST(MetricsTest, CountAcrossThreads)
+{
+    const auto countBefore = metrics::GetSnapshot()["histograms"]["build"]["count"].get<uint64_t>();
+    const auto bytesBefore = metrics::Get(metrics::Counter::BytesReceived);
+    const auto record = [] {
+        for (int i = 0; i < 500; ++i)
+        {
+            metrics::Record(metrics::Histogram::Build, std::chrono::seconds(5));
+            metrics::Increment(metrics::Counter::BytesReceived, 2);
+            metrics::CountMessage(metrics::Direction::Received, "test/metrics");
+        }
+    };
+    std::thread thread(record);
+    record();
+    thread.join();
+
+    EXPECT_EQ(metrics::Get(metrics::Counter::BytesReceived) - bytesBefore, 2000u);
+    EXPECT_EQ(metrics::GetMessageCount(metrics::Direction::Received, "test/metrics"), 1000u);
+    EXPECT_EQ(metrics::GetMessageCount(metrics::Direction::Sent, "test/metrics"), 0u);
+    const auto p50 = metrics::GetPercentile(metrics::Histogram::Build, 50);
+    EXPECT_GE(p50, 5000000u);
+    EXPECT_LE(p50, 5000000u * 17 / 16);
+
+    const auto snapshot = metrics::GetSnapshot();
+    EXPECT_EQ(snapshot["histograms"]["build"]["count"].get<uint64_t>() - countBefore, 1000u);
+    EXPECT_EQ(snapshot["histograms"]["build"]["max"], 5000000u);
+    EXPECT_EQ(snapshot["messages"]["received"]["test/metrics"], 1000u);
+    EXPECT_TRUE(snapshot["gauges"].contains("outgoingQueue"));
+}
+
+#if defined(__linux__)
+TEST(DaemonTest, ServeIsolatedClients)
+{
+    const auto path = (std::filesystem::temp_directory_path() / "opencl-ls-daemon-test.sock").string();
+    auto daemon = CreateDaemon(path);
+    std::thread thread([&daemon] { daemon->Run(); });
+    // only the user running the daemon can connect
+    EXPECT_EQ(std::filesystem::status(path).permissions() & std::filesystem::perms::all,
+              std::filesystem::perms::owner_read | std::filesystem::perms::owner_write);
+
+    const std::vector<std::string> uris = {"file:///first.cl", "file:///second.cl"};
+    std::vector<int> clients;
+    for (const auto& uri : uris)
+    {
+        const int fd = ConnectTo(path);
+        ASSERT_GE(fd, 0);
+        clients.push_back(fd);
+        SendTo(fd, BuildInitializeRequest());
+        SendTo(
+            fd,
+            {{"jsonrpc", "2.0"},
+             {"method", "textDocument/didOpen"},
+             {"params", {{"textDocument", {{"uri", uri}, {"version", 1}, {"text", "__kernel void f() {}"}}}}}});
+    }
+
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        std::string buffer;
+        EXPECT_EQ(ReceiveFrom(clients[i], buffer)["id"], 0);
+        const auto published = ReceiveFrom(clients[i], buffer);
+        EXPECT_EQ(published["method"], "textDocument/publishDiagnostics");
+        EXPECT_EQ(published["params"]["uri"], uris[i]);
+
+        SendTo(clients[i], {{"jsonrpc", "2.0"}, {"id", 1}, {"method", "shutdown"}, {"params", nullptr}});
+        SendTo(clients[i], {{"jsonrpc", "2.0"}, {"method", "exit"}, {"params", nullptr}});
+        EXPECT_EQ(ReceiveFrom(clients[i], buffer)["id"], 1);
+        // the daemon closes the connection after 'exit'
+        EXPECT_TRUE(ReceiveFrom(clients[i], buffer).is_null());
+        close(clients[i]);
+    }
+
+    daemon->Stop();
+    thread.join();
+    daemon.reset();
+    EXPECT_FALSE(std::filesystem::exists(path));
+}
+
+TEST(DaemonTest, BuildWhileServingOtherClients)
+{
+    using namespace std::chrono;
+    constexpr auto latency = milliseconds(1000);
+    mock::SetBuildLatency(latency);
+    const auto path = (std::filesystem::temp_directory_path() / "opencl-ls-daemon-build-test.sock").string();
+    auto daemon = CreateDaemon(path);
+    std::thread thread([&daemon] { daemon->Run(); });
+
+    const int building = ConnectTo(path);
+    ASSERT_GE(building, 0);
+    std::string buildingBuffer;
+    SendTo(building, BuildInitializeRequest());
+    SendTo(
+        building,
+        {{"jsonrpc", "2.0"},
+         {"method", "textDocument/didOpen"},
+         {"params",
+          {{"textDocument", {{"uri", "file:///slow.cl"}, {"version", 1}, {"text", "__kernel void f() {}"}}}}}});
+    const auto start = steady_clock::now();
+    EXPECT_EQ(ReceiveFrom(building, buildingBuffer)["id"], 0);
+
+    // the other client is answered while the build runs
+    const int idle = ConnectTo(path);
+    ASSERT_GE(idle, 0);
+    std::string idleBuffer;
+    SendTo(idle, BuildInitializeRequest());
+    SendTo(idle, {{"jsonrpc", "2.0"}, {"id", 1}, {"method", "$/ocls/stats"}, {"params", nullptr}});
+    EXPECT_EQ(ReceiveFrom(idle, idleBuffer)["id"], 0);
+    EXPECT_EQ(ReceiveFrom(idle, idleBuffer)["id"], 1);
+    EXPECT_LT(steady_clock::now() - start, latency / 2);
+    EXPECT_EQ(ReceiveFrom(building, buildingBuffer)["method"], "textDocument/publishDiagnostics");
+    EXPECT_GE(steady_clock::now() - start, latency);
+
+    for (const int fd : {building, idle})
+    {
+        SendTo(fd, {{"jsonrpc", "2.0"}, {"method", "exit"}, {"params", nullptr}});
+        close(fd);
+    }
+    daemon->Stop();
+    thread.join();
+    mock::Reset();
+}
+
+TEST(DaemonTest, TcpBackpressure)
+{
+    DaemonOptions options;
+    options.receiveBufferSize = 4096;
+    options.sendBufferSize = 4096;
+    options.maxPendingOutput = 1024;
+    options.tokenFile = (std::filesystem::temp_directory_path() / "opencl-ls-daemon-test.token").string();
+    auto daemon = CreateDaemon(0, options);
+    ASSERT_NE(daemon->GetPort(), 0);
+    std::thread thread([&daemon] { daemon->Run(); });
+    const auto pausedBefore = metrics::Get(metrics::Counter::PausedInputs);
+
+    const int fd = ConnectTo(daemon->GetPort());
+    ASSERT_GE(fd, 0);
+    // every response is larger than the limit, so the daemon keeps pausing the input
+    // while the responses are not read
+    constexpr int requestsCount = 200;
+    std::string requests;
+    std::getline(std::ifstream(options.tokenFile), requests);
+    EXPECT_EQ(requests.size(), 32u);
+    requests += "\r\n" + BuildRequest(BuildInitializeRequest());
+    for (int id = 1; id <= requestsCount; ++id)
+        requests += BuildRequest({{"jsonrpc", "2.0"}, {"id", id}, {"method", "$/ocls/stats"}, {"params", nullptr}});
+    std::thread writer([fd, &requests] {
+        size_t offset = 0;
+        while (offset < requests.size())
+        {
+            const auto size = write(fd, requests.data() + offset, requests.size() - offset);
+            if (size <= 0)
+                return;
+            offset += static_cast<size_t>(size);
+        }
+    });
+
+    // the responses are not read until the daemon stops reading the requests
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (metrics::Get(metrics::Counter::PausedInputs) == pausedBefore && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_GT(metrics::Get(metrics::Counter::PausedInputs), pausedBefore);
+
+    std::string buffer;
+    for (int id = 0; id <= requestsCount; ++id)
+        ASSERT_EQ(ReceiveFrom(fd, buffer)["id"], id);
+    writer.join();
+
+    SendTo(fd, {{"jsonrpc", "2.0"}, {"id", 1}, {"method", "shutdown"}, {"params", nullptr}});
+    SendTo(fd, {{"jsonrpc", "2.0"}, {"method", "exit"}, {"params", nullptr}});
+    EXPECT_EQ(ReceiveFrom(fd, buffer)["id"], 1);
+    EXPECT_TRUE(ReceiveFrom(fd, buffer).is_null());
+    close(fd);
+
+    daemon->Stop();
+    thread.join();
+}
+
+TEST(DaemonTest, TcpRejectWrongToken)
+{
+    EXPECT_THROW(CreateDaemon(0), std::runtime_error);
+
+    DaemonOptions options;
+    options.tokenFile = (std::filesystem::temp_directory_path() / "opencl-ls-daemon-token-test.token").string();
+    auto daemon = CreateDaemon(0, options);
+    // only the user running the daemon can read the token
+    EXPECT_EQ(std::filesystem::status(options.tokenFile).permissions() & std::filesystem::perms::all,
+              std::filesystem::perms::owner_read | std::filesystem::perms::owner_write);
+    std::thread thread([&daemon] { daemon->Run(); });
+    const auto rejectedBefore = metrics::Get(metrics::Counter::RejectedClients);
+
+    std::string token;
+    std::getline(std::ifstream(options.tokenFile), token);
+    for (const auto& line : {std::string(token.size(), '0'), token + token, std::string()})
+    {
+        const int fd = ConnectTo(daemon->GetPort());
+        ASSERT_GE(fd, 0);
+        const auto request = line + "\n" + BuildRequest(BuildInitializeRequest());
+        ASSERT_EQ(write(fd, request.data(), request.size()), static_cast<ssize_t>(request.size()));
+        std::string buffer;
+        EXPECT_TRUE(ReceiveFrom(fd, buffer).is_null());
+        close(fd);
+    }
+    EXPECT_EQ(metrics::Get(metrics::Counter::RejectedClients) - rejectedBefore, 3u);
+
+    daemon->Stop();
+    thread.join();
+    daemon.reset();
+    EXPECT_FALSE(std::filesystem::exists(options.tokenFile));
+}
+#endif
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     auto sink = std::make_shared<spdlog::sinks::null_sink_st>();
@@ -0,0 +1,535 @@
+//
+//  main.cpp
+//  opencl-language-server-loadgen
+//
+
+#include <CLI/CLI.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace nlohmann;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Every build reports the unused variable, inserted lines move it, so each edit changes the diagnostics.
+constexpr char defaultKernel[] = R"(__kernel void scale(__global const float* input, __global float* output)
+{
+    int unused;
+    const size_t i = get_global_id(0);
+    output[i] = input[i] * 2.0f;
+}
+)";
+
+struct Options
+{
+    std::string server;
+    std::vector<std::string> serverArgs;
+    std::string kernelFile;
+    size_t clients = 1;
+    size_t documents = 4;
+    double typingRate = 5.0;
+    double duration = 10.0;
+    double configurationInterval = 0.0;
+};
+
+struct ClientReport
+{
+    std::vector<int64_t> latencies;
+    uint64_t edits = 0;
+    uint64_t published = 0;
+    uint64_t superseded = 0;
+    uint64_t errors = 0;
+    uint64_t configurationChanges = 0;
+    long maxRSS = 0; // kilobytes
+    double cpuTime = 0.0;
+    int exitCode = -1;
+};
+
+int64_t ToMicroseconds(Clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+std::string Frame(const json& message)
+{
+    const auto body = message.dump();
+    return "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+json GetLatencyStats(std::vector<int64_t> latencies)
+{
+    if (latencies.empty())
+        return {{"count", 0}};
+
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&latencies](double p) {
+        const auto rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(latencies.size())));
+        return latencies[rank > 0 ? rank - 1 : 0];
+    };
+    return {
+        {"count", latencies.size()},
+        {"p50", percentile(50)},
+        {"p95", percentile(95)},
+        {"p99", percentile(99)},
+        {"max", latencies.back()},
+    };
+}
+
+class Client
+{
+public:
+    Client(const Options& options, size_t index, const std::string& kernel)
+        : m_options {options}
+        , m_index {index}
+        , m_kernel {kernel}
+    {}
+
+    ClientReport Run()
+    {
+        Spawn();
+        std::thread reader([this] { Read(); });
+
+        Initialize();
+        for (size_t i = 0; i < m_options.documents; ++i)
+            Open(i);
+
+        const auto start = Clock::now();
+        const auto end = start + std::chrono::duration<double>(m_options.duration);
+        const auto editInterval = std::chrono::duration<double>(1.0 / m_options.typingRate);
+        auto nextEdit = start;
+        auto nextConfiguration = start + std::chrono::duration<double>(m_options.configurationInterval);
+        size_t edit = 0;
+        while (nextEdit < end && m_running)
+        {
+            std::this_thread::sleep_until(nextEdit);
+            Change(edit % m_options.documents, edit);
+            ++edit;
+            nextEdit += std::chrono::duration_cast<Clock::duration>(editInterval);
+            if (m_options.configurationInterval > 0 && Clock::now() >= nextConfiguration)
+            {
+                ChangeConfiguration();
+                nextConfiguration += std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(m_options.configurationInterval));
+            }
+        }
+
+        Shutdown();
+        reader.join();
+        Wait();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& [uri, document] : m_documents)
+            m_report.superseded += document.sent.size();
+        return m_report;
+    }
+
+private:
+    struct Document
+    {
+        int64_t version = 0;
+        // version -> time the change was sent, removed once diagnostics for it or a later version arrive
+        std::map<int64_t, Clock::time_point> sent;
+    };
+
+    void Spawn()
+    {
+        int input[2];
+        int output[2];
+        if (pipe(input) != 0 || pipe(output) != 0)
+            throw std::runtime_error("Failed to create pipes");
+
+        m_pid = fork();
+        if (m_pid < 0)
+            throw std::runtime_error("Failed to start the server");
+        if (m_pid == 0)
+        {
+            dup2(input[0], STDIN_FILENO);
+            dup2(output[1], STDOUT_FILENO);
+            const int devNull = open("/dev/null", O_WRONLY);
+            if (devNull >= 0)
+                dup2(devNull, STDERR_FILENO);
+            close(input[0]);
+            close(input[1]);
+            close(output[0]);
+            close(output[1]);
+
+            std::vector<char*> args;
+            args.push_back(const_cast<char*>(m_options.server.c_str()));
+            for (auto& arg : m_options.serverArgs)
+                args.push_back(const_cast<char*>(arg.c_str()));
+            args.push_back(nullptr);
+            execv(m_options.server.c_str(), args.data());
+            _exit(127);
+        }
+        close(input[0]);
+        close(output[1]);
+        m_in = input[1];
+        m_out = output[0];
+    }
+
+    void Wait()
+    {
+        close(m_in);
+        close(m_out);
+        int status = 0;
+        rusage usage {};
+        if (wait4(m_pid, &status, 0, &usage) < 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_report.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#if defined(__APPLE__)
+        m_report.maxRSS = usage.ru_maxrss / 1024;
+#else
+        m_report.maxRSS = usage.ru_maxrss;
+#endif
+        const auto seconds = [](const timeval& time) {
+            return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_usec) / 1e6;
+        };
+        m_report.cpuTime = seconds(usage.ru_utime) + seconds(usage.ru_stime);
+    }
+
+    void Send(const json& message)
+    {
+        const auto frame = Frame(message);
+        // server requests are answered from the reader thread
+        std::lock_guard<std::mutex> lock(m_sendMutex);
+        size_t written = 0;
+        while (written < frame.size())
+        {
+            const auto result = write(m_in, frame.data() + written, frame.size() - written);
+            if (result <= 0)
+            {
+                m_running = false;
+                return;
+            }
+            written += static_cast<size_t>(result);
+        }
+    }
+
+    std::string GetUri(size_t document) const
+    {
+        return "file:///loadgen/client" + std::to_string(m_index) + "/kernel" + std::to_string(document) + ".cl";
+    }
+
+    json GetConfiguration() const
+    {
+        // alternate the problems limit, so every configuration change is an actual change
+        return json::array({json::array(), m_configurationChanges % 2 == 0 ? 100 : 99, 0});
+    }
+
+    void Initialize()
+    {
+        Send(
+            {{"jsonrpc", "2.0"},
+             {"id", m_nextId++},
+             {"method", "initialize"},
+             {"params",
+              {{"processId", getpid()},
+               {"trace", "off"},
+               {"capabilities",
+                {{"workspace",
+                  {{"configuration", true}, {"didChangeConfiguration", {{"dynamicRegistration", true}}}}}}},
+               {"initializationOptions",
+                {{"configuration",
+                  {{"buildOptions", json::array()}, {"maxNumberOfProblems", 100}, {"deviceID", 0}}}}}}}});
+        Send({{"jsonrpc", "2.0"}, {"method", "initialized"}, {"params", json::object()}});
+    }
+
+    void Open(size_t document)
+    {
+        const auto uri = GetUri(document);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_documents[uri].sent[0] = Clock::now();
+        }
+        Send(
+            {{"jsonrpc", "2.0"},
+             {"method", "textDocument/didOpen"},
+             {"params", {{"textDocument", {{"uri", uri}, {"languageId", "opencl"}, {"version", 0}, {"text", m_kernel}}}}}});
+    }
+
+    void Change(size_t document, size_t edit)
+    {
+        const auto uri = GetUri(document);
+        int64_t version = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto& state = m_documents[uri];
+            version = ++state.version;
+            state.sent[version] = Clock::now();
+            ++m_report.edits;
+        }
+        std::string text;
+        for (size_t i = 0; i <= edit / m_options.documents % 32; ++i)
+            text.append("// edit\n");
+        text.append(m_kernel);
+        Send(
+            {{"jsonrpc", "2.0"},
+             {"method", "textDocument/didChange"},
+             {"params",
+              {{"textDocument", {{"uri", uri}, {"version", version}}},
+               {"contentChanges", json::array({{{"text", std::move(text)}}})}}}});
+    }
+
+    void ChangeConfiguration()
+    {
+        ++m_configurationChanges;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_report.configurationChanges;
+        }
+        Send({{"jsonrpc", "2.0"}, {"method", "workspace/didChangeConfiguration"}, {"params", {{"settings", nullptr}}}});
+    }
+
+    void Shutdown()
+    {
+        m_shutdownId = m_nextId++;
+        Send({{"jsonrpc", "2.0"}, {"id", m_shutdownId.load()}, {"method", "shutdown"}, {"params", nullptr}});
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_shutdownCondition.wait_for(lock, std::chrono::seconds(30), [this] { return m_shutdownReceived; });
+        lock.unlock();
+        Send({{"jsonrpc", "2.0"}, {"method", "exit"}, {"params", nullptr}});
+    }
+
+    void Read()
+    {
+        std::string buffer;
+        char chunk[64 * 1024];
+        while (true)
+        {
+            const auto result = read(m_out, chunk, sizeof(chunk));
+            if (result <= 0)
+                break;
+            buffer.append(chunk, static_cast<size_t>(result));
+            size_t offset = 0;
+            while (true)
+            {
+                const auto headerEnd = buffer.find("\r\n\r\n", offset);
+                if (headerEnd == std::string::npos)
+                    break;
+                const auto lengthPos = buffer.find("Content-Length: ", offset);
+                if (lengthPos == std::string::npos || lengthPos > headerEnd)
+                {
+                    offset = headerEnd + 4;
+                    continue;
+                }
+                const auto length = std::stoul(buffer.substr(lengthPos + 16, headerEnd - lengthPos - 16));
+                if (buffer.size() < headerEnd + 4 + length)
+                    break;
+                Handle(json::parse(buffer.begin() + headerEnd + 4, buffer.begin() + headerEnd + 4 + length, nullptr, false));
+                offset = headerEnd + 4 + length;
+            }
+            buffer.erase(0, offset);
+        }
+        m_running = false;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_shutdownReceived = true;
+        m_shutdownCondition.notify_all();
+    }
+
+    void Handle(const json& message)
+    {
+        if (!message.is_object())
+            return;
+
+        const auto now = Clock::now();
+        if (message.contains("method") && message["method"].is_string())
+        {
+            const auto method = message["method"].get<std::string>();
+            if (method == "textDocument/publishDiagnostics")
+            {
+                OnPublishDiagnostics(message["params"], now);
+            }
+            else if (message.contains("id"))
+            {
+                // server requests: workspace/configuration and client/registerCapability
+                json result = method == "workspace/configuration" ? GetConfiguration() : json();
+                Send({{"jsonrpc", "2.0"}, {"id", message["id"]}, {"result", result}});
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (message.contains("error"))
+            ++m_report.errors;
+        if (message.contains("id") && message["id"] == m_shutdownId.load())
+        {
+            m_shutdownReceived = true;
+            m_shutdownCondition.notify_all();
+        }
+    }
+
+    void OnPublishDiagnostics(const json& params, Clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_report.published;
+        const auto document = m_documents.find(params.value("uri", ""));
+        if (document == m_documents.end() || !params.contains("version"))
+            return;
+
+        auto& sent = document->second.sent;
+        const auto version = params["version"].get<int64_t>();
+        const auto published = sent.find(version);
+        if (published == sent.end())
+            return;
+        m_report.latencies.push_back(ToMicroseconds(now - published->second));
+        // the earlier versions were not published, their builds were superseded or dropped
+        m_report.superseded += static_cast<uint64_t>(std::distance(sent.begin(), published));
+        sent.erase(sent.begin(), std::next(published));
+    }
+
+private:
+    const Options& m_options;
+    const size_t m_index;
+    const std::string& m_kernel;
+    pid_t m_pid = -1;
+    int m_in = -1;
+    int m_out = -1;
+    std::atomic<bool> m_running {true};
+    std::atomic<int64_t> m_nextId {0};
+    std::atomic<int64_t> m_shutdownId {-1};
+    std::mutex m_sendMutex;
+    std::mutex m_mutex;
+    std::condition_variable m_shutdownCondition;
+    bool m_shutdownReceived = false;
+    std::map<std::string, Document> m_documents;
+    std::atomic<size_t> m_configurationChanges {0};
+    ClientReport m_report;
+};
+
+std::string LoadKernel(const std::string& path)
+{
+    if (path.empty())
+        return defaultKernel;
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error("Failed to open '" + path + "'");
+    std::stringstream stream;
+    stream << file.rdbuf();
+    return stream.str();
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    CLI::App app {"OpenCL Language Server load generator"};
+    app.add_option("-s,--server", options.server, "Path to the server executable")->required();
+    app.add_option("-a,--server-args", options.serverArgs, "Arguments passed to the server")->required(false);
+    app.add_option("-c,--clients", options.clients, "Number of simulated editors, each runs its own server")
+        ->check(CLI::PositiveNumber)
+        ->capture_default_str();
+    app.add_option("-d,--documents", options.documents, "Number of documents each client opens")
+        ->check(CLI::PositiveNumber)
+        ->capture_default_str();
+    app.add_option("-r,--typing-rate", options.typingRate, "Edits per second per client")
+        ->check(CLI::PositiveNumber)
+        ->capture_default_str();
+    app.add_option("-t,--duration", options.duration, "Seconds of typing")
+        ->check(CLI::NonNegativeNumber)
+        ->capture_default_str();
+    app.add_option(
+           "--configuration-interval",
+           options.configurationInterval,
+           "Seconds between configuration changes, 0 disables them")
+        ->check(CLI::NonNegativeNumber)
+        ->capture_default_str();
+    app.add_option("-k,--kernel", options.kernelFile, "OpenCL source used for the documents")->required(false);
+    CLI11_PARSE(app, argc, argv);
+
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::string kernel;
+    try
+    {
+        kernel = LoadKernel(options.kernelFile);
+    }
+    catch (const std::exception& err)
+    {
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<ClientReport> reports(options.clients);
+    std::vector<std::thread> threads;
+    const auto start = Clock::now();
+    for (size_t i = 0; i < options.clients; ++i)
+    {
+        threads.emplace_back([&, i] {
+            try
+            {
+                reports[i] = Client(options, i, kernel).Run();
+            }
+            catch (const std::exception& err)
+            {
+                std::cerr << "Client " << i << " failed: " << err.what() << std::endl;
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    const auto duration = ToMicroseconds(Clock::now() - start);
+
+    ClientReport total;
+    long rssSum = 0;
+    for (auto& report : reports)
+    {
+        total.latencies.insert(total.latencies.end(), report.latencies.begin(), report.latencies.end());
+        total.edits += report.edits;
+        total.published += report.published;
+        total.superseded += report.superseded;
+        total.errors += report.errors;
+        total.configurationChanges += report.configurationChanges;
+        total.maxRSS = std::max(total.maxRSS, report.maxRSS);
+        total.cpuTime += report.cpuTime;
+        rssSum += report.maxRSS;
+    }
+
+    const json result = {
+        {"clients", options.clients},
+        {"documents", options.documents},
+        {"duration", duration},
+        {"edits", total.edits},
+        {"configurationChanges", total.configurationChanges},
+        {"published", total.published},
+        {"superseded", total.superseded},
+        {"errors", total.errors},
+        {"publishLatency", GetLatencyStats(std::move(total.latencies))},
+        {"server",
+         {{"maxRSS", total.maxRSS},
+          {"averageMaxRSS", rssSum / static_cast<long>(options.clients)},
+          {"cpuTime", total.cpuTime},
+          {"exitCodes", [&reports] {
+               json codes = json::array();
+               for (auto& report : reports)
+                   codes.push_back(report.exitCode);
+               return codes;
+           }()}}},
+    };
+    std::cout << result.dump() << std::endl;
+    return EXIT_SUCCESS;
+}